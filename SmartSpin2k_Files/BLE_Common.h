@@ -19,6 +19,8 @@
 // #include "BLE_Wattbike_Service.h"
 // #include "BLE_SB20_Service.h"
 #include "Constants.h"
+#include "ControlPointQueue.h"
+#include "BLE_Update_Scheduler.h"
 
 // Client size allocated to the queue for receiving characteristic data
 #define NOTIFY_DATA_QUEUE_SIZE   25
@@ -85,10 +87,29 @@ class MyServerCallbacks : public NimBLEServerCallbacks {
   bool onConnParamsUpdateRequest(uint16_t handle, const ble_gap_upd_params* params);
 };
 
+// What the services encode, taken once at the start of every BLE server tick so all characteristics
+// sent in a tick agree with each other and the derived values are only worked out once
+struct SpinBLESnapshot {
+  unsigned long takenAt;  // millis()
+  int power;              // W
+  float cadence;          // rpm
+  int heartRate;          // bpm
+  bool heartMonitorConnected;
+  double speed;           // km/h, the simulated speed when one is set, otherwise estimated from power
+  int resistance;         // as reported by the bike, or estimated from the stepper position
+  long int wheelRevolutions;    // cumulative, after this tick's update
+  double lastWheelEventTime;    // 1/1024 s
+  long int crankRevolutions;    // cumulative, after this tick's update
+  double lastCrankEventTime;    // 1/1024 s
+};
+
 // TODO add the rest of the server to this class
 class SpinBLEServer {
  private:
+  SpinBLESnapshot snapshot = {};
+  void takeSnapshot();
   void updateWheelAndCrankRev();
+  int calculateResistanceFromPosition();
   // Helper Function to clean up the BLE Services
 
  public:
@@ -96,10 +117,15 @@ class SpinBLEServer {
   NimBLEServer* pServer = nullptr;
   void notifyShift();
   double calculateSpeed();
+  static double speedFromPower(double watts);
+  // This tick's values, read only. Services encode from it rather than from rtConfig.
+  const SpinBLESnapshot& getSnapshot() const { return snapshot; }
+  // Runs the service updates, see startBLEServer()
+  BLEUpdateScheduler updateScheduler;
   void update();
   int connectedClientCount();
-  // Queue to store writes to any of the callbacks to the server
-  std::queue<std::string> writeCache;
+  // FTMS control point writes from BLE and DirCon clients, carried out by BLE_Fitness_Machine_Service::processFTMSWrite()
+  ControlPointQueue controlPointQueue;
 };
 
 class MyCharacteristicCallbacks : public NimBLECharacteristicCallbacks {
@@ -113,6 +139,7 @@ class MyCharacteristicCallbacks : public NimBLECharacteristicCallbacks {
 extern SpinBLEServer spinBLEServer;
 // extern BLE_Wattbike_Service wattbikeService;
 
+// Call on the task that runs spinBLEServer.update(), it becomes the DirCon notification producer
 void startBLEServer();
 void logCharacteristic(char* buffer, const size_t bufferCapacity, const byte* data, const size_t dataLength, const NimBLEUUID serviceUUID, const NimBLEUUID charUUID,
                        const char* format, ...);
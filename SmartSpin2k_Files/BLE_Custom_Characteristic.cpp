@@ -81,12 +81,38 @@ This characteristic allows for reading and writing various user configuration pa
      - ASCII for "MyDevice": 0x4D, 0x79, 0x44, 0x65, 0x76, 0x69, 0x63, 0x65
      - Response: 0x80, 0x07, 0x4D, 0x79, 0x44, 0x65, 0x76, 0x69, 0x63, 0x65
 
+5. DirCon Statistics (0x2E):
+   - Read command: 0x01, 0x2E, page (0 if left out)
+   - Response: 0x80, 0x2E, page, page count, then up to 16 bytes of the
+     DirConManager::encodeDiagnostics() block from page * 16 on, so each page fits the default MTU.
+     Read pages 0 to page count - 1 and join them for the whole block, or read the DirCon stats
+     characteristic, which returns the same bytes in one long read.
+
+6. DirCon Capture (0x2F):
+   - Write command: 0x02, 0x2F, 0x01 starts recording DirCon traffic, 0x02, 0x2F, 0x00 stops and
+     writes the capture to Serial as hex lines for tools/DirConReplay.cpp
+   - Read command: 0x01, 0x2F
+   - Response: 0x80, 0x2F, 0x01 while recording, 0x00 otherwise
+
 */
 
 #include <BLE_Common.h>
 #include <Power_Table.h>
 #include <BLE_Custom_Characteristic.h>
 #include <Constants.h>
+#include <DirConManager.h>
+#include "BLE_Handle_Table.h"
+#include <algorithm>
+
+// Not yet in BLE_Custom_Characteristic.h's list of variables
+#ifndef BLE_dirConStats
+#define BLE_dirConStats 0x2E
+#endif
+#ifndef BLE_dirConCapture
+#define BLE_dirConCapture 0x2F
+#endif
+
+#define DIRCON_STATS_PAGE_BYTES 16  // diagnostics bytes per 0x2E response, 4 byte header + 16 = default MTU - 3
 
 void BLE_ss2kCustomCharacteristic::setupService(NimBLEServer *pServer) {
   pSmartSpin2kService = spinBLEServer.pServer->createService(SMARTSPIN2K_SERVICE_UUID);
@@ -94,7 +120,10 @@ void BLE_ss2kCustomCharacteristic::setupService(NimBLEServer *pServer) {
       pSmartSpin2kService->createCharacteristic(SMARTSPIN2K_CHARACTERISTIC_UUID, NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::INDICATE | NIMBLE_PROPERTY::NOTIFY);
   smartSpin2kCharacteristic->setValue(ss2kCustomCharacteristicValue, sizeof(ss2kCustomCharacteristicValue));
   smartSpin2kCharacteristic->setCallbacks(new ss2kCustomCharacteristicCallbacks());
+  DirConManager::setupDiagnosticsCharacteristic(pSmartSpin2kService);
   pSmartSpin2kService->start();
+  BLEHandleTable::registerService(BLEHandle::SmartSpin2kService, pSmartSpin2kService);
+  BLEHandleTable::registerCharacteristic(BLEHandle::SmartSpin2kCharacteristic, smartSpin2kCharacteristic);
 }
 
 void BLE_ss2kCustomCharacteristic::update() {}
@@ -133,11 +162,10 @@ void BLE_ss2kCustomCharacteristic::notify(char _item, int tableRow) {
 }
 
 void BLE_ss2kCustomCharacteristic::process(std::string rxValue) {
-  // Find the Characteristic
-  if (NimBLEDevice::getServer()->getServiceByUUID(SMARTSPIN2K_SERVICE_UUID) == nullptr) {
+  NimBLECharacteristic *pCharacteristic = BLEHandleTable::getCharacteristic(BLEHandle::SmartSpin2kCharacteristic);
+  if (pCharacteristic == nullptr) {
     return;
   }
-  NimBLECharacteristic *pCharacteristic = NimBLEDevice::getServer()->getServiceByUUID(SMARTSPIN2K_SERVICE_UUID)->getCharacteristic(SMARTSPIN2K_CHARACTERISTIC_UUID);
   uint8_t *pData                        = reinterpret_cast<uint8_t *>(&rxValue[0]);
 
 #ifdef CUSTOM_CHAR_DEBUG
@@ -814,6 +842,38 @@ void BLE_ss2kCustomCharacteristic::process(std::string rxValue) {
       }
       break;
 
+    case BLE_dirConStats: {  // 0x2E
+      LOG_BUF_APPEND("<-DirCon Stats");
+      if (rxValue[0] == cc_read) {
+        uint8_t stats[DIRCON_DIAGNOSTICS_LENGTH];
+        size_t length     = DirConManager::encodeDiagnostics(stats, sizeof(stats));
+        uint8_t pageCount = (uint8_t)((length + DIRCON_STATS_PAGE_BYTES - 1) / DIRCON_STATS_PAGE_BYTES);
+        uint8_t page      = (rxValue.length() > 2) ? (uint8_t)rxValue[2] : 0;
+        size_t offset     = std::min((size_t)page * DIRCON_STATS_PAGE_BYTES, length);
+        returnValue[0]    = cc_success;
+        returnString.assign(1, (char)page);
+        returnString += (char)pageCount;
+        returnString.append((char *)stats + offset, std::min(length - offset, (size_t)DIRCON_STATS_PAGE_BYTES));
+        LOG_BUF_APPEND(" (page %d of %d)", page, pageCount);
+      }
+      break;
+    }
+
+    case BLE_dirConCapture: {  // 0x2F
+      LOG_BUF_APPEND("<-DirCon Capture");
+      bool recording = DirConManager::isCapturing();
+      if (rxValue[0] == cc_write && rxValue.length() > 2) {
+        recording = rxValue[2] != 0;
+        DirConManager::requestCapture(recording);
+        LOG_BUF_APPEND(" (%s)", recording ? "start" : "stop and export");
+      }
+      if (rxValue[0] == cc_read || rxValue[0] == cc_write) {
+        returnValue[0] = cc_success;
+        returnString.assign(1, (char)recording);
+      }
+      break;
+    }
+
     default:
       LOG_BUF_APPEND("<-Unknown Characteristic");
       returnValue[0] = cc_error;
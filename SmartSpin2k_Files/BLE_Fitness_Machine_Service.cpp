@@ -6,10 +6,18 @@
  */
 #include "BLE_Fitness_Machine_Service.h"
 #include "DirConManager.h"
+#include "NotificationHub.h"
+#include "ControlPointLog.h"
+#include "BLE_Handle_Table.h"
 #include "Main.h"
 #include <Constants.h>
+#include <algorithm>
 #include <vector>
 
+std::atomic<int> BLE_Fitness_Machine_Service::minResistance(0);
+std::atomic<int> BLE_Fitness_Machine_Service::maxResistance(0);
+std::atomic<bool> BLE_Fitness_Machine_Service::targetPowerAvailable(false);
+
 BLE_Fitness_Machine_Service::BLE_Fitness_Machine_Service()
     : pFitnessMachineService(nullptr),
       fitnessMachineFeature(nullptr),
@@ -19,7 +27,8 @@ BLE_Fitness_Machine_Service::BLE_Fitness_Machine_Service()
       fitnessMachineResistanceLevelRange(nullptr),
       fitnessMachinePowerRange(nullptr),
       fitnessMachineInclinationRange(nullptr),
-      fitnessMachineTrainingStatus(nullptr) {}
+      fitnessMachineTrainingStatus(nullptr),
+      lastIndoorBikeDataTime(0) {}
 
 void BLE_Fitness_Machine_Service::setupService(NimBLEServer *pServer, MyCharacteristicCallbacks *chrCallbacks) {
   // Resistance, IPower, HeartRate
@@ -54,353 +63,370 @@ void BLE_Fitness_Machine_Service::setupService(NimBLEServer *pServer, MyCharacte
   fitnessMachineInclinationRange->setValue(ftmsInclinationRange, sizeof(ftmsInclinationRange));
   fitnessMachineIndoorBikeData->setCallbacks(chrCallbacks);
   fitnessMachineControlPoint->setCallbacks(chrCallbacks);
+  fitnessMachineStatusCharacteristic->setCallbacks(chrCallbacks);
+  fitnessMachineTrainingStatus->setCallbacks(chrCallbacks);
   pFitnessMachineService->start();
 
+  NotificationHub::registerCharacteristic(NotificationHubCharacteristic::FitnessMachineIndoorBikeData, fitnessMachineIndoorBikeData);
+  NotificationHub::registerCharacteristic(NotificationHubCharacteristic::FitnessMachineControlPoint, fitnessMachineControlPoint);
+  NotificationHub::registerCharacteristic(NotificationHubCharacteristic::FitnessMachineStatus, fitnessMachineStatusCharacteristic);
+  NotificationHub::registerCharacteristic(NotificationHubCharacteristic::FitnessMachineTrainingStatus, fitnessMachineTrainingStatus);
+  BLEHandleTable::registerService(BLEHandle::FitnessMachineService, pFitnessMachineService);
+  BLEHandleTable::registerCharacteristic(BLEHandle::FitnessMachineFeature, fitnessMachineFeature);
+  BLEHandleTable::registerCharacteristic(BLEHandle::FitnessMachineControlPoint, fitnessMachineControlPoint);
+  BLEHandleTable::registerCharacteristic(BLEHandle::FitnessMachineStatus, fitnessMachineStatusCharacteristic);
+  BLEHandleTable::registerCharacteristic(BLEHandle::FitnessMachineIndoorBikeData, fitnessMachineIndoorBikeData);
+  BLEHandleTable::registerCharacteristic(BLEHandle::FitnessMachineTrainingStatus, fitnessMachineTrainingStatus);
+  ControlPointLog::start();
+
   // Add service UUID to DirCon MDNS
   DirConManager::addBleServiceUuid(pFitnessMachineService->getUUID());
 }
 
 void BLE_Fitness_Machine_Service::update() {
-  std::vector<uint8_t> ftmsIndoorBikeData;
-
-  this->processFTMSWrite();
-
-  // Calculate Speed for FTMS
-  int speedFtmsUnit = 0;
-  if (rtConfig->getSimulatedSpeed() > 5) {
-    speedFtmsUnit = rtConfig->getSimulatedSpeed() * 100;
-  } else {
-    speedFtmsUnit = spinBLEServer.calculateSpeed() * 100;
+  // Don't encode anything unless a BLE or DirCon client is subscribed
+  if (!NotificationHub::hasSubscribers(NotificationHubCharacteristic::FitnessMachineIndoorBikeData)) {
+    resetIndoorBikeData();
+    return;
   }
 
-  // Rebuild ftmsIndoorBikeData vector with current values
-  ftmsIndoorBikeData.clear();
+  const SpinBLESnapshot &snapshot = spinBLEServer.getSnapshot();
+  int speedFtmsUnit                = snapshot.speed * 100;
 
   // Fitness Machine Indoor Bike Data Flags Setup
   FitnessMachineIndoorBikeDataFlags::Types ftmsIBDFlags = FitnessMachineIndoorBikeDataFlags::InstantaneousCadencePresent |
                                                           FitnessMachineIndoorBikeDataFlags::ResistanceLevelPresent | FitnessMachineIndoorBikeDataFlags::InstantaneousPowerPresent;
 
-  if (strcmp(userConfig->getConnectedHeartMonitor(), NONE) != 0) {
+  if (snapshot.heartMonitorConnected) {
     ftmsIBDFlags = ftmsIBDFlags | FitnessMachineIndoorBikeDataFlags::HeartRatePresent;
   }
 
-  // Add flags
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>(ftmsIBDFlags & 0xFF));
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>((ftmsIBDFlags >> 8) & 0xFF));
-
-  // Add speed
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>(speedFtmsUnit & 0xff));
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>(speedFtmsUnit >> 8));
-
-  // Add cadence. FTMS expects cadence in 0.5 RPM units
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>(static_cast<int>(rtConfig->cad.getValue() * 2) & 0xff));
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>(static_cast<int>(rtConfig->cad.getValue() * 2) >> 8));
-
-  // Add resistance
-  int resistanceValue;
-  // Check if bike has resistance reporting capability or resistance simulation enabled
-  bool hasResistanceReporting = (!rtConfig->resistance.getSimulate() && 
-                                (rtConfig->resistance.getTimestamp() > 0 && 
-                                 (millis() - rtConfig->resistance.getTimestamp()) < 5000));
-  
-  if (hasResistanceReporting) {
-    // Use reported resistance value
-    resistanceValue = rtConfig->resistance.getValue();
-  } else {
-    // Calculate resistance from stepper position for bikes that don't report resistance
-    resistanceValue = this->calculateResistanceFromPosition();
-    rtConfig->resistance.setValue(resistanceValue);
-    rtConfig->resistance.setSimulate(true); // Mark as simulated
-  }
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>(resistanceValue & 0xff));
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>(resistanceValue >> 8));
-
-  // Add power
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>(rtConfig->watts.getValue() & 0xff));
-  ftmsIndoorBikeData.push_back(static_cast<uint8_t>(rtConfig->watts.getValue() >> 8));
-
-  // Add heart rate if HRM is connected
-  if (strcmp(userConfig->getConnectedHeartMonitor(), NONE) != 0) {
-    ftmsIndoorBikeData.push_back(static_cast<uint8_t>(rtConfig->hr.getValue()));
+  // FTMS expects cadence in 0.5 RPM units
+  FtmsIndoorBikeDataValues values;
+  values.speed      = speedFtmsUnit;
+  values.cadence    = static_cast<int>(snapshot.cadence * 2);
+  values.resistance = snapshot.resistance;
+  values.power      = snapshot.power;
+  values.heartRate  = snapshot.heartRate;
+
+  FtmsIndoorBikeDataEncoder ftmsIndoorBikeData;
+  ftmsIndoorBikeData.encode(ftmsIBDFlags, values);
+
+  // Unchanged data only goes out as a keepalive, saving airtime and the work of notifying
+  unsigned long now = millis();
+  if (ftmsIndoorBikeData == lastIndoorBikeData && now - lastIndoorBikeDataTime < FTMS_IBD_KEEPALIVE_MS) {
+    return;
   }
+  lastIndoorBikeData     = ftmsIndoorBikeData;
+  lastIndoorBikeDataTime = now;
 
-  // Notify the cycling power measurement characteristic
-  // Need to set the value before notifying so that read works correctly.
-  fitnessMachineIndoorBikeData->setValue(ftmsIndoorBikeData.data(), ftmsIndoorBikeData.size());
-  fitnessMachineIndoorBikeData->notify();
-
-  // Also notify DirCon TCP clients about Indoor Bike Data
-  DirConManager::notifyCharacteristic(NimBLEUUID(FITNESSMACHINESERVICE_UUID), fitnessMachineIndoorBikeData->getUUID(), ftmsIndoorBikeData.data(), ftmsIndoorBikeData.size());
+  // Notify BLE and DirCon clients about Indoor Bike Data
+  NotificationHub::publish(NotificationHubCharacteristic::FitnessMachineIndoorBikeData, ftmsIndoorBikeData.data(), ftmsIndoorBikeData.size());
 
   const int kLogBufCapacity = 200;  // Data(30), Sep(data/2), Arrow(3), CharId(37), Sep(3), CharId(37), Sep(3), Name(10), Prefix(2), HR(7), SEP(1), CD(10), SEP(1), PW(8),
                                     // SEP(1), SD(7), Suffix(2), Nul(1), rounded up
   char logBuf[kLogBufCapacity];
   logCharacteristic(logBuf, kLogBufCapacity, ftmsIndoorBikeData.data(), ftmsIndoorBikeData.size(), FITNESSMACHINESERVICE_UUID, fitnessMachineIndoorBikeData->getUUID(),
-                    "FTMS(IBD)[ HR(%d) CD(%.2f) PW(%d) SD(%.2f) ]", rtConfig->hr.getValue() % 1000, fmodf(rtConfig->cad.getValue(), 1000.0), rtConfig->watts.getValue() % 10000,
+                    "FTMS(IBD)[ HR(%d) CD(%.2f) PW(%d) SD(%.2f) ]", snapshot.heartRate % 1000, fmodf(snapshot.cadence, 1000.0), snapshot.power % 10000,
                     fmodf((float)speedFtmsUnit / 100.0, 1000.0));
 }
 
+size_t FtmsIndoorBikeDataEncoder::encode(uint16_t flags, const FtmsIndoorBikeDataValues &values) {
+  flags &= kSupported;
+  length = 0;
+  put(flags);
+
+  // Instantaneous speed is present unless More Data is set
+  if (!(flags & FitnessMachineIndoorBikeDataFlags::MoreDataBit)) {
+    put(values.speed);
+  }
+  if (flags & FitnessMachineIndoorBikeDataFlags::InstantaneousCadencePresent) {
+    put(values.cadence);
+  }
+  if (flags & FitnessMachineIndoorBikeDataFlags::ResistanceLevelPresent) {
+    put(values.resistance);
+  }
+  if (flags & FitnessMachineIndoorBikeDataFlags::InstantaneousPowerPresent) {
+    put(values.power);
+  }
+  if (flags & FitnessMachineIndoorBikeDataFlags::HeartRatePresent) {
+    frame[length++] = values.heartRate;
+  }
+  return length;
+}
+
 // The things that happen when we receive a FitnessMachineControlPointProcedure from a Client.
 void BLE_Fitness_Machine_Service::processFTMSWrite() {
-  while (!spinBLEServer.writeCache.empty()) {
-    std::string rxValue = spinBLEServer.writeCache.front();
-    spinBLEServer.writeCache.pop();
-    if (rxValue == "") {
-      return;
+  publishControlPointLimits();
+
+  ControlPointQueue &queue = spinBLEServer.controlPointQueue;
+  const ControlPointCommand *command;
+  while ((command = queue.front()) != nullptr) {
+    if (command->length == 0) {
+      queue.pop();
+      break;
     }
-    std::vector<uint8_t> returnValue        = {FitnessMachineControlPointProcedure::ResponseCode, (uint8_t)rxValue[0], FitnessMachineControlPointResultCode::OpCodeNotSupported};
-    BLECharacteristic *pCharacteristic      = NimBLEDevice::getServer()->getServiceByUUID(FITNESSMACHINESERVICE_UUID)->getCharacteristic(FITNESSMACHINECONTROLPOINT_UUID);
-    std::vector<uint8_t> ftmsStatus         = {FitnessMachineStatus::ReservedForFutureUse};
-    std::vector<uint8_t> ftmsTrainingStatus = {0x00, FitnessMachineTrainingStatus::Other};
-
-    if (rxValue.length() >= 1) {
-      uint8_t *pData            = reinterpret_cast<uint8_t *>(&rxValue[0]);
-      int length                = rxValue.length();
-      const int kLogBufCapacity = (rxValue.length() * 2) + 60;  // largest comment is 48 VV
-      char logBuf[kLogBufCapacity];
-      int logBufLength = ss2k_log_hex_to_buffer(pData, length, logBuf, 0, kLogBufCapacity);
-      int port         = 0;
-
-      switch ((uint8_t)rxValue[0]) {
-        case FitnessMachineControlPointProcedure::RequestControl:
-          returnValue[2] = FitnessMachineControlPointResultCode::Success;
-          rtConfig->watts.setTarget(0);
-          rtConfig->setSimTargetWatts(false);
-          logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Control Request");
-          break;
-
-        case FitnessMachineControlPointProcedure::Reset: {
-          returnValue[2] = FitnessMachineControlPointResultCode::Success;
-          logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Reset");
-          ftmsStatus            = {FitnessMachineStatus::Reset};
-          ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::Idle;
-        } break;
-
-        case FitnessMachineControlPointProcedure::SetTargetInclination: {
-          rtConfig->setFTMSMode((uint8_t)rxValue[0]);
-          returnValue[2] = FitnessMachineControlPointResultCode::Success;
-          int16_t rawInclineTenthsPercent = (int16_t)((rxValue[2] << 8) | rxValue[1]); // signed 0.1% units
-          port                            = static_cast<int>(rawInclineTenthsPercent) * 10; // convert to 0.01% units
-          rtConfig->setTargetIncline(port);
-          logBufLength += snprintf(logBuf + logBufLength,
-                                   kLogBufCapacity - logBufLength,
-                                   "-> Incline Mode: %2f",
-                                   rtConfig->getTargetIncline() / 100);
-          ftmsStatus            = {FitnessMachineStatus::TargetInclineChanged, (uint8_t)rxValue[1], (uint8_t)rxValue[2]};
-          ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::ManualMode;
-        } break;
-
-        case FitnessMachineControlPointProcedure::SetTargetResistanceLevel: {
-          rtConfig->setFTMSMode((uint8_t)rxValue[0]);
-          int16_t requestedResistance = (int16_t)((rxValue[2] << 8) | rxValue[1]);
-
-          if (requestedResistance >= rtConfig->getMinResistance() && requestedResistance <= rtConfig->getMaxResistance()) {
-            rtConfig->resistance.setTarget(requestedResistance);
-            
-            // For bikes that don't report resistance, calculate stepper position from resistance level (0-100)
-            bool hasResistanceReporting = (!rtConfig->resistance.getSimulate() && 
-                                          (rtConfig->resistance.getTimestamp() > 0 && 
-                                           (millis() - rtConfig->resistance.getTimestamp()) < 5000));
+
+    // A target that is set again straight after is superseded, only the newer one is carried out. Only
+    // DirCon writes, those were answered already; a BLE client waits for the indication of each write.
+    const ControlPointCommand *next = queue.next();
+    bool superseded = command->source == ControlPointSource::DirCon && next != nullptr && next->length > 0 && next->data[0] == command->data[0] &&
+                      ControlPointQueue::isCoalescable(command->data[0]);
+    if (!superseded) {
+      processControlPointWrite(std::string((const char *)command->data, command->length));
+    }
+    uint32_t age = micros() - command->enqueuedAt;
+    if (age >= FTMS_CONTROL_POINT_SLOW_MICROS) {
+      SS2K_LOG(FMTS_SERVER_LOG_TAG, "Control point write %02x %s %lu us after it arrived", command->data[0], superseded ? "superseded" : "done", (unsigned long)age);
+    }
+    if (command->source == ControlPointSource::DirCon) {
+      DirConManager::controlPointWriteDone(*command, superseded);
+    }
+    queue.pop(superseded);
+  }
+}
+
+void BLE_Fitness_Machine_Service::processControlPointWrite(std::string rxValue) {
+  uint8_t response[CONTROL_POINT_RESPONSE_MAX];
+  size_t responseLength                   = controlPointResponse(reinterpret_cast<const uint8_t *>(rxValue.data()), rxValue.length(), response);
+  std::vector<uint8_t> returnValue        = {FitnessMachineControlPointProcedure::ResponseCode, (uint8_t)rxValue[0], FitnessMachineControlPointResultCode::OpCodeNotSupported};
+  std::vector<uint8_t> ftmsStatus         = {FitnessMachineStatus::ReservedForFutureUse};
+  std::vector<uint8_t> ftmsTrainingStatus = {0x00, FitnessMachineTrainingStatus::Other};
+  if (responseLength > 0) {
+    returnValue.assign(response, response + responseLength);
+  }
+  uint8_t result       = returnValue[2];
+  size_t writtenLength = rxValue.length();
+
+  if (rxValue.length() >= 1) {
+    int length = writtenLength;
+    // Parameters the write left out read as 0, as in controlPointResponse()
+    rxValue.resize(std::max(rxValue.length(), (size_t)CONTROL_POINT_MAX_LENGTH), '\0');
+    uint8_t *pData = reinterpret_cast<uint8_t *>(&rxValue[0]);
+    int port       = 0;
+
+    switch ((uint8_t)rxValue[0]) {
+      case FitnessMachineControlPointProcedure::RequestControl:
+        rtConfig->watts.setTarget(0);
+        rtConfig->setSimTargetWatts(false);
+        break;
+
+      case FitnessMachineControlPointProcedure::Reset: {
+        ftmsStatus            = {FitnessMachineStatus::Reset};
+        ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::Idle;
+      } break;
+
+      case FitnessMachineControlPointProcedure::SetTargetInclination: {
+        rtConfig->setFTMSMode((uint8_t)rxValue[0]);
+        int16_t rawInclineTenthsPercent = (int16_t)((rxValue[2] << 8) | rxValue[1]); // signed 0.1% units
+        port                            = static_cast<int>(rawInclineTenthsPercent) * 10; // convert to 0.01% units
+        rtConfig->setTargetIncline(port);
+        ftmsStatus            = {FitnessMachineStatus::TargetInclineChanged, (uint8_t)rxValue[1], (uint8_t)rxValue[2]};
+        ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::ManualMode;
+      } break;
+
+      case FitnessMachineControlPointProcedure::SetTargetResistanceLevel: {
+        rtConfig->setFTMSMode((uint8_t)rxValue[0]);
+        int16_t requestedResistance = (int16_t)((rxValue[2] << 8) | rxValue[1]);
+
+        if (result == FitnessMachineControlPointResultCode::Success) {
+          rtConfig->resistance.setTarget(requestedResistance);
+          
+          // For bikes that don't report resistance, calculate stepper position from resistance level (0-100)
+          bool hasResistanceReporting = (!rtConfig->resistance.getSimulate() && 
+                                        (rtConfig->resistance.getTimestamp() > 0 && 
+                                         (millis() - rtConfig->resistance.getTimestamp()) < 5000));
+          
+          if (!hasResistanceReporting) {
+            int32_t minPos, maxPos;
             
-            if (!hasResistanceReporting) {
-              int32_t minPos, maxPos;
-              
-              // Use homing values if available, otherwise use stepper min/max
-              if (userConfig->getHMin() != INT32_MIN && userConfig->getHMax() != INT32_MIN) {
-                minPos = userConfig->getHMin();
-                maxPos = userConfig->getHMax();
-              } else {
-                minPos = rtConfig->getMinStep();
-                maxPos = rtConfig->getMaxStep();
-              }
-              
-              // TODO: Implement calculation of target position from resistance percentage if resistance reporting is unavailable.
+            // Use homing values if available, otherwise use stepper min/max
+            if (userConfig->getHMin() != INT32_MIN && userConfig->getHMax() != INT32_MIN) {
+              minPos = userConfig->getHMin();
+              maxPos = userConfig->getHMax();
+            } else {
+              minPos = rtConfig->getMinStep();
+              maxPos = rtConfig->getMaxStep();
             }
             
-            returnValue[2] = FitnessMachineControlPointResultCode::Success;
-            logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Resistance Mode: %d", rtConfig->resistance.getTarget());
-          } else {
-            // Clamp the value if it's out of bounds
-            if (requestedResistance > rtConfig->getMaxResistance()) {
-              rtConfig->resistance.setTarget(rtConfig->getMaxResistance());
-            } else {  // requestedResistance < rtConfig->getMinResistance()
-              rtConfig->resistance.setTarget(rtConfig->getMinResistance());
-            }
-            returnValue[2] = FitnessMachineControlPointResultCode::InvalidParameter;
-            logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Resistance Request %d beyond limits", requestedResistance);
-          }
-
-          int16_t targetRes     = rtConfig->resistance.getTarget();
-          ftmsStatus            = {FitnessMachineStatus::TargetResistanceLevelChanged, (uint8_t)(targetRes & 0xff), (uint8_t)(targetRes >> 8)};
-          ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::ManualMode;
-        } break;
-
-        case FitnessMachineControlPointProcedure::SetTargetPower: {
-          rtConfig->setFTMSMode((uint8_t)rxValue[0]);
-          if (spinBLEClient.connectedPM || rtConfig->watts.getSimulate() || spinBLEClient.connectedCD) {
-            returnValue[2] = FitnessMachineControlPointResultCode::Success;  // 0x01;
-            rtConfig->watts.setTarget(bytes_to_u16(rxValue[2], rxValue[1]));
-            logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> ERG Mode Target: %d Current: %d Incline: %2f", rtConfig->watts.getTarget(),
-                                     rtConfig->watts.getValue(), rtConfig->getTargetIncline() / 100);
-            ftmsStatus            = {FitnessMachineStatus::TargetPowerChanged, (uint8_t)rxValue[1], (uint8_t)rxValue[2]};
-            ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::WattControl;  // 0x0C;
-            // Adjust set point for powerCorrectionFactor and send to FTMS server (if connected)
-            int adjustedTarget         = rtConfig->watts.getTarget() / userConfig->getPowerCorrectionFactor();
-            const uint8_t translated[] = {FitnessMachineControlPointProcedure::SetTargetPower, (uint8_t)(adjustedTarget % 256), (uint8_t)(adjustedTarget / 256)};
-            spinBLEClient.FTMSControlPointWrite(translated, 3);
-          } else {
-            returnValue[2] = FitnessMachineControlPointResultCode::OpCodeNotSupported;  // 0x02; no power meter connected, so no ERG
-            logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> ERG Mode: No Power Meter Connected");
+            // TODO: Implement calculation of target position from resistance percentage if resistance reporting is unavailable.
           }
-        } break;
-
-        case FitnessMachineControlPointProcedure::StartOrResume: {
-          returnValue[2] = FitnessMachineControlPointResultCode::Success;  // 0x01;
-          logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Start Training");
-          ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::WarmingUp;
-          ftmsStatus            = {FitnessMachineStatus::StartedOrResumedByUser};
-        } break;
-
-        case FitnessMachineControlPointProcedure::StopOrPause: {
-          returnValue[2] = FitnessMachineControlPointResultCode::Success;
-
-          uint8_t controlParam = (rxValue.length() > 1) ? rxValue[1] : 0x01; 
-          ftmsStatus = {FitnessMachineStatus::StoppedOrPausedByUser, controlParam};
-          if (controlParam == 0x01) {  // Stop
-            logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Stop Training");
-            ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::Idle;
-          } else if (controlParam == 0x02) {  // Pause
-            logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Pause Training");
-            ftmsTrainingStatus = fitnessMachineTrainingStatus->getValue();
+        } else {
+          // Clamp the value if it's out of bounds
+          if (requestedResistance > rtConfig->getMaxResistance()) {
+            rtConfig->resistance.setTarget(rtConfig->getMaxResistance());
+          } else {  // requestedResistance < rtConfig->getMinResistance()
+            rtConfig->resistance.setTarget(rtConfig->getMinResistance());
           }
+        }
 
-        } break;
-
-        case FitnessMachineControlPointProcedure::SetIndoorBikeSimulationParameters: {  // sim mode
-          rtConfig->setFTMSMode((uint8_t)rxValue[0]);
-          returnValue[2] = FitnessMachineControlPointResultCode::Success;  // 0x01;
-          signed char buf[2];
-          // int16_t windSpeed        = (rxValue[2] << 8) + rxValue[1];
-          buf[0] = rxValue[3];  // (Least significant byte)
-          buf[1] = rxValue[4];  // (Most significant byte)
-          // int8_t rollingResistance = rxValue[5];
-          // int8_t windResistance    = rxValue[6];
-          port = bytes_to_u16(buf[1], buf[0]);
-          rtConfig->setTargetIncline(port);
-          logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Sim Mode Incline %2f", rtConfig->getTargetIncline() / 100);
-          ftmsStatus = {FitnessMachineStatus::IndoorBikeSimulationParametersChanged,
-                        (uint8_t)rxValue[1],
-                        (uint8_t)rxValue[2],
-                        (uint8_t)rxValue[3],
-                        (uint8_t)rxValue[4],
-                        (uint8_t)rxValue[5],
-                        (uint8_t)rxValue[6]};
-
-          ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::ManualMode;
-          spinBLEClient.FTMSControlPointWrite(pData, length);
-        } break;
-
-        case FitnessMachineControlPointProcedure::SpinDownControl: {
-          rtConfig->setFTMSMode((uint8_t)rxValue[0]);
-
-          // The response parameter for a successful spin down command.
-          // Values are Target Speed Low and Target Speed High in km/h with a resolution of 0.01.
-          // Example: 8.00 km/h (0x0320) and 24.00 km/h (0x0960)
-          uint8_t responseParams[] = {0x20, 0x03, 0x60, 0x09};
-
-          // Build the complete, correct response in a single vector
-          returnValue = {FitnessMachineControlPointProcedure::ResponseCode, (uint8_t)rxValue[0], FitnessMachineControlPointResultCode::Success};
-
-          // Append the mandatory parameters for a successful spindown
-          returnValue.insert(returnValue.end(), std::begin(responseParams), std::end(responseParams));
-
-          logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Spin Down Requested");
-          ftmsStatus                 = {FitnessMachineStatus::SpinDownStatus, FitnessMachineStatus::SpinDown_SpinDownRequested};
-          ftmsTrainingStatus[1]      = FitnessMachineTrainingStatus::Other;
-          spinBLEServer.spinDownFlag = 2;
-        } break;
-
-        case FitnessMachineControlPointProcedure::SetTargetedCadence: {
-          rtConfig->setFTMSMode((uint8_t)rxValue[0]);
-          returnValue[2]    = FitnessMachineControlPointResultCode::Success;  // 0x01;
-          int targetCadence = bytes_to_u16(rxValue[2], rxValue[1]);
-          // rtConfig->setTargetCadence(targetCadence);
-          logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Target Cadence: %d ", targetCadence);
-          ftmsStatus            = {FitnessMachineStatus::TargetedCadenceChanged, (uint8_t)rxValue[1], (uint8_t)rxValue[2]};
-          ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::ManualMode;  // 0x00;
-        } break;
-
-        default: {
-          logBufLength += snprintf(logBuf + logBufLength, kLogBufCapacity - logBufLength, "-> Unsupported FTMS Request");
+        int16_t targetRes     = rtConfig->resistance.getTarget();
+        ftmsStatus            = {FitnessMachineStatus::TargetResistanceLevelChanged, (uint8_t)(targetRes & 0xff), (uint8_t)(targetRes >> 8)};
+        ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::ManualMode;
+      } break;
+
+      case FitnessMachineControlPointProcedure::SetTargetPower: {
+        rtConfig->setFTMSMode((uint8_t)rxValue[0]);
+        if (result == FitnessMachineControlPointResultCode::Success) {
+          rtConfig->watts.setTarget(bytes_to_u16(rxValue[2], rxValue[1]));
+          ftmsStatus            = {FitnessMachineStatus::TargetPowerChanged, (uint8_t)rxValue[1], (uint8_t)rxValue[2]};
+          ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::WattControl;  // 0x0C;
+          // Adjust set point for powerCorrectionFactor and send to FTMS server (if connected)
+          int adjustedTarget         = rtConfig->watts.getTarget() / userConfig->getPowerCorrectionFactor();
+          const uint8_t translated[] = {FitnessMachineControlPointProcedure::SetTargetPower, (uint8_t)(adjustedTarget % 256), (uint8_t)(adjustedTarget / 256)};
+          spinBLEClient.FTMSControlPointWrite(translated, 3);
+        }  // otherwise OpCodeNotSupported, no power meter connected, so no ERG
+      } break;
+
+      case FitnessMachineControlPointProcedure::StartOrResume: {
+        ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::WarmingUp;
+        ftmsStatus            = {FitnessMachineStatus::StartedOrResumedByUser};
+      } break;
+
+      case FitnessMachineControlPointProcedure::StopOrPause: {
+        uint8_t controlParam = (length > 1) ? rxValue[1] : 0x01;
+        ftmsStatus = {FitnessMachineStatus::StoppedOrPausedByUser, controlParam};
+        if (controlParam == 0x01) {  // Stop
+          ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::Idle;
+        } else if (controlParam == 0x02) {  // Pause
+          ftmsTrainingStatus = fitnessMachineTrainingStatus->getValue();
         }
+
+      } break;
+
+      case FitnessMachineControlPointProcedure::SetIndoorBikeSimulationParameters: {  // sim mode
+        rtConfig->setFTMSMode((uint8_t)rxValue[0]);
+        signed char buf[2];
+        // int16_t windSpeed        = (rxValue[2] << 8) + rxValue[1];
+        buf[0] = rxValue[3];  // (Least significant byte)
+        buf[1] = rxValue[4];  // (Most significant byte)
+        // int8_t rollingResistance = rxValue[5];
+        // int8_t windResistance    = rxValue[6];
+        port = bytes_to_u16(buf[1], buf[0]);
+        rtConfig->setTargetIncline(port);
+        ftmsStatus = {FitnessMachineStatus::IndoorBikeSimulationParametersChanged,
+                      (uint8_t)rxValue[1],
+                      (uint8_t)rxValue[2],
+                      (uint8_t)rxValue[3],
+                      (uint8_t)rxValue[4],
+                      (uint8_t)rxValue[5],
+                      (uint8_t)rxValue[6]};
+
+        ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::ManualMode;
+        spinBLEClient.FTMSControlPointWrite(pData, length);
+      } break;
+
+      case FitnessMachineControlPointProcedure::SpinDownControl: {
+        rtConfig->setFTMSMode((uint8_t)rxValue[0]);
+        // The response carries the target speeds, see controlPointResponse()
+        ftmsStatus                 = {FitnessMachineStatus::SpinDownStatus, FitnessMachineStatus::SpinDown_SpinDownRequested};
+        ftmsTrainingStatus[1]      = FitnessMachineTrainingStatus::Other;
+        spinBLEServer.spinDownFlag = 2;
+      } break;
+
+      case FitnessMachineControlPointProcedure::SetTargetedCadence: {
+        rtConfig->setFTMSMode((uint8_t)rxValue[0]);
+        // rtConfig->setTargetCadence(bytes_to_u16(rxValue[2], rxValue[1]));
+        ftmsStatus            = {FitnessMachineStatus::TargetedCadenceChanged, (uint8_t)rxValue[1], (uint8_t)rxValue[2]};
+        ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::ManualMode;  // 0x00;
+      } break;
+
+      default: {
       }
-      SS2K_LOG(FMTS_SERVER_LOG_TAG, "%s. Responding: %02x %02x %02x", logBuf, returnValue[0], returnValue[1], returnValue[2]);
-    } else {
-      SS2K_LOG(FMTS_SERVER_LOG_TAG, "App wrote nothing ");
-      SS2K_LOG(FMTS_SERVER_LOG_TAG, "assuming it's a Control request");
-      returnValue[2]        = FitnessMachineControlPointResultCode::Success;
-      ftmsStatus            = {FitnessMachineStatus::StartedOrResumedByUser};
-      ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::Other;  // 0x00;
     }
-    // not checking for subscription because a write request would have triggered this
-    fitnessMachineControlPoint->setValue(returnValue.data(), returnValue.size());
-    fitnessMachineControlPoint->notify();
-    if (fitnessMachineTrainingStatus->getValue() != ftmsTrainingStatus) {
-      fitnessMachineTrainingStatus->setValue(ftmsTrainingStatus);
-      fitnessMachineTrainingStatus->notify();
-      // Also notify DirCon TCP clients
-      DirConManager::notifyCharacteristic(NimBLEUUID(FITNESSMACHINESERVICE_UUID), fitnessMachineTrainingStatus->getUUID(), ftmsTrainingStatus.data(), ftmsTrainingStatus.size());
-    }
-    if (fitnessMachineStatusCharacteristic->getValue() != ftmsStatus) {
-      fitnessMachineStatusCharacteristic->setValue(ftmsStatus);
-      fitnessMachineStatusCharacteristic->notify();
-      // Also notify DirCon TCP clients
-      DirConManager::notifyCharacteristic(NimBLEUUID(FITNESSMACHINESERVICE_UUID), fitnessMachineStatusCharacteristic->getUUID(), ftmsStatus.data(), ftmsStatus.size());
+  } else {
+    // App wrote nothing, assume it's a Control request
+    returnValue[2]        = FitnessMachineControlPointResultCode::Success;
+    ftmsStatus            = {FitnessMachineStatus::StartedOrResumedByUser};
+    ftmsTrainingStatus[1] = FitnessMachineTrainingStatus::Other;  // 0x00;
+  }
+  // Record the outcome for ControlPointLog to format later, off this task
+  ControlPointLogEvent logEvent;
+  logEvent.timestamp = micros();
+  logEvent.opCode    = returnValue[1];
+  logEvent.result    = returnValue[2];
+  logEvent.length    = std::min(writtenLength, (size_t)UINT8_MAX);
+  memset(logEvent.params, 0, sizeof(logEvent.params));
+  if (writtenLength > 1) {
+    memcpy(logEvent.params, rxValue.data() + 1, std::min(writtenLength - 1, sizeof(logEvent.params)));
+  }
+  logEvent.resistanceTarget = rtConfig->resistance.getTarget();
+  logEvent.powerTarget      = rtConfig->watts.getTarget();
+  logEvent.power            = rtConfig->watts.getValue();
+  logEvent.incline          = rtConfig->getTargetIncline();
+  ControlPointLog::record(logEvent);
+
+  // Indicate the response to BLE and DirCon clients, then any status change
+  NotificationHub::publish(NotificationHubCharacteristic::FitnessMachineControlPoint, returnValue.data(), returnValue.size());
+  if (fitnessMachineTrainingStatus->getValue() != ftmsTrainingStatus) {
+    NotificationHub::publish(NotificationHubCharacteristic::FitnessMachineTrainingStatus, ftmsTrainingStatus.data(), ftmsTrainingStatus.size());
+  }
+  if (fitnessMachineStatusCharacteristic->getValue() != ftmsStatus) {
+    NotificationHub::publish(NotificationHubCharacteristic::FitnessMachineStatus, ftmsStatus.data(), ftmsStatus.size());
+  }
+}
+
+void BLE_Fitness_Machine_Service::publishControlPointLimits() {
+  minResistance        = rtConfig->getMinResistance();
+  maxResistance        = rtConfig->getMaxResistance();
+  targetPowerAvailable = spinBLEClient.connectedPM || rtConfig->watts.getSimulate() || spinBLEClient.connectedCD;
+}
+
+// Every result code processControlPointWrite() answers with is decided here. A DirCon write is answered
+// with this before it is carried out, from limits up to a tick old, so the result can still differ if
+// they change in between, e.g. the power meter disconnecting before a queued SetTargetPower runs.
+size_t BLE_Fitness_Machine_Service::controlPointResponse(const uint8_t *data, size_t length, uint8_t *response) {
+  if (length == 0) {
+    return 0;
+  }
+  uint8_t write[CONTROL_POINT_MAX_LENGTH] = {0};
+  memcpy(write, data, std::min(length, sizeof(write)));
+
+  response[0] = FitnessMachineControlPointProcedure::ResponseCode;
+  response[1] = write[0];
+  response[2] = FitnessMachineControlPointResultCode::Success;
+  switch (write[0]) {
+    case FitnessMachineControlPointProcedure::RequestControl:
+    case FitnessMachineControlPointProcedure::Reset:
+    case FitnessMachineControlPointProcedure::SetTargetInclination:
+    case FitnessMachineControlPointProcedure::StartOrResume:
+    case FitnessMachineControlPointProcedure::StopOrPause:
+    case FitnessMachineControlPointProcedure::SetIndoorBikeSimulationParameters:
+    case FitnessMachineControlPointProcedure::SetTargetedCadence:
+      break;
+
+    case FitnessMachineControlPointProcedure::SetTargetResistanceLevel: {
+      int16_t requestedResistance = (int16_t)((write[2] << 8) | write[1]);
+      if (requestedResistance < minResistance || requestedResistance > maxResistance) {
+        response[2] = FitnessMachineControlPointResultCode::InvalidParameter;
+      }
+    } break;
+
+    case FitnessMachineControlPointProcedure::SetTargetPower:
+      if (!targetPowerAvailable) {
+        response[2] = FitnessMachineControlPointResultCode::OpCodeNotSupported;
+      }
+      break;
+
+    case FitnessMachineControlPointProcedure::SpinDownControl: {
+      // The response parameters for a successful spin down command, Target Speed Low and Target Speed
+      // High in km/h with a resolution of 0.01: 8.00 km/h (0x0320) and 24.00 km/h (0x0960)
+      const uint8_t responseParams[] = {0x20, 0x03, 0x60, 0x09};
+      memcpy(response + 3, responseParams, sizeof(responseParams));
+      return 3 + sizeof(responseParams);
     }
 
-    // Also notify DirCon TCP clients
-    DirConManager::notifyCharacteristic(NimBLEUUID(FITNESSMACHINESERVICE_UUID), fitnessMachineControlPoint->getUUID(), returnValue.data(), returnValue.size());
+    default:
+      response[2] = FitnessMachineControlPointResultCode::OpCodeNotSupported;
   }
+  return 3;
 }
 
 bool BLE_Fitness_Machine_Service::spinDown(uint8_t response) {
   uint8_t spinStatus[2] = {FitnessMachineStatus::SpinDownStatus, response};
-  // Set the value of the characteristic
-  fitnessMachineStatusCharacteristic->setValue(spinStatus, sizeof(spinStatus));
-  // Notify the connected client
-  fitnessMachineStatusCharacteristic->notify();
+  // Set the value and notify BLE and DirCon clients
+  NotificationHub::publish(NotificationHubCharacteristic::FitnessMachineStatus, spinStatus, sizeof(spinStatus));
   SS2K_LOG(FMTS_SERVER_LOG_TAG, "Sent SpinDown Status: 0x%02X", response);
-  // Also notify DirCon TCP clients about the status change
-  DirConManager::notifyCharacteristic(NimBLEUUID(FITNESSMACHINESERVICE_UUID), fitnessMachineStatusCharacteristic->getUUID(), spinStatus, sizeof(spinStatus));
 
   return true;
 }
-
-// Calculate resistance from stepper position for bikes that don't natively report resistance
-int BLE_Fitness_Machine_Service::calculateResistanceFromPosition() {
-  int32_t currentPosition = ss2k->getCurrentPosition();
-  int32_t minPos, maxPos;
-  
-  // Use homing values if available, otherwise use stepper min/max
-  if (userConfig->getHMin() != INT32_MIN && userConfig->getHMax() != INT32_MIN) {
-    minPos = userConfig->getHMin();
-    maxPos = userConfig->getHMax();
-  } else {
-    minPos = rtConfig->getMinStep();
-    maxPos = rtConfig->getMaxStep();
-  }
-  
-  // Ensure we have valid range
-  if (maxPos <= minPos) {
-    return 50; // Default to mid-point resistance if range is invalid
-  }
-  
-  // Calculate resistance as percentage (0-100) based on position
-  int resistance = ((currentPosition - minPos) * 100) / (maxPos - minPos);
-  
-  // Clamp to valid range
-  if (resistance < 0) resistance = 0;
-  if (resistance > 100) resistance = 100;
-  
-  return resistance;
-}
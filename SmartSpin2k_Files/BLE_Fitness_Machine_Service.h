@@ -8,18 +8,68 @@
 #pragma once
 
 #include <NimBLEDevice.h>
+#include <array>
+#include <atomic>
 #include "BLE_Common.h"
 
+#define FTMS_CONTROL_POINT_SLOW_MICROS 20000  // control point writes waiting longer than this for the BLE server task are logged
+
+#ifndef FTMS_IBD_KEEPALIVE_MS
+#define FTMS_IBD_KEEPALIVE_MS 1000  // Indoor Bike Data that hasn't changed is sent this often, 0 sends it every tick
+#endif
+
+// Indoor Bike Data values, in FTMS units
+struct FtmsIndoorBikeDataValues {
+  uint16_t speed;      // 0.01 km/h
+  uint16_t cadence;    // 0.5 rpm
+  int16_t resistance;  // unitless
+  int16_t power;       // W
+  uint8_t heartRate;   // bpm
+};
+
+// Builds an Indoor Bike Data frame in a fixed buffer. The flags decide which fields are present and
+// so the layout, in the order FTMS defines. Only the fields SmartSpin2k has values for are supported,
+// the flags of any other field are cleared.
+class FtmsIndoorBikeDataEncoder {
+ public:
+  static constexpr size_t kMaxLength   = 11;  // flags, speed, cadence, resistance, power, heart rate
+  static constexpr uint16_t kSupported = 0x0265;  // More Data, cadence, resistance, power and heart rate, see FitnessMachineIndoorBikeDataFlags
+
+  FtmsIndoorBikeDataEncoder() : length(0) {}
+  size_t encode(uint16_t flags, const FtmsIndoorBikeDataValues &values);
+  const uint8_t *data() const { return frame.data(); }
+  size_t size() const { return length; }
+  bool operator==(const FtmsIndoorBikeDataEncoder &other) const { return length == other.length && memcmp(frame.data(), other.frame.data(), length) == 0; }
+
+ private:
+  std::array<uint8_t, kMaxLength> frame;
+  size_t length;
+  void put(uint16_t value) {
+    frame[length++] = value & 0xff;
+    frame[length++] = value >> 8;
+  }
+};
+
 class BLE_Fitness_Machine_Service {
  public:
   BLE_Fitness_Machine_Service();
   void setupService(NimBLEServer *pServer, MyCharacteristicCallbacks *chrCallbacks);
+  // Indoor Bike Data, at the rate BLEUpdateScheduler runs it. Control point writes are carried out by
+  // processFTMSWrite() every tick.
   void update();
+  // Forget the last Indoor Bike Data, so whoever subscribes next gets a frame straight away
+  void resetIndoorBikeData() { lastIndoorBikeData = FtmsIndoorBikeDataEncoder(); }
   bool spinDown(uint8_t response);
   void processFTMSWrite();
-  
+  void processControlPointWrite(std::string rxValue);
+  // The response to a control point write (ResponseCode, opcode, result code and any parameters, at
+  // most CONTROL_POINT_RESPONSE_MAX bytes), without carrying it out. Returns its length, 0 for an
+  // empty write. Parameters the write leaves out read as 0. processControlPointWrite() answers with
+  // this, and DirCon answers its clients with it before the write is carried out, so the two agree.
+  // Only reads the limits the BLE server task last published, so it is safe from any task.
+  static size_t controlPointResponse(const uint8_t *data, size_t length, uint8_t *response);
+
  private:
-  int calculateResistanceFromPosition();
   BLEService *pFitnessMachineService;
   BLECharacteristic *fitnessMachineFeature;
   BLECharacteristic *fitnessMachineIndoorBikeData;
@@ -29,6 +79,14 @@ class BLE_Fitness_Machine_Service {
   BLECharacteristic *fitnessMachinePowerRange;
   BLECharacteristic *fitnessMachineInclinationRange;
   BLECharacteristic *fitnessMachineTrainingStatus;
+  FtmsIndoorBikeDataEncoder lastIndoorBikeData;  // as last published, empty until then
+  unsigned long lastIndoorBikeDataTime;          // millis() of that
+
+  // What controlPointResponse() checks against, stored by processFTMSWrite() on the BLE server task
+  static std::atomic<int> minResistance;
+  static std::atomic<int> maxResistance;
+  static std::atomic<bool> targetPowerAvailable;  // ERG needs a power meter, a simulated one or cadence
+  void publishControlPointLimits();
 };
 
 extern BLE_Fitness_Machine_Service fitnessMachineService;
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "BLE_Handle_Table.h"
+
+NimBLEService* BLEHandleTable::services[BLEHandle::ServiceCount]                      = {};
+NimBLECharacteristic* BLEHandleTable::characteristics[BLEHandle::CharacteristicCount] = {};
+
+NimBLEService* BLEHandleTable::findService(const NimBLEUUID& uuid) {
+  for (NimBLEService* service : services) {
+    if (service != nullptr && service->getUUID() == uuid) {
+      return service;
+    }
+  }
+  NimBLEServer* server = NimBLEDevice::getServer();
+  return (server != nullptr) ? server->getServiceByUUID(uuid) : nullptr;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <NimBLEDevice.h>
+
+// Services and characteristics that are needed after setup
+struct BLEHandle {
+  enum Services : uint8_t {
+    FitnessMachineService = 0,
+    SmartSpin2kService,
+    HeartRateService,
+    CyclingPowerService,
+    CyclingSpeedCadenceService,
+    ServiceCount
+  };
+  enum Characteristics : uint8_t {
+    FitnessMachineFeature = 0,
+    FitnessMachineControlPoint,
+    FitnessMachineStatus,
+    FitnessMachineIndoorBikeData,
+    FitnessMachineTrainingStatus,
+    SmartSpin2kCharacteristic,
+    HeartRateMeasurement,
+    CyclingPowerMeasurement,
+    CSCMeasurement,
+    CharacteristicCount
+  };
+};
+
+// Service and characteristic pointers, filled in by each service's setupService() so the rest of the
+// firmware doesn't walk the server's service and characteristic lists comparing UUIDs at runtime.
+// Written once during setup and only read afterwards, so safe from any task.
+class BLEHandleTable {
+ public:
+  static void registerService(BLEHandle::Services id, NimBLEService* service) { services[id] = service; }
+  static void registerCharacteristic(BLEHandle::Characteristics id, NimBLECharacteristic* characteristic) { characteristics[id] = characteristic; }
+
+  // nullptr until the owning service has been set up
+  static NimBLEService* getService(BLEHandle::Services id) { return services[id]; }
+  static NimBLECharacteristic* getCharacteristic(BLEHandle::Characteristics id) { return characteristics[id]; }
+
+  // Any service of the server by UUID, only for the DirCon discovery requests, which name one. Everything
+  // else goes by handle. Registered services are checked first; the others, set up by services without
+  // an entry here, fall back to the server's list.
+  static NimBLEService* findService(const NimBLEUUID& uuid);
+
+ private:
+  static NimBLEService* services[BLEHandle::ServiceCount];
+  static NimBLECharacteristic* characteristics[BLEHandle::CharacteristicCount];
+};
@@ -19,6 +19,9 @@
 #include "BLE_Fitness_Machine_Service.h"
 #include "BLE_Custom_Characteristic.h"
 #include "BLE_Device_Information_Service.h"
+#include "DirConManager.h"
+#include "NotificationHub.h"
+#include "BLE_Handle_Table.h"
 
 // BLE Server Settings
 SpinBLEServer spinBLEServer;
@@ -34,6 +37,36 @@ BLE_Device_Information_Service deviceInformationService;
 // BLE_Wattbike_Service wattbikeService;
 // BLE_SB20_Service sb20Service;
 
+// The heart rate, cycling power and CSC services don't fill in their own handles. Looks theirs up once,
+// straight after their setupService(), so nothing compares their UUIDs afterwards.
+static void registerHandles(NimBLEServer* pServer, BLEHandle::Services serviceId, const NimBLEUUID& serviceUuid, BLEHandle::Characteristics characteristicId,
+                            const NimBLEUUID& characteristicUuid) {
+  NimBLEService* service = pServer->getServiceByUUID(serviceUuid);
+  if (service == nullptr) {
+    return;
+  }
+  BLEHandleTable::registerService(serviceId, service);
+  BLEHandleTable::registerCharacteristic(characteristicId, service->getCharacteristic(characteristicUuid));
+}
+
+// The hub only sees BLE subscriptions through chrCallbacks. A measurement without callbacks gets them;
+// one with callbacks of its own stays unregistered, so the scheduler updates it whether or not
+// anybody is subscribed rather than never.
+static void registerMeasurement(NotificationHubCharacteristic::Types id, BLEHandle::Characteristics handle) {
+  NimBLECharacteristic* characteristic = BLEHandleTable::getCharacteristic(handle);
+  if (characteristic == nullptr) {
+    return;
+  }
+  if (characteristic->getCallbacks() == nullptr) {
+    characteristic->setCallbacks(&chrCallbacks);
+  }
+  if (characteristic->getCallbacks() != &chrCallbacks) {
+    SS2K_LOG(BLE_SERVER_LOG_TAG, "%s has its own callbacks, updating it ungated", characteristic->getUUID().toString().c_str());
+    return;
+  }
+  NotificationHub::registerCharacteristic(id, characteristic);
+}
+
 void startBLEServer() {
   // Server Setup
   SS2K_LOG(BLE_SERVER_LOG_TAG, "Starting BLE Server");
@@ -49,8 +82,11 @@ void startBLEServer() {
   oScanResponseData.setFlags(0x06);  // General Discoverable, BR/EDR Not Supported
   oScanResponseData.setCompleteServices(SMARTSPIN2K_SERVICE_UUID);
   cyclingSpeedCadenceService.setupService(spinBLEServer.pServer, &chrCallbacks);
+  registerHandles(spinBLEServer.pServer, BLEHandle::CyclingSpeedCadenceService, CSCSERVICE_UUID, BLEHandle::CSCMeasurement, CSCMEASUREMENT_UUID);
   cyclingPowerService.setupService(spinBLEServer.pServer, &chrCallbacks);
+  registerHandles(spinBLEServer.pServer, BLEHandle::CyclingPowerService, CYCLINGPOWERSERVICE_UUID, BLEHandle::CyclingPowerMeasurement, CYCLINGPOWERMEASUREMENT_UUID);
   heartService.setupService(spinBLEServer.pServer, &chrCallbacks);
+  registerHandles(spinBLEServer.pServer, BLEHandle::HeartRateService, HEARTSERVICE_UUID, BLEHandle::HeartRateMeasurement, HEARTCHARACTERISTIC_UUID);
   fitnessMachineService.setupService(spinBLEServer.pServer, &chrCallbacks);
   ss2kCustomCharacteristic.setupService(spinBLEServer.pServer);
   deviceInformationService.setupService(spinBLEServer.pServer);
@@ -66,6 +102,22 @@ void startBLEServer() {
   // wattbikeService.setupService(spinBLEServer.pServer);  // No callback needed
   // sb20Service.begin();
   BLEFirmwareSetup(spinBLEServer.pServer);
+  DirConManager::buildCharacteristicRegistry();
+  // This task runs update(), so it is the one that publishes notifications
+  DirConManager::setNotificationProducer();
+
+  // The heart rate, cycling power and CSC services notify by themselves. Register their measurements so
+  // the hub tracks who is subscribed to them.
+  registerMeasurement(NotificationHubCharacteristic::HeartRateMeasurement, BLEHandle::HeartRateMeasurement);
+  registerMeasurement(NotificationHubCharacteristic::CyclingPowerMeasurement, BLEHandle::CyclingPowerMeasurement);
+  registerMeasurement(NotificationHubCharacteristic::CSCMeasurement, BLEHandle::CSCMeasurement);
+
+  // Each service update runs at its own rate, and only while its measurement has a subscriber
+  spinBLEServer.updateScheduler.add("HR", []() { heartService.update(); }, NotificationHubCharacteristic::HeartRateMeasurement, BLE_HEART_RATE_UPDATE_MS);
+  spinBLEServer.updateScheduler.add("CPS", []() { cyclingPowerService.update(); }, NotificationHubCharacteristic::CyclingPowerMeasurement, BLE_CYCLING_POWER_UPDATE_MS);
+  spinBLEServer.updateScheduler.add("CSC", []() { cyclingSpeedCadenceService.update(); }, NotificationHubCharacteristic::CSCMeasurement, BLE_CSC_UPDATE_MS);
+  spinBLEServer.updateScheduler.add("FTMS", []() { fitnessMachineService.update(); }, NotificationHubCharacteristic::FitnessMachineIndoorBikeData,
+                                    BLE_INDOOR_BIKE_DATA_UPDATE_MS, []() { fitnessMachineService.resetIndoorBikeData(); });
 
   // const std::string fitnessData = {0b00000001, 0b00100000, 0b00000000};
   // pAdvertising->setServiceData(FITNESSMACHINESERVICE_UUID, fitnessData);
@@ -78,25 +130,27 @@ void startBLEServer() {
 }
 
 void SpinBLEServer::update() {
-  // Wheel and crank is used in multiple characteristics. Update first.
-  spinBLEServer.updateWheelAndCrankRev();
+  // Every service encodes from this, take it first
+  spinBLEServer.takeSnapshot();
+  // Control point writes are carried out every tick, whatever the schedule
+  fitnessMachineService.processFTMSWrite();
   // update the BLE information on the server
-  heartService.update();
-  cyclingPowerService.update();
-  cyclingSpeedCadenceService.update();
-  fitnessMachineService.update();
+  updateScheduler.run();
   // wattbikeService.parseNemit();  // Changed from update() to parseNemit()
   // sb20Service.notify();
+  // Send this tick's DirCon notifications as one write per client
+  DirConManager::flush();
 }
 
-double SpinBLEServer::calculateSpeed() {
+double SpinBLEServer::calculateSpeed() { return speedFromPower(rtConfig->watts.getValue()); }
+
+double SpinBLEServer::speedFromPower(double power) {
   // Constants for the formula: adjusted for calibration
   const double dragCoefficient   = 1.95;
   const double frontalArea       = 0.9;    // m^2
   const double airDensity        = 1.225;  // kg/m^3
   const double rollingResistance = 0.004;
   const double combinedConstant  = 0.5 * airDensity * dragCoefficient * frontalArea + rollingResistance;
-  double power                   = rtConfig->watts.getValue();           // Power in watts
   double speedInMetersPerSecond  = std::cbrt(power / combinedConstant);  // Speed in m/s
 
   // Convert speed from m/s to km/h
@@ -109,15 +163,45 @@ double SpinBLEServer::calculateSpeed() {
   return speedKmH;
 }
 
-void SpinBLEServer::updateWheelAndCrankRev() {
-  float wheelSize     = 2.127;  // 700cX28 circumference, typical in meters
-  float wheelSpeedMps = 0.0;
+void SpinBLEServer::takeSnapshot() {
+  snapshot.takenAt               = millis();
+  snapshot.power                 = rtConfig->watts.getValue();
+  snapshot.cadence               = rtConfig->cad.getValue();
+  snapshot.heartRate             = rtConfig->hr.getValue();
+  snapshot.heartMonitorConnected = strcmp(userConfig->getConnectedHeartMonitor(), NONE) != 0;
   if (rtConfig->getSimulatedSpeed() > 5) {
-    wheelSpeedMps = rtConfig->getSimulatedSpeed() / 3.6;
+    snapshot.speed = rtConfig->getSimulatedSpeed();
   } else {
-    wheelSpeedMps = this->calculateSpeed() / 3.6;  // covert km/h to m/s
+    snapshot.speed = speedFromPower(snapshot.power);
   }
 
+  // Check if bike has resistance reporting capability or resistance simulation enabled
+  bool hasResistanceReporting = (!rtConfig->resistance.getSimulate() && 
+                                (rtConfig->resistance.getTimestamp() > 0 && 
+                                 (millis() - rtConfig->resistance.getTimestamp()) < 5000));
+  if (hasResistanceReporting) {
+    // Use reported resistance value
+    snapshot.resistance = rtConfig->resistance.getValue();
+  } else {
+    // Calculate resistance from stepper position for bikes that don't report resistance, which keeps
+    // rtConfig current for them whether or not anyone is subscribed
+    snapshot.resistance = calculateResistanceFromPosition();
+    rtConfig->resistance.setValue(snapshot.resistance);
+    rtConfig->resistance.setSimulate(true);  // Mark as simulated
+  }
+
+  // Wheel and crank is used in multiple characteristics
+  updateWheelAndCrankRev();
+  snapshot.wheelRevolutions   = spinBLEClient.cscCumulativeWheelRev;
+  snapshot.lastWheelEventTime = spinBLEClient.cscLastWheelEvtTime;
+  snapshot.crankRevolutions   = spinBLEClient.cscCumulativeCrankRev;
+  snapshot.lastCrankEventTime = spinBLEClient.cscLastCrankEvtTime;
+}
+
+void SpinBLEServer::updateWheelAndCrankRev() {
+  float wheelSize     = 2.127;                   // 700cX28 circumference, typical in meters
+  float wheelSpeedMps = snapshot.speed / 3.6;  // covert km/h to m/s
+
   // Calculate wheel revolutions per minute
   float wheelRpm = (wheelSpeedMps / wheelSize) * 60;
   if (wheelRpm > 0) {
@@ -126,7 +210,7 @@ void SpinBLEServer::updateWheelAndCrankRev() {
     spinBLEClient.cscLastWheelEvtTime += wheelRevPeriod;  // Convert RPM to time, ensuring no division by zero
   }
 
-  float cadence = rtConfig->cad.getValue();
+  float cadence = snapshot.cadence;
   if (cadence > 0) {
     float crankRevPeriod = (60 * 1024) / cadence;
     spinBLEClient.cscCumulativeCrankRev++;
@@ -134,6 +218,35 @@ void SpinBLEServer::updateWheelAndCrankRev() {
   }
 }
 
+// Calculate resistance from stepper position for bikes that don't natively report resistance
+int SpinBLEServer::calculateResistanceFromPosition() {
+  int32_t currentPosition = ss2k->getCurrentPosition();
+  int32_t minPos, maxPos;
+  
+  // Use homing values if available, otherwise use stepper min/max
+  if (userConfig->getHMin() != INT32_MIN && userConfig->getHMax() != INT32_MIN) {
+    minPos = userConfig->getHMin();
+    maxPos = userConfig->getHMax();
+  } else {
+    minPos = rtConfig->getMinStep();
+    maxPos = rtConfig->getMaxStep();
+  }
+  
+  // Ensure we have valid range
+  if (maxPos <= minPos) {
+    return 50; // Default to mid-point resistance if range is invalid
+  }
+  
+  // Calculate resistance as percentage (0-100) based on position
+  int resistance = ((currentPosition - minPos) * 100) / (maxPos - minPos);
+  
+  // Clamp to valid range
+  if (resistance < 0) resistance = 0;
+  if (resistance > 100) resistance = 100;
+  
+  return resistance;
+}
+
 // Creating Server Connection Callbacks
 void MyServerCallbacks::onConnect(NimBLEServer* pServer, NimBLEConnInfo& connInfo) {
   SS2K_LOG(BLE_SERVER_LOG_TAG, "Bluetooth Remote Client Connected: %s Connected Clients: %d", connInfo.getAddress().toString().c_str(), pServer->getConnectedCount());
@@ -173,7 +286,10 @@ void MyCharacteristicCallbacks::onRead(NimBLECharacteristic* pCharacteristic, Ni
 
 void MyCharacteristicCallbacks::onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) {
   if (pCharacteristic->getUUID() == FITNESSMACHINECONTROLPOINT_UUID) {
-    spinBLEServer.writeCache.push(pCharacteristic->getValue());
+    NimBLEAttValue value = pCharacteristic->getValue();
+    if (!spinBLEServer.controlPointQueue.push(ControlPointSource::Ble, value.data(), value.size())) {
+      SS2K_LOG(BLE_SERVER_LOG_TAG, "Control point write refused, %lu writes outstanding", (unsigned long)spinBLEServer.controlPointQueue.depth());
+    }
   } else {
     SS2K_LOG(BLE_SERVER_LOG_TAG, "Write to %s is not supported", pCharacteristic->getUUID().toString().c_str());
   }
@@ -197,6 +313,8 @@ void MyCharacteristicCallbacks::onStatus(NimBLECharacteristic* pCharacteristic,
 }
 
 void MyCharacteristicCallbacks::onSubscribe(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo, uint16_t subValue) {
+  NotificationHub::onSubscribe(pCharacteristic, connInfo.getConnHandle(), subValue);
+
   String str       = "Client ID: ";
   NimBLEUUID pUUID = pCharacteristic->getUUID();
   str += connInfo.getConnHandle();
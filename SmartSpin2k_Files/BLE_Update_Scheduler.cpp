@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "BLE_Update_Scheduler.h"
+#include "Main.h"
+#include "BLE_Common.h"
+#include "SS2KLog.h"
+
+bool BLEUpdateScheduler::add(const char* name, void (*update)(), NotificationHubCharacteristic::Types gate, uint32_t periodMs, void (*idle)()) {
+  if (count >= BLE_SCHEDULER_MAX_UPDATES) {
+    SS2K_LOG(BLE_SERVER_LOG_TAG, "Scheduler full, %s not added", name);
+    return false;
+  }
+  BLEScheduledUpdate& entry = updates[count++];
+  entry                     = {};
+  entry.name                = name;
+  entry.update              = update;
+  entry.idle                = idle;
+  entry.gate                = gate;
+  entry.periodMs            = periodMs;
+  entry.nextDue             = millis();
+  return true;
+}
+
+void BLEUpdateScheduler::run() {
+  unsigned long now = millis();
+  for (size_t i = 0; i < count; i++) {
+    BLEScheduledUpdate& entry = updates[i];
+    if ((long)(now + BLE_SCHEDULER_SLACK_MS - entry.nextDue) < 0) {
+      continue;
+    }
+    // Keep to the rate, but don't try to catch up after a stall
+    entry.nextDue += entry.periodMs;
+    if ((long)(now - entry.nextDue) >= 0) {
+      entry.nextDue = now + entry.periodMs;
+    }
+
+    if (NotificationHub::isRegistered(entry.gate) && !NotificationHub::hasSubscribers(entry.gate)) {
+      entry.idleRuns++;
+      if (entry.idle != nullptr) {
+        entry.idle();
+      }
+      continue;
+    }
+
+    unsigned long startTime = micros();
+    entry.update();
+    uint32_t elapsed = micros() - startTime;
+    entry.runs++;
+    entry.totalMicros += elapsed;
+    if (elapsed > entry.maxMicros) {
+      entry.maxMicros = elapsed;
+    }
+  }
+
+  if (now - lastReport >= BLE_SCHEDULER_REPORT_MS) {
+    lastReport = now;
+    report();
+  }
+}
+
+void BLEUpdateScheduler::report() {
+  for (size_t i = 0; i < count; i++) {
+    BLEScheduledUpdate& entry = updates[i];
+    SS2K_LOG(BLE_SERVER_LOG_TAG, "%s: %lu runs, avg %lu us, max %lu us, %lu idle", entry.name, (unsigned long)entry.runs,
+             (unsigned long)(entry.runs ? entry.totalMicros / entry.runs : 0), (unsigned long)entry.maxMicros, (unsigned long)entry.idleRuns);
+    // Per reporting interval
+    entry.runs        = 0;
+    entry.idleRuns    = 0;
+    entry.totalMicros = 0;
+    entry.maxMicros   = 0;
+  }
+
+  // Since boot, the queue doesn't reset its statistics
+  ControlPointQueueStats controlPointQueue = spinBLEServer.controlPointQueue.getStats();
+  SS2K_LOG(BLE_SERVER_LOG_TAG, "Control point queue: max depth %lu, %lu refused, %lu carried out, %lu superseded, queued avg %lu us, max %lu us",
+           (unsigned long)controlPointQueue.maxDepth, (unsigned long)controlPointQueue.rejected, (unsigned long)controlPointQueue.processed,
+           (unsigned long)controlPointQueue.coalesced, (unsigned long)controlPointQueue.averageAgeMicros, (unsigned long)controlPointQueue.maxAgeMicros);
+}
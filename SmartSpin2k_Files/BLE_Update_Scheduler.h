@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "NotificationHub.h"
+
+#define BLE_SCHEDULER_MAX_UPDATES 8
+#define BLE_SCHEDULER_SLACK_MS    10     // an update this close to due runs now rather than a whole tick late
+#define BLE_SCHEDULER_REPORT_MS   60000  // how often the per-service CPU time is logged
+
+// Target rates of the service updates. Capped by how often the BLE server ticks.
+#ifndef BLE_INDOOR_BIKE_DATA_UPDATE_MS
+#define BLE_INDOOR_BIKE_DATA_UPDATE_MS 250  // 4 Hz
+#endif
+#ifndef BLE_CYCLING_POWER_UPDATE_MS
+#define BLE_CYCLING_POWER_UPDATE_MS 250
+#endif
+#ifndef BLE_CSC_UPDATE_MS
+#define BLE_CSC_UPDATE_MS 500
+#endif
+#ifndef BLE_HEART_RATE_UPDATE_MS
+#define BLE_HEART_RATE_UPDATE_MS 1000
+#endif
+
+// A service update and what it costs
+struct BLEScheduledUpdate {
+  const char* name;
+  void (*update)();
+  void (*idle)();  // instead of update() when it's due and nobody is subscribed, may be nullptr
+  NotificationHubCharacteristic::Types gate;  // only run while this has a BLE or DirCon subscriber
+  uint32_t periodMs;
+  unsigned long nextDue;  // millis()
+  uint32_t runs;
+  uint32_t idleRuns;      // times it was due with nobody subscribed
+  uint32_t totalMicros;
+  uint32_t maxMicros;
+};
+
+// Runs each service update at its own rate, and only while somebody is subscribed to the characteristic
+// it notifies, so a service nobody listens to costs a due check and a subscriber check per tick.
+// Measures the CPU time of every update. Only used from the BLE server task.
+class BLEUpdateScheduler {
+ public:
+  BLEUpdateScheduler() : count(0), lastReport(0) {}
+
+  // From startBLEServer(), after the services are set up. An update gated on a characteristic that
+  // was never registered with the NotificationHub runs whether or not anybody is subscribed.
+  bool add(const char* name, void (*update)(), NotificationHubCharacteristic::Types gate, uint32_t periodMs, void (*idle)() = nullptr);
+
+  // Once per BLE server tick
+  void run();
+
+  size_t size() const { return count; }
+  const BLEScheduledUpdate& get(size_t index) const { return updates[index]; }
+
+ private:
+  BLEScheduledUpdate updates[BLE_SCHEDULER_MAX_UPDATES];
+  size_t count;
+  unsigned long lastReport;
+  void report();
+};
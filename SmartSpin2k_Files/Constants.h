@@ -12,6 +12,7 @@
 // SmartSpin2k custom UUID's
 #define SMARTSPIN2K_SERVICE_UUID        NimBLEUUID("77776277-7877-7774-4466-896665500000")
 #define SMARTSPIN2K_CHARACTERISTIC_UUID NimBLEUUID("77776277-7877-7774-4466-896665500001")
+#define SMARTSPIN2K_DIRCON_STATS_UUID   NimBLEUUID("77776277-7877-7774-4466-896665500002")
 
 #define FIRMWARE_SERVICE_UUID            NimBLEUUID("4FAFC201-1FB5-459E-8FCC-C5C9C331914B")
 #define FIRMWARE_CHARACTERISTIC_TX_UUID  NimBLEUUID("62ec0272-3ec5-11eb-b378-0242ac130003")
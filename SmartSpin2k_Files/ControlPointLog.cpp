@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "ControlPointLog.h"
+#include "Main.h"
+#include "SS2KLog.h"
+
+ControlPointLogEvent ControlPointLog::events[CONTROL_POINT_LOG_LENGTH];
+std::atomic<uint32_t> ControlPointLog::head(0);
+std::atomic<uint32_t> ControlPointLog::tail(0);
+std::atomic<uint32_t> ControlPointLog::dropped(0);
+uint32_t ControlPointLog::reportedDropped = 0;
+
+static TaskHandle_t controlPointLogTaskHandle = nullptr;
+
+void ControlPointLog::start() {
+  if (controlPointLogTaskHandle == nullptr) {
+    xTaskCreate(logTask, "ControlPointLog", CONTROL_POINT_LOG_TASK_STACK_SIZE, nullptr, CONTROL_POINT_LOG_TASK_PRIORITY, &controlPointLogTaskHandle);
+  }
+}
+
+void ControlPointLog::record(const ControlPointLogEvent &event) {
+  uint32_t currentHead = head.load(std::memory_order_relaxed);
+  if (currentHead - tail.load(std::memory_order_acquire) >= CONTROL_POINT_LOG_LENGTH) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  events[currentHead & (CONTROL_POINT_LOG_LENGTH - 1)] = event;
+  head.store(currentHead + 1, std::memory_order_release);
+}
+
+void ControlPointLog::drain() {
+  uint32_t currentTail = tail.load(std::memory_order_relaxed);
+  uint32_t currentHead = head.load(std::memory_order_acquire);
+  while (currentTail != currentHead) {
+    const ControlPointLogEvent &event = events[currentTail & (CONTROL_POINT_LOG_LENGTH - 1)];
+#ifdef CONTROL_POINT_LOG_RAW
+    uint8_t record[CONTROL_POINT_LOG_RECORD_LENGTH];
+    char hex[CONTROL_POINT_LOG_RECORD_LENGTH * 2 + 1];
+    event.encode(record);
+    for (int i = 0; i < CONTROL_POINT_LOG_RECORD_LENGTH; i++) {
+      snprintf(hex + i * 2, 3, "%02x", record[i]);
+    }
+    SS2K_LOG(FMTS_SERVER_LOG_TAG, CONTROL_POINT_LOG_RECORD_PREFIX "%s", hex);
+#else
+    char logBuf[160];
+    event.format(logBuf, sizeof(logBuf));
+    SS2K_LOG(FMTS_SERVER_LOG_TAG, "%s", logBuf);
+#endif
+    currentTail++;
+    tail.store(currentTail, std::memory_order_release);
+  }
+
+  uint32_t currentDropped = dropped.load(std::memory_order_relaxed);
+  if (currentDropped != reportedDropped) {
+    SS2K_LOG(FMTS_SERVER_LOG_TAG, "%lu control point log events dropped", (unsigned long)(currentDropped - reportedDropped));
+    reportedDropped = currentDropped;
+  }
+}
+
+void ControlPointLog::logTask(void *pvParameters) {
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(CONTROL_POINT_LOG_DRAIN_MS));
+    drain();
+  }
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else  // tools/ControlPointLogDecoder.cpp, give BLE_Definitions.h what Arduino.h would
+#include <cstdint>
+#include <vector>
+typedef unsigned int uint;
+#endif
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include "BLE_Definitions.h"
+
+#define CONTROL_POINT_LOG_LENGTH          32   // events waiting to be formatted, must be a power of two
+#define CONTROL_POINT_LOG_MAX_PARAMS      6    // bytes kept of a write after its opcode, enough for sim parameters
+#define CONTROL_POINT_LOG_DRAIN_MS        250  // how often the log task formats what has been recorded
+#define CONTROL_POINT_LOG_TASK_STACK_SIZE 3072
+#define CONTROL_POINT_LOG_TASK_PRIORITY   1
+#define CONTROL_POINT_LOG_RECORD_LENGTH   23  // bytes of an encoded event, see ControlPointLogEvent::encode()
+#define CONTROL_POINT_LOG_RECORD_PREFIX   "CPL1:"
+// Define CONTROL_POINT_LOG_RAW to log events as hex records for tools/ControlPointLogDecoder.cpp
+// instead of formatting them on the device.
+
+static_assert((CONTROL_POINT_LOG_LENGTH & (CONTROL_POINT_LOG_LENGTH - 1)) == 0, "CONTROL_POINT_LOG_LENGTH must be a power of two");
+
+// One FTMS control point write and its outcome, with the state it left behind. Everything the old
+// text log line showed can be rebuilt from this.
+struct ControlPointLogEvent {
+  uint32_t timestamp;  // micros() when the write was carried out
+  uint8_t opCode;
+  uint8_t result;  // FitnessMachineControlPointResultCode sent back
+  uint8_t length;  // of the write, 0 for an empty one
+  uint8_t params[CONTROL_POINT_LOG_MAX_PARAMS];  // the write after its opcode, truncated
+  int16_t resistanceTarget;
+  int16_t powerTarget;
+  int16_t power;   // current watts
+  float incline;   // target incline, 0.01%
+
+  // Fixed little endian layout, the same on the device and the host
+  void encode(uint8_t *out) const {
+    memcpy(out, &timestamp, 4);
+    out[4] = opCode;
+    out[5] = result;
+    out[6] = length;
+    memcpy(out + 7, params, CONTROL_POINT_LOG_MAX_PARAMS);
+    memcpy(out + 13, &resistanceTarget, 2);
+    memcpy(out + 15, &powerTarget, 2);
+    memcpy(out + 17, &power, 2);
+    memcpy(out + 19, &incline, 4);
+  }
+  void decode(const uint8_t *in) {
+    memcpy(&timestamp, in, 4);
+    opCode = in[4];
+    result = in[5];
+    length = in[6];
+    memcpy(params, in + 7, CONTROL_POINT_LOG_MAX_PARAMS);
+    memcpy(&resistanceTarget, in + 13, 2);
+    memcpy(&powerTarget, in + 15, 2);
+    memcpy(&power, in + 17, 2);
+    memcpy(&incline, in + 19, 4);
+  }
+
+  // The log line for this event, as processControlPointWrite() used to write it. Inline so the host
+  // decoder shares it. Returns the length, truncated to fit.
+  int format(char *buffer, size_t size) const {
+    int used = 0;
+    auto append = [&](int written) {
+      if (written > 0) {
+        used = ((size_t)(used + written) < size) ? used + written : (int)size - 1;
+      }
+    };
+    if (length == 0) {
+      append(snprintf(buffer, size, "App wrote nothing, assuming it's a Control request"));
+    } else {
+      append(snprintf(buffer, size, "%02x ", opCode));
+      for (int i = 0; i < length - 1 && i < CONTROL_POINT_LOG_MAX_PARAMS; i++) {
+        append(snprintf(buffer + used, size - used, "%02x ", params[i]));
+      }
+      int16_t param16 = (int16_t)(params[0] | (params[1] << 8));
+      switch (opCode) {
+        case FitnessMachineControlPointProcedure::RequestControl:
+          append(snprintf(buffer + used, size - used, "-> Control Request"));
+          break;
+        case FitnessMachineControlPointProcedure::Reset:
+          append(snprintf(buffer + used, size - used, "-> Reset"));
+          break;
+        case FitnessMachineControlPointProcedure::SetTargetInclination:
+          append(snprintf(buffer + used, size - used, "-> Incline Mode: %2f", incline / 100));
+          break;
+        case FitnessMachineControlPointProcedure::SetTargetResistanceLevel:
+          if (result == FitnessMachineControlPointResultCode::Success) {
+            append(snprintf(buffer + used, size - used, "-> Resistance Mode: %d", resistanceTarget));
+          } else {
+            append(snprintf(buffer + used, size - used, "-> Resistance Request %d beyond limits", param16));
+          }
+          break;
+        case FitnessMachineControlPointProcedure::SetTargetPower:
+          if (result == FitnessMachineControlPointResultCode::Success) {
+            append(snprintf(buffer + used, size - used, "-> ERG Mode Target: %d Current: %d Incline: %2f", powerTarget, power, incline / 100));
+          } else {
+            append(snprintf(buffer + used, size - used, "-> ERG Mode: No Power Meter Connected"));
+          }
+          break;
+        case FitnessMachineControlPointProcedure::StartOrResume:
+          append(snprintf(buffer + used, size - used, "-> Start Training"));
+          break;
+        case FitnessMachineControlPointProcedure::StopOrPause: {
+          uint8_t controlParam = (length > 1) ? params[0] : 0x01;
+          if (controlParam == 0x01) {
+            append(snprintf(buffer + used, size - used, "-> Stop Training"));
+          } else if (controlParam == 0x02) {
+            append(snprintf(buffer + used, size - used, "-> Pause Training"));
+          }
+        } break;
+        case FitnessMachineControlPointProcedure::SetIndoorBikeSimulationParameters:
+          append(snprintf(buffer + used, size - used, "-> Sim Mode Incline %2f", incline / 100));
+          break;
+        case FitnessMachineControlPointProcedure::SpinDownControl:
+          append(snprintf(buffer + used, size - used, "-> Spin Down Requested"));
+          break;
+        case FitnessMachineControlPointProcedure::SetTargetedCadence:
+          append(snprintf(buffer + used, size - used, "-> Target Cadence: %d ", (uint16_t)param16));
+          break;
+        default:
+          append(snprintf(buffer + used, size - used, "-> Unsupported FTMS Request"));
+      }
+    }
+    append(snprintf(buffer + used, size - used, ". Responding: %02x %02x %02x", FitnessMachineControlPointProcedure::ResponseCode, opCode, result));
+    return used;
+  }
+};
+
+// Deferred log of FTMS control point writes. The BLE server task records a fixed size event into a
+// lock-free single producer, single consumer ring; a low priority task formats them later, so a
+// write no longer pays for hex dumps and snprintf() while it is being carried out.
+class ControlPointLog {
+ public:
+  // Start the task that drains the ring, from setupService()
+  static void start();
+
+  // Producer side, the BLE server task. Never blocks; counts the event as dropped when the ring is full.
+  static void record(const ControlPointLogEvent &event);
+
+  // Consumer side. Logs every recorded event, as text or as CONTROL_POINT_LOG_RAW records.
+  static void drain();
+
+  static uint32_t getDropped() { return dropped.load(std::memory_order_relaxed); }
+
+ private:
+  static ControlPointLogEvent events[CONTROL_POINT_LOG_LENGTH];
+  static std::atomic<uint32_t> head;  // next event to write, only advanced by the producer
+  static std::atomic<uint32_t> tail;  // next event to read, only advanced by the consumer
+  static std::atomic<uint32_t> dropped;
+  static uint32_t reportedDropped;  // consumer's copy of dropped, as last logged
+  static void logTask(void *pvParameters);
+};
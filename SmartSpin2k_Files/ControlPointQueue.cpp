@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "ControlPointQueue.h"
+#include <vector>
+#include "BLE_Definitions.h"
+
+ControlPointQueue::ControlPointQueue()
+    : head(0), tail(0), tailPublished(0), maxDepth(0), rejected(0), processed(0), coalesced(0), maxAgeMicros(0), totalAgeMicros(0) {
+  for (uint32_t i = 0; i < CONTROL_POINT_QUEUE_LENGTH; i++) {
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool ControlPointQueue::push(ControlPointSource::Types source, const uint8_t* data, size_t length, uint8_t clientIndex, uint8_t sequenceNumber) {
+  if (length > CONTROL_POINT_MAX_LENGTH) {
+    rejected.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  // Claim a position. Its slot is free once the consumer has released it for this lap of the ring.
+  uint32_t position = head.load(std::memory_order_relaxed);
+  Slot* slot;
+  for (;;) {
+    slot             = &slots[position & (CONTROL_POINT_QUEUE_LENGTH - 1)];
+    int32_t distance = (int32_t)(slot->sequence.load(std::memory_order_acquire) - position);
+    if (distance == 0) {
+      if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (distance < 0) {
+      rejected.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      position = head.load(std::memory_order_relaxed);
+    }
+  }
+
+  ControlPointCommand& command = slot->command;
+  command.source               = source;
+  command.clientIndex          = clientIndex;
+  command.sequenceNumber       = sequenceNumber;
+  command.length               = (uint8_t)length;
+  command.enqueuedAt           = micros();
+  memcpy(command.data, data, length);
+  slot->sequence.store(position + 1, std::memory_order_release);
+
+  uint32_t currentDepth = position + 1 - tailPublished.load(std::memory_order_relaxed);
+  uint32_t currentMax   = maxDepth.load(std::memory_order_relaxed);
+  while (currentDepth > currentMax && !maxDepth.compare_exchange_weak(currentMax, currentDepth, std::memory_order_relaxed)) {
+  }
+  return true;
+}
+
+const ControlPointQueue::Slot* ControlPointQueue::slotAt(uint32_t position) const {
+  const Slot& slot = slots[position & (CONTROL_POINT_QUEUE_LENGTH - 1)];
+  return (slot.sequence.load(std::memory_order_acquire) == position + 1) ? &slot : nullptr;
+}
+
+const ControlPointCommand* ControlPointQueue::front() const {
+  const Slot* slot = slotAt(tail);
+  return (slot != nullptr) ? &slot->command : nullptr;
+}
+
+const ControlPointCommand* ControlPointQueue::next() const {
+  if (front() == nullptr) {
+    return nullptr;
+  }
+  const Slot* slot = slotAt(tail + 1);
+  return (slot != nullptr) ? &slot->command : nullptr;
+}
+
+void ControlPointQueue::pop(bool wasCoalesced) {
+  Slot& slot   = slots[tail & (CONTROL_POINT_QUEUE_LENGTH - 1)];
+  uint32_t age = micros() - slot.command.enqueuedAt;
+  slot.sequence.store(tail + CONTROL_POINT_QUEUE_LENGTH, std::memory_order_release);
+  tail++;
+  tailPublished.store(tail, std::memory_order_relaxed);
+
+  // Only the consumer updates these, plain load and store is enough
+  (wasCoalesced ? coalesced : processed).fetch_add(1, std::memory_order_relaxed);
+  totalAgeMicros.store(totalAgeMicros.load(std::memory_order_relaxed) + age, std::memory_order_relaxed);
+  if (age > maxAgeMicros.load(std::memory_order_relaxed)) {
+    maxAgeMicros.store(age, std::memory_order_relaxed);
+  }
+}
+
+bool ControlPointQueue::isCoalescable(uint8_t opCode) {
+  switch (opCode) {
+    case FitnessMachineControlPointProcedure::SetTargetInclination:
+    case FitnessMachineControlPointProcedure::SetTargetResistanceLevel:
+    case FitnessMachineControlPointProcedure::SetTargetPower:
+    case FitnessMachineControlPointProcedure::SetIndoorBikeSimulationParameters:
+    case FitnessMachineControlPointProcedure::SetTargetedCadence:
+      return true;
+    default:
+      return false;
+  }
+}
+
+uint32_t ControlPointQueue::depth() const { return head.load(std::memory_order_relaxed) - tailPublished.load(std::memory_order_relaxed); }
+
+ControlPointQueueStats ControlPointQueue::getStats() const {
+  ControlPointQueueStats stats;
+  stats.maxDepth         = maxDepth.load(std::memory_order_relaxed);
+  stats.rejected         = rejected.load(std::memory_order_relaxed);
+  stats.processed        = processed.load(std::memory_order_relaxed);
+  stats.coalesced        = coalesced.load(std::memory_order_relaxed);
+  stats.maxAgeMicros     = maxAgeMicros.load(std::memory_order_relaxed);
+  uint32_t popped        = stats.processed + stats.coalesced;
+  stats.averageAgeMicros = popped ? totalAgeMicros.load(std::memory_order_relaxed) / popped : 0;
+  return stats;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+#define CONTROL_POINT_QUEUE_LENGTH 16  // outstanding control point writes from BLE and DirCon, must be a power of two
+#define CONTROL_POINT_MAX_LENGTH   20  // longest control point write accepted, one BLE ATT payload
+#define CONTROL_POINT_RESPONSE_MAX 7   // longest control point response, spin down with its target speeds
+
+static_assert((CONTROL_POINT_QUEUE_LENGTH & (CONTROL_POINT_QUEUE_LENGTH - 1)) == 0, "CONTROL_POINT_QUEUE_LENGTH must be a power of two");
+
+// Where a control point write came from
+struct ControlPointSource {
+  enum Types : uint8_t {
+    Ble    = 0,
+    DirCon = 1,  // already answered on the network side, see DirConManager::acceptControlPointWrite()
+  };
+};
+
+// A control point write waiting for the BLE server task
+struct ControlPointCommand {
+  ControlPointSource::Types source;
+  uint8_t clientIndex;     // DirCon client slot
+  uint8_t sequenceNumber;  // of the DirCon write request, identifies it in the logs
+  uint8_t length;
+  unsigned long enqueuedAt;  // micros()
+  uint8_t data[CONTROL_POINT_MAX_LENGTH];
+};
+
+struct ControlPointQueueStats {
+  uint32_t maxDepth;
+  uint32_t rejected;   // full queue or too long
+  uint32_t processed;  // popped after being carried out
+  uint32_t coalesced;  // popped unprocessed, superseded by the next write
+  uint32_t maxAgeMicros;
+  uint32_t averageAgeMicros;  // from push() to pop()
+};
+
+// Lock-free multiple producer, single consumer ring of fixed size control point writes. The NimBLE host
+// task and the DirCon task push, the BLE server task, which owns the FTMS state, pops. push() never
+// blocks and never allocates. Each slot carries a sequence number, so a producer that has claimed a
+// slot but not finished filling it holds up the consumer rather than exposing a half written command.
+class ControlPointQueue {
+ public:
+  ControlPointQueue();
+
+  // Producer side, any task. False when the ring is full or the write too long.
+  bool push(ControlPointSource::Types source, const uint8_t* data, size_t length, uint8_t clientIndex = 0, uint8_t sequenceNumber = 0);
+
+  // Consumer side. front() returns nullptr when empty, next() the command after it if that one is
+  // complete already; both stay valid until pop(). Pass coalesced when the front command was skipped.
+  const ControlPointCommand* front() const;
+  const ControlPointCommand* next() const;
+  void pop(bool coalesced = false);
+
+  // True if a queued write of this procedure may be dropped for a newer one of the same procedure:
+  // it only sets a target, so carrying out both ends in the same state as carrying out the newer.
+  // The caller also has to have answered the dropped write, see ControlPointSource::DirCon.
+  static bool isCoalescable(uint8_t opCode);
+
+  // Either side
+  uint32_t depth() const;
+  ControlPointQueueStats getStats() const;
+
+ private:
+  struct Slot {
+    std::atomic<uint32_t> sequence;  // position + 1 once filled, position + length once free again
+    ControlPointCommand command;
+  };
+  Slot slots[CONTROL_POINT_QUEUE_LENGTH];
+  std::atomic<uint32_t> head;  // next position to claim, advanced by the producers
+  uint32_t tail;               // next position to read, only touched by the consumer
+  std::atomic<uint32_t> tailPublished;  // copy of tail for depth() from other tasks
+
+  std::atomic<uint32_t> maxDepth;
+  std::atomic<uint32_t> rejected;
+  std::atomic<uint32_t> processed;
+  std::atomic<uint32_t> coalesced;
+  std::atomic<uint32_t> maxAgeMicros;
+  std::atomic<uint32_t> totalAgeMicros;  // wraps after a long time, only feeds the average
+
+  const Slot* slotAt(uint32_t position) const;
+};
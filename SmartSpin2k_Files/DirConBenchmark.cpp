@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifdef DIRCON_BENCHMARK
+
+#include "DirConBenchmark.h"
+#include "DirConManager.h"
+#include "BLE_Handle_Table.h"
+#include "SS2KLog.h"
+#include <Constants.h>
+#include <new>
+
+#define DIRCON_BENCHMARK_LOG_TAG "DirConBenchmark"
+
+// Allocation counting. Replacing the global operators is only done in benchmark builds.
+// Allocations made by other tasks while a case runs are counted too, so run it with nothing connected.
+static volatile bool countAllocations = false;
+static uint32_t allocationCount       = 0;
+static uint32_t allocatedBytes        = 0;
+
+void* operator new(size_t size) {
+  if (countAllocations) {
+    allocationCount++;
+    allocatedBytes += size;
+  }
+  void* pointer = malloc(size ? size : 1);
+  if (pointer == nullptr) {
+    abort();
+  }
+  return pointer;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* pointer) noexcept { free(pointer); }
+void operator delete[](void* pointer) noexcept { free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { free(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { free(pointer); }
+
+// Keeps the compiler from discarding a result that is otherwise unused
+static volatile size_t benchmarkSink = 0;
+
+template <typename Body>
+bool DirConBenchmark::runCase(const char* name, size_t messageBytes, bool allocationFree, Body body) {
+  // Warm up once so lazily initialized state isn't charged to the case
+  body(0);
+
+  allocationCount  = 0;
+  allocatedBytes   = 0;
+  countAllocations = true;
+  unsigned long startTime = micros();
+  for (uint32_t i = 0; i < DIRCON_BENCHMARK_ITERATIONS; i++) {
+    body(i);
+  }
+  unsigned long elapsed = micros() - startTime;
+  countAllocations      = false;
+
+  if (elapsed == 0) {
+    elapsed = 1;
+  }
+  uint32_t nsPerMessage   = (uint64_t)elapsed * 1000 / DIRCON_BENCHMARK_ITERATIONS;
+  uint32_t messagesPerSec = (uint64_t)DIRCON_BENCHMARK_ITERATIONS * 1000000 / elapsed;
+  uint32_t kBytesPerSec   = (uint64_t)messagesPerSec * messageBytes / 1024;
+  SS2K_LOG(DIRCON_BENCHMARK_LOG_TAG, "%-28s %7lu ns/msg %5lu B/msg %5.2f allocs/msg %7lu msg/s %6lu KiB/s", name, (unsigned long)nsPerMessage,
+           (unsigned long)(allocatedBytes / DIRCON_BENCHMARK_ITERATIONS), (float)allocationCount / DIRCON_BENCHMARK_ITERATIONS, (unsigned long)messagesPerSec,
+           (unsigned long)kBytesPerSec);
+
+  // Let the idle task feed the watchdog between cases
+  delay(1);
+
+  if (allocationFree && allocationCount > 0) {
+    SS2K_LOG(DIRCON_BENCHMARK_LOG_TAG, "%s allocated %lu times, it must not allocate", name, (unsigned long)allocationCount);
+    return false;
+  }
+  return true;
+}
+
+bool DirConBenchmark::run() {
+  SS2K_LOG(DIRCON_BENCHMARK_LOG_TAG, "Running DirCon benchmark, %d iterations per case", DIRCON_BENCHMARK_ITERATIONS);
+
+  uint8_t buffer[DIRCON_SEND_BUFFER_SIZE];
+  std::vector<NimBLEUUID> services = DirConManager::getAvailableServices();
+
+  uint8_t featureUuid[16];
+  uint8_t bikeDataUuid[16];
+  uint8_t controlPointUuid[16];
+  uuidToBytes(FITNESSMACHINEFEATURE_UUID, featureUuid);
+  uuidToBytes(FITNESSMACHINEINDOORBIKEDATA_UUID, bikeDataUuid);
+  uuidToBytes(FITNESSMACHINECONTROLPOINT_UUID, controlPointUuid);
+
+  // Typical payloads: an indoor bike data notification and a set target power write
+  uint8_t bikeData[19]          = {0x44, 0x02, 0x10, 0x0e, 0xb4, 0x00, 0xc8, 0x00, 0x00, 0x00};
+  uint8_t setPower[3]           = {0x05, 0xc8, 0x00};
+  uint8_t featureValue[8]       = {0x8a, 0x44, 0x00, 0x00, 0x0e, 0xa0, 0x00, 0x00};
+  uint8_t readRequest[22]       = {0};
+  uint8_t writeRequest[25]      = {0};
+  size_t readRequestLength      = DirConMessage::encodeFrame(readRequest, sizeof(readRequest), DIRCON_MSGID_READ_CHARACTERISTIC, 1, DIRCON_RESPCODE_SUCCESS_REQUEST,
+                                                             featureUuid, nullptr, 0);
+  size_t writeRequestLength     = DirConMessage::encodeFrame(writeRequest, sizeof(writeRequest), DIRCON_MSGID_WRITE_CHARACTERISTIC, 1,
+                                                             DIRCON_RESPCODE_SUCCESS_REQUEST, controlPointUuid, setPower, sizeof(setPower));
+  size_t discoverResponseLength = DIRCON_MESSAGE_HEADER_LENGTH + 16 * services.size();
+  NimBLEUUID controlPointServiceUuid = FITNESSMACHINESERVICE_UUID;
+  bool passed                        = true;
+
+  passed &= runCase("discover response (vector)", discoverResponseLength, false, [&](uint32_t i) {
+    DirConMessage response;
+    response.Identifier      = DIRCON_MSGID_DISCOVER_SERVICES;
+    response.AdditionalUUIDs = services;
+    benchmarkSink            = response.encode(i)->size();
+  });
+
+  passed &= runCase("discover response (buffer)", discoverResponseLength, false, [&](uint32_t i) {
+    DirConMessage response;
+    response.Identifier      = DIRCON_MSGID_DISCOVER_SERVICES;
+    response.AdditionalUUIDs = services;
+    benchmarkSink            = response.encode(buffer, sizeof(buffer), i);
+  });
+
+  passed &= runCase("read response (message)", 22 + sizeof(featureValue), false, [&](uint32_t i) {
+    DirConMessage response;
+    response.Identifier     = DIRCON_MSGID_READ_CHARACTERISTIC;
+    response.UUID           = FITNESSMACHINEFEATURE_UUID;
+    response.AdditionalData = std::vector<uint8_t>(featureValue, featureValue + sizeof(featureValue));
+    benchmarkSink           = response.encode(buffer, sizeof(buffer), i);
+  });
+
+  passed &= runCase("read response (frame)", 22 + sizeof(featureValue), true, [&](uint32_t i) {
+    benchmarkSink = DirConMessage::encodeFrame(buffer, sizeof(buffer), DIRCON_MSGID_READ_CHARACTERISTIC, i, DIRCON_RESPCODE_SUCCESS_REQUEST, featureUuid,
+                                               featureValue, sizeof(featureValue));
+  });
+
+  passed &= runCase("notification (frame)", 22 + sizeof(bikeData), true, [&](uint32_t i) {
+    benchmarkSink = DirConMessage::encodeFrame(buffer, sizeof(buffer), DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION, 0, DIRCON_RESPCODE_SUCCESS_REQUEST,
+                                               bikeDataUuid, bikeData, sizeof(bikeData));
+  });
+
+  passed &= runCase("parse read (message)", readRequestLength, false, [&](uint32_t i) {
+    DirConMessage message;
+    benchmarkSink = message.parse(readRequest, readRequestLength, 0);
+  });
+
+  passed &= runCase("parse read (view)", readRequestLength, true, [&](uint32_t i) {
+    DirConMessageView message;
+    benchmarkSink = message.parse(readRequest, readRequestLength, 0);
+  });
+
+  passed &= runCase("parse write (view)", writeRequestLength, true, [&](uint32_t i) {
+    DirConMessageView message;
+    benchmarkSink = message.parse(writeRequest, writeRequestLength, 0);
+  });
+
+  passed &= runCase("registry lookup", readRequestLength, true, [&](uint32_t i) {
+    DirConMessageView message;
+    message.parse(readRequest, readRequestLength, 0);
+    benchmarkSink = (size_t)DirConManager::findCharacteristic(message.UUID);
+  });
+
+  // What a control point write or custom characteristic command used to pay to find its characteristic,
+  // against the handle table filled in by setupService()
+  passed &= runCase("characteristic (UUID walk)", 0, false, [&](uint32_t i) {
+    NimBLEService* service = NimBLEDevice::getServer()->getServiceByUUID(FITNESSMACHINESERVICE_UUID);
+    benchmarkSink          = (size_t)(service ? service->getCharacteristic(FITNESSMACHINECONTROLPOINT_UUID) : nullptr);
+  });
+
+  passed &= runCase("characteristic (handle)", 0, true, [&](uint32_t i) {
+    benchmarkSink = (size_t)BLEHandleTable::getCharacteristic(BLEHandle::FitnessMachineControlPoint);
+  });
+
+  passed &= runCase("service by UUID (server)", 0, false, [&](uint32_t i) { benchmarkSink = (size_t)NimBLEDevice::getServer()->getServiceByUUID(controlPointServiceUuid); });
+
+  passed &= runCase("service by UUID (table)", 0, true, [&](uint32_t i) { benchmarkSink = (size_t)BLEHandleTable::findService(controlPointServiceUuid); });
+
+  SS2K_LOG(DIRCON_BENCHMARK_LOG_TAG, "DirCon benchmark complete%s", passed ? "" : ", allocation free cases allocated");
+  return passed;
+}
+
+#endif  // DIRCON_BENCHMARK
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// DirCon codec and BLE handle lookup benchmark. Build with -D DIRCON_BENCHMARK; results are logged once
+// when DirConManager starts, so compare the log lines before and after touching the codec. The host
+// build in tools/host runs it as the dircon-benchmark test.
+#ifdef DIRCON_BENCHMARK
+
+#include <Arduino.h>
+
+#ifndef DIRCON_BENCHMARK_ITERATIONS
+#define DIRCON_BENCHMARK_ITERATIONS 2000
+#endif
+
+class DirConBenchmark {
+ public:
+  // Run every case and log ns/message, heap bytes allocated per message and throughput. False if a
+  // case that must not allocate did.
+  static bool run();
+
+ private:
+  template <typename Body>
+  static bool runCase(const char* name, size_t messageBytes, bool allocationFree, Body body);
+};
+
+#endif  // DIRCON_BENCHMARK
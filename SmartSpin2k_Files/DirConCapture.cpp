@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "DirConCapture.h"
+#include "SS2KLog.h"
+#include <algorithm>
+
+#define DIRCON_CAPTURE_LOG_TAG "DirConCapture"
+
+DirConCapture::DirConCapture() : ring(nullptr), capacity(0), head(0), used(0), recording(false), recordCount(0), evictedRecords(0) {}
+
+bool DirConCapture::start(size_t size) {
+  if (ring == nullptr || capacity != size) {
+    release();
+    ring = (uint8_t*)(psramFound() ? ps_malloc(size) : malloc(size));
+    if (ring == nullptr) {
+      SS2K_LOG(DIRCON_CAPTURE_LOG_TAG, "Can't allocate a %d byte capture buffer", size);
+      return false;
+    }
+    capacity = size;
+  }
+
+  head           = 0;
+  used           = 0;
+  recordCount    = 0;
+  evictedRecords = 0;
+  recording      = true;
+  SS2K_LOG(DIRCON_CAPTURE_LOG_TAG, "Capturing DirCon traffic into %d bytes of %s", size, psramFound() ? "PSRAM" : "RAM");
+  return true;
+}
+
+void DirConCapture::stop() {
+  if (recording) {
+    SS2K_LOG(DIRCON_CAPTURE_LOG_TAG, "Capture stopped, %lu records in %d bytes, %lu evicted", (unsigned long)recordCount, used, (unsigned long)evictedRecords);
+  }
+  recording = false;
+}
+
+void DirConCapture::release() {
+  recording = false;
+  free(ring);
+  ring     = nullptr;
+  capacity = 0;
+  head     = 0;
+  used     = 0;
+}
+
+void DirConCapture::record(DirConCaptureRecord::Types type, size_t clientIndex, const uint8_t* data, size_t length) {
+  size_t recordLength = DIRCON_CAPTURE_RECORD_HEADER_LENGTH + length;
+  if (!recording || recordLength > capacity || length > UINT16_MAX) {
+    return;
+  }
+
+  // Drop the oldest records until this one fits
+  while (capacity - used < recordLength) {
+    uint8_t oldest[DIRCON_CAPTURE_RECORD_HEADER_LENGTH];
+    copyOut((head + capacity - used) % capacity, oldest, sizeof(oldest));
+    used -= DIRCON_CAPTURE_RECORD_HEADER_LENGTH + (oldest[5] | (oldest[6] << 8));
+    recordCount--;
+    evictedRecords++;
+  }
+
+  uint32_t timestamp                                   = micros();
+  uint8_t header[DIRCON_CAPTURE_RECORD_HEADER_LENGTH] = {(uint8_t)timestamp,        (uint8_t)(timestamp >> 8),  (uint8_t)(timestamp >> 16),
+                                                          (uint8_t)(timestamp >> 24), (uint8_t)(type << 6 | (clientIndex & 0x3f)),
+                                                          (uint8_t)length,           (uint8_t)(length >> 8)};
+  copyIn(head, header, sizeof(header));
+  copyIn((head + sizeof(header)) % capacity, data, length);
+  head = (head + recordLength) % capacity;
+  used += recordLength;
+  recordCount++;
+}
+
+size_t DirConCapture::writeTo(Print& out) const {
+  const uint8_t header[DIRCON_CAPTURE_HEADER_LENGTH] = {'D', 'C', 'A', 'P', DIRCON_CAPTURE_VERSION, 0, 0, 0};
+  size_t written                                      = out.write(header, sizeof(header));
+  if (ring == nullptr) {
+    return written;
+  }
+
+  // The records are written as stored, in at most two pieces around the end of the ring
+  size_t start     = (head + capacity - used) % capacity;
+  size_t firstPart = std::min(used, capacity - start);
+  written += out.write(ring + start, firstPart);
+  written += out.write(ring, used - firstPart);
+  return written;
+}
+
+// Turns the exported bytes into DIRCON_CAPTURE_HEX_PREFIX lines of hex
+class DirConCaptureHexPrint : public Print {
+ public:
+  explicit DirConCaptureHexPrint(Print& out) : out(out), lineBytes(0) {}
+
+  size_t write(uint8_t b) {
+    static const char digits[] = "0123456789abcdef";
+    if (lineBytes == 0) {
+      writeText(DIRCON_CAPTURE_HEX_PREFIX);
+    }
+    const uint8_t hex[2] = {(uint8_t)digits[b >> 4], (uint8_t)digits[b & 0x0f]};
+    out.write(hex, sizeof(hex));
+    if (++lineBytes == DIRCON_CAPTURE_HEX_LINE_BYTES) {
+      endLine();
+    }
+    return 1;
+  }
+
+  size_t write(const uint8_t* buffer, size_t size) override {
+    for (size_t i = 0; i < size; i++) {
+      write(buffer[i]);
+    }
+    return size;
+  }
+
+  void endLine() {
+    writeText("\n");
+    lineBytes = 0;
+  }
+
+  void finish() {
+    if (lineBytes > 0) {
+      endLine();
+    }
+  }
+
+  void writeText(const char* text) { out.write((const uint8_t*)text, strlen(text)); }
+
+ private:
+  Print& out;
+  size_t lineBytes;
+};
+
+size_t DirConCapture::writeHexTo(Print& out) const {
+  DirConCaptureHexPrint hex(out);
+  hex.writeText(DIRCON_CAPTURE_HEX_PREFIX "begin\n");
+  size_t written = writeTo(hex);
+  hex.finish();
+  hex.writeText(DIRCON_CAPTURE_HEX_PREFIX "end\n");
+  return written;
+}
+
+void DirConCapture::copyIn(size_t offset, const uint8_t* data, size_t length) {
+  if (length == 0) {
+    return;
+  }
+  size_t firstPart = std::min(length, capacity - offset);
+  memcpy(ring + offset, data, firstPart);
+  memcpy(ring, data + firstPart, length - firstPart);
+}
+
+void DirConCapture::copyOut(size_t offset, uint8_t* out, size_t length) const {
+  size_t firstPart = std::min(length, capacity - offset);
+  memcpy(out, ring + offset, firstPart);
+  memcpy(out + firstPart, ring, length - firstPart);
+}
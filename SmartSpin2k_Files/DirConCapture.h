@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define DIRCON_CAPTURE_DEFAULT_SIZE         (32 * 1024)  // bytes, from PSRAM when the board has it
+#define DIRCON_CAPTURE_VERSION              1
+#define DIRCON_CAPTURE_HEADER_LENGTH        8  // "DCAP", version, 3 reserved bytes
+#define DIRCON_CAPTURE_RECORD_HEADER_LENGTH 7  // timestamp (4), type and client (1), length (2)
+#define DIRCON_CAPTURE_HEX_PREFIX           "dcap: "
+#define DIRCON_CAPTURE_HEX_LINE_BYTES       32  // capture bytes per line of writeHexTo()
+
+// What a capture record holds. Stored in the top two bits of the type byte, the client slot in the rest.
+struct DirConCaptureRecord {
+  enum Types : uint8_t {
+    Inbound    = 0,  // a complete frame from the client, as taken from the framer
+    Outbound   = 1,  // a frame queued for the client
+    Connect    = 2,  // no data
+    Disconnect = 3,  // no data
+  };
+};
+
+// Records DirCon traffic into a fixed size ring, dropping the oldest records once full, so the bytes
+// leading up to an interop problem can be exported and replayed with tools/DirConReplay.cpp.
+//
+// Exported format, all little endian: "DCAP", DIRCON_CAPTURE_VERSION, 3 reserved bytes, then the
+// records oldest first. Each record is a 32 bit micros() timestamp (it wraps, so only differences
+// between neighbouring records mean anything), type << 6 | client slot, a 16 bit length and the frame.
+//
+// Not thread safe. DirConManager only touches it with stateMutex held.
+class DirConCapture {
+ public:
+  DirConCapture();
+
+  // Allocate the ring and start recording, discarding any earlier capture. False if out of memory.
+  bool start(size_t size = DIRCON_CAPTURE_DEFAULT_SIZE);
+  // Stop recording and keep the contents for export
+  void stop();
+  // Free the ring
+  void release();
+  bool isRecording() const { return recording; }
+
+  void record(DirConCaptureRecord::Types type, size_t clientIndex, const uint8_t* data, size_t length);
+
+  // Write the capture in the exported format. Returns the number of bytes written.
+  size_t writeTo(Print& out) const;
+  // Same, as hex text for a serial console: a DIRCON_CAPTURE_HEX_PREFIX "begin" line, the bytes on
+  // prefixed lines of DIRCON_CAPTURE_HEX_LINE_BYTES, then a prefixed "end" line. tools/DirConReplay.cpp
+  // reads a saved log back, skipping any other output between the lines. Returns the capture bytes written.
+  size_t writeHexTo(Print& out) const;
+
+  uint32_t getRecordCount() const { return recordCount; }
+  uint32_t getEvictedRecords() const { return evictedRecords; }
+
+ private:
+  uint8_t* ring;
+  size_t capacity;
+  size_t head;  // where the next record starts
+  size_t used;  // bytes held, the oldest record starts at head - used
+  bool recording;
+  uint32_t recordCount;     // records held right now
+  uint32_t evictedRecords;  // records dropped to make room since start()
+
+  void copyIn(size_t offset, const uint8_t* data, size_t length);
+  void copyOut(size_t offset, uint8_t* out, size_t length) const;
+};
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "DirConFramer.h"
+#include "SS2KLog.h"
+#include <algorithm>
+
+#define DIRCON_FRAMER_LOG_TAG "DirConFramer"
+
+DirConFramer::DirConFramer() { reset(); }
+
+void DirConFramer::reset() {
+  readIndex           = 0;
+  bufferedLength      = 0;
+  state               = State::Header;
+  pendingLength       = 0;
+  resyncing           = false;
+  frameCount          = 0;
+  droppedBytes        = 0;
+  resyncCount         = 0;
+  oversizedFrameCount = 0;
+}
+
+size_t DirConFramer::receive(WiFiClient& client) {
+  size_t received = 0;
+  // At most two reads per call: up to the end of the ring, then the wrapped part.
+  while (bufferedLength < DIRCON_RECEIVE_BUFFER_SIZE) {
+    int available = client.available();
+    if (available <= 0) {
+      break;
+    }
+
+    size_t writeIndex = (readIndex + bufferedLength) & (DIRCON_RECEIVE_BUFFER_SIZE - 1);
+    size_t contiguous = std::min(DIRCON_RECEIVE_BUFFER_SIZE - writeIndex, DIRCON_RECEIVE_BUFFER_SIZE - bufferedLength);
+    int bytesRead     = client.read(ring + writeIndex, std::min(contiguous, (size_t)available));
+    if (bytesRead <= 0) {
+      break;
+    }
+
+    bufferedLength += bytesRead;
+    received += bytesRead;
+  }
+  return received;
+}
+
+bool DirConFramer::isKnownIdentifier(uint8_t identifier) {
+  return identifier >= DIRCON_MSGID_DISCOVER_SERVICES && identifier <= DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION;
+}
+
+const uint8_t* DirConFramer::nextFrame(size_t* frameLength) {
+  while (true) {
+    switch (state) {
+      case State::Header: {
+        if (bufferedLength < DIRCON_MESSAGE_HEADER_LENGTH) {
+          return nullptr;
+        }
+
+        uint8_t header[DIRCON_MESSAGE_HEADER_LENGTH];
+        copyOut(header, sizeof(header));
+
+        // The version and the message identifier must both be known before the length is trusted, so a
+        // stray 0x01 in garbage doesn't swallow the frames after it. The parser validates the rest once
+        // the frame is complete.
+        if (header[0] != DIRCON_MESSAGE_VERSION || !isKnownIdentifier(header[1])) {
+          if (!resyncing) {
+            SS2K_LOG(DIRCON_FRAMER_LOG_TAG, "Invalid DirCon header (version %d, identifier 0x%02x), resynchronising", header[0], header[1]);
+            resyncing = true;
+            resyncCount++;
+          }
+          consume(1);
+          droppedBytes++;
+          break;
+        }
+        resyncing = false;
+
+        size_t payloadLength = (header[4] << 8) | header[5];
+        if (DIRCON_MESSAGE_HEADER_LENGTH + payloadLength > DIRCON_MAX_FRAME_LENGTH) {
+          SS2K_LOG(DIRCON_FRAMER_LOG_TAG, "DirCon frame too large (%d bytes), discarding", payloadLength);
+          consume(DIRCON_MESSAGE_HEADER_LENGTH);
+          droppedBytes += DIRCON_MESSAGE_HEADER_LENGTH;
+          oversizedFrameCount++;
+          pendingLength = payloadLength;
+          state         = State::Skip;
+          break;
+        }
+
+        pendingLength = DIRCON_MESSAGE_HEADER_LENGTH + payloadLength;
+        state         = State::Payload;
+        break;
+      }
+
+      case State::Payload: {
+        if (bufferedLength < pendingLength) {
+          return nullptr;
+        }
+
+        // Hand out the frame in place unless it wraps around the end of the ring
+        const uint8_t* result;
+        if (readIndex + pendingLength <= DIRCON_RECEIVE_BUFFER_SIZE) {
+          result = ring + readIndex;
+        } else {
+          copyOut(frame, pendingLength);
+          result = frame;
+        }
+
+        *frameLength = pendingLength;
+        consume(pendingLength);
+        frameCount++;
+        state = State::Header;
+        return result;
+      }
+
+      case State::Skip: {
+        size_t skipped = std::min(bufferedLength, pendingLength);
+        consume(skipped);
+        droppedBytes += skipped;
+        pendingLength -= skipped;
+        if (pendingLength > 0) {
+          return nullptr;
+        }
+        state = State::Header;
+        break;
+      }
+    }
+  }
+}
+
+void DirConFramer::copyOut(uint8_t* out, size_t length) const {
+  size_t firstPart = std::min(length, DIRCON_RECEIVE_BUFFER_SIZE - readIndex);
+  memcpy(out, ring + readIndex, firstPart);
+  memcpy(out + firstPart, ring, length - firstPart);
+}
+
+void DirConFramer::consume(size_t length) {
+  readIndex = (readIndex + length) & (DIRCON_RECEIVE_BUFFER_SIZE - 1);
+  bufferedLength -= length;
+}
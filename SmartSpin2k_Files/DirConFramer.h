@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include "DirConMessage.h"
+
+#define DIRCON_MESSAGE_VERSION      1
+#define DIRCON_RECEIVE_BUFFER_SIZE  1024                                            // per client ring, must be a power of two
+#define DIRCON_MAX_FRAME_LENGTH     (DIRCON_MESSAGE_HEADER_LENGTH + 16 + 512)       // header + UUID + largest BLE attribute value
+
+static_assert((DIRCON_RECEIVE_BUFFER_SIZE & (DIRCON_RECEIVE_BUFFER_SIZE - 1)) == 0, "DIRCON_RECEIVE_BUFFER_SIZE must be a power of two");
+static_assert(DIRCON_RECEIVE_BUFFER_SIZE >= DIRCON_MAX_FRAME_LENGTH, "DIRCON_RECEIVE_BUFFER_SIZE must hold a full frame");
+
+// Splits a DirCon TCP byte stream into frames.
+//
+// Bytes are pulled from the socket in bulk into a ring buffer. The 6 byte header gives the frame
+// length, so an incomplete frame is simply waited for, while a bad header (unknown version or message
+// identifier) drops a byte at a time until a plausible header lines up again. Frames longer than DIRCON_MAX_FRAME_LENGTH are never
+// buffered; their payload is discarded as it arrives.
+class DirConFramer {
+ public:
+  DirConFramer();
+
+  void reset();
+
+  // Read everything the client has available, as far as the ring has room. Returns bytes read.
+  size_t receive(WiFiClient& client);
+
+  // Return the next complete frame (header included), or nullptr if none is buffered yet.
+  // The frame stays valid until the next call to receive() or nextFrame().
+  const uint8_t* nextFrame(size_t* frameLength);
+
+  // Statistics since the last reset()
+  uint32_t getFrameCount() const { return frameCount; }
+  uint32_t getDroppedBytes() const { return droppedBytes; }
+  uint32_t getResyncCount() const { return resyncCount; }
+  uint32_t getOversizedFrameCount() const { return oversizedFrameCount; }
+
+ private:
+  enum class State { Header, Payload, Skip };
+
+  uint8_t ring[DIRCON_RECEIVE_BUFFER_SIZE];
+  uint8_t frame[DIRCON_MAX_FRAME_LENGTH];  // wrapped frames are copied here so they can be parsed linearly
+  size_t readIndex;
+  size_t bufferedLength;
+
+  State state;
+  size_t pendingLength;  // full frame length in Payload state, payload bytes still to discard in Skip state
+  bool resyncing;
+
+  uint32_t frameCount;
+  uint32_t droppedBytes;
+  uint32_t resyncCount;
+  uint32_t oversizedFrameCount;
+
+  void copyOut(uint8_t* out, size_t length) const;
+  void consume(size_t length);
+  static bool isKnownIdentifier(uint8_t identifier);  // one of the DIRCON_MSGID_* message types
+};
@@ -9,34 +9,105 @@
 #include "SS2KLog.h"
 #include <algorithm>
 #include <BLE_Fitness_Machine_Service.h>
+#include "BLE_Handle_Table.h"
 
 #define DIRCON_LOG_TAG "DirConManager"
 
 // Static member initialization
 bool DirConManager::started         = false;
 String DirConManager::statusMessage = "";
-WiFiClient DirConManager::dirConClients[DIRCON_MAX_CLIENTS];
+DirConClient DirConManager::clients[DIRCON_MAX_CLIENTS];
+size_t DirConManager::maxClients     = DIRCON_MAX_CLIENTS;
+uint32_t DirConManager::idleTimeoutMs = DIRCON_IDLE_TIMEOUT_MS;
 WiFiServer* DirConManager::tcpServer = nullptr;
-uint8_t DirConManager::receiveBuffer[DIRCON_MAX_CLIENTS][DIRCON_RECEIVE_BUFFER_SIZE];
-size_t DirConManager::receiveBufferLength[DIRCON_MAX_CLIENTS] = {0};
 uint8_t DirConManager::sendBuffer[DIRCON_SEND_BUFFER_SIZE];
-uint8_t DirConManager::lastSequenceNumber[DIRCON_MAX_CLIENTS]                           = {0};
-bool DirConManager::clientSubscriptions[DIRCON_MAX_CLIENTS][DIRCON_MAX_CHARACTERISTICS] = {false};
+uint32_t DirConManager::subscriberMask[DIRCON_MAX_CHARACTERISTICS] = {0};
+SemaphoreHandle_t DirConManager::stateMutex                        = nullptr;
+DirConLatencyStats DirConManager::requestLatency                   = {};
+DirConLatencyStats DirConManager::messageLatency[DIRCON_STATS_MESSAGE_TYPES] = {};
+DirConLatencyStats DirConManager::notifyFanout                     = {};
+uint32_t DirConManager::connectionCount                            = 0;
+uint32_t DirConManager::reconnectCount                             = 0;
+NimBLECharacteristic* DirConManager::diagnosticsCharacteristic     = nullptr;
+TaskHandle_t DirConManager::dirConTaskHandle = nullptr;
+std::atomic<int> DirConManager::wakeSocket(-1);
+struct sockaddr_in DirConManager::wakeAddress = {};
+std::atomic<bool> DirConManager::wakePending(false);
+DirConNotificationQueue DirConManager::notificationQueue;
+std::atomic<TaskHandle_t> DirConManager::notificationProducer(nullptr);
+std::atomic<uint32_t> DirConManager::foreignNotifications(0);
+DirConLatencyStats DirConManager::controlPointLatency              = {};
+DirConSnapshot<DirConLatencyStats> DirConManager::controlPointLatencySnapshot;
+DirConSnapshot<DirConDiagnostics> DirConManager::diagnostics;
+uint32_t DirConManager::controlPointRefused                        = 0;
+DirConCharacteristicRegistry DirConManager::characteristicRegistry;
+std::atomic<bool> DirConManager::registryBuilt(false);
+DirConMdnsAnnouncer DirConManager::mdnsAnnouncer;
+DirConCapture DirConManager::capture;
+std::atomic<uint8_t> DirConManager::captureRequest(DirConManager::CaptureNone);
+std::atomic<bool> DirConManager::captureRecording(false);
+const DirConCharacteristicEntry* DirConManager::controlPointEntry = nullptr;
+
+// Holds stateMutex for the lifetime of the scope. Recursive, so the locking getters can be used from
+// code that already holds it.
+class DirConLock {
+ public:
+  explicit DirConLock(SemaphoreHandle_t mutex) : mutex(mutex) {
+    if (mutex != nullptr) {
+      xSemaphoreTakeRecursive(mutex, portMAX_DELAY);
+    }
+  }
+  ~DirConLock() {
+    if (mutex != nullptr) {
+      xSemaphoreGiveRecursive(mutex);
+    }
+  }
 
-// Static buffer to store the list of UUIDs to avoid dynamic string allocations
-static char uuidListBuffer[128] = "";
-static size_t uuidListLength    = 0;
+ private:
+  SemaphoreHandle_t mutex;
+};
 
 bool DirConManager::start() {
   if (!started) {
+    if (stateMutex == nullptr) {
+      stateMutex = xSemaphoreCreateRecursiveMutex();
+    }
+    DirConLock lock(stateMutex);
+
     // Initialize buffers
     for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
-      receiveBufferLength[i] = 0;
-      lastSequenceNumber[i]  = 0;
-      for (int j = 0; j < DIRCON_MAX_CHARACTERISTICS; j++) {
-        clientSubscriptions[i][j] = false;
-      }
+      clients[i].reset();
+      clients[i].active                = false;
+      clients[i].flushCount            = 0;
+      clients[i].flushedBytes          = 0;
+      clients[i].replacedFrames        = 0;
+      clients[i].droppedFrames         = 0;
+      clients[i].partialWrites         = 0;
+      clients[i].receivedBytes         = 0;
+      clients[i].parseErrors           = 0;
+      clients[i].framerResyncs         = 0;
+      clients[i].framerDroppedBytes    = 0;
+      clients[i].framerOversizedFrames = 0;
+    }
+    for (int j = 0; j < DIRCON_MAX_CHARACTERISTICS; j++) {
+      subscriberMask[j] = 0;
     }
+    requestLatency = {};
+    for (int j = 0; j < DIRCON_STATS_MESSAGE_TYPES; j++) {
+      messageLatency[j] = {};
+    }
+    notifyFanout        = {};
+    controlPointLatency = {};
+    controlPointLatencySnapshot.publish(controlPointLatency);
+    controlPointRefused = 0;
+    connectionCount     = 0;
+    reconnectCount      = 0;
+    publishDiagnostics();
+
+#ifdef DIRCON_CAPTURE_AT_START
+    // Record from the first connection, for problems that show up before anyone can send the capture command
+    captureRecording = capture.start();
+#endif
 
     // Setup MDNS service
     setupMDNS();
@@ -50,15 +121,30 @@ bool DirConManager::start() {
 
     tcpServer->begin();
 
+#ifdef DIRCON_EVENT_DRIVEN
+    if (!openWakeSocket()) {
+      SS2K_LOG(DIRCON_LOG_TAG, "No wake-up socket, outbound frames wait for the select() timeout");
+    }
+#endif
+
     started = true;
     updateStatusMessage();
     SS2K_LOG(DIRCON_LOG_TAG, "%s", statusMessage.c_str());
+    // All socket I/O happens on the DirCon task. A task left over from a quick stop()/start() picks up
+    // the restarted service by itself.
+    if (dirConTaskHandle == nullptr) {
+      xTaskCreate(dirConTask, "DirConTask", DIRCON_TASK_STACK_SIZE, nullptr, DIRCON_TASK_PRIORITY, &dirConTaskHandle);
+    }
+#ifdef DIRCON_BENCHMARK
+    DirConBenchmark::run();
+#endif
     return true;
   }
   return false;
 }
 
 void DirConManager::stop() {
+  DirConLock lock(stateMutex);
   if (started) {
     // Stop TCP server and disconnect clients
     if (tcpServer != nullptr) {
@@ -68,11 +154,33 @@ void DirConManager::stop() {
     }
 
     for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
-      if (dirConClients[i].connected()) {
-        dirConClients[i].stop();
+      if (clients[i].active) {
+        disconnectClient(i, "service stopped");
       }
     }
 
+    uint32_t flushes = getFlushCount();
+    SS2K_LOG(DIRCON_LOG_TAG, "Sent %lu bytes in %lu writes (%lu bytes per write)", (unsigned long)getFlushedBytes(), (unsigned long)flushes,
+             (unsigned long)(flushes ? getFlushedBytes() / flushes : 0));
+    SS2K_LOG(DIRCON_LOG_TAG, "Outbound frames: %lu replaced, %lu dropped, %lu partial writes", (unsigned long)getReplacedFrames(), (unsigned long)getDroppedFrames(),
+             (unsigned long)getPartialWrites());
+    SS2K_LOG(DIRCON_LOG_TAG, "Handled %lu requests, latency avg %lu us, max %lu us", (unsigned long)requestLatency.count, (unsigned long)requestLatency.averageMicros(),
+             (unsigned long)requestLatency.maxMicros);
+    DirConLatencyStats controlPoint = getControlPointLatency();
+    SS2K_LOG(DIRCON_LOG_TAG, "Carried out %lu control point writes, avg %lu us, max %lu us after the response, %lu refused", (unsigned long)controlPoint.count,
+             (unsigned long)controlPoint.averageMicros(), (unsigned long)controlPoint.maxMicros, (unsigned long)controlPointRefused);
+    DirConNotificationQueueStats queueStats = notificationQueue.getStats();
+    SS2K_LOG(DIRCON_LOG_TAG, "Notification queue: max depth %lu, dropped %lu, worst enqueue %lu us, %lu refused from other tasks", (unsigned long)queueStats.maxDepth,
+             (unsigned long)queueStats.dropped, (unsigned long)queueStats.maxEnqueueMicros, (unsigned long)foreignNotifications.load());
+    ControlPointQueueStats controlPointQueue = spinBLEServer.controlPointQueue.getStats();
+    SS2K_LOG(DIRCON_LOG_TAG, "Control point queue: max depth %lu, %lu refused, %lu carried out, %lu superseded, queued avg %lu us, max %lu us",
+             (unsigned long)controlPointQueue.maxDepth, (unsigned long)controlPointQueue.rejected, (unsigned long)controlPointQueue.processed,
+             (unsigned long)controlPointQueue.coalesced, (unsigned long)controlPointQueue.averageAgeMicros, (unsigned long)controlPointQueue.maxAgeMicros);
+
+    capture.stop();
+    captureRecording = false;
+    publishDiagnostics();
+    mdnsAnnouncer.setServiceRegistered(false);
     started = false;
     updateStatusMessage();
     SS2K_LOG(DIRCON_LOG_TAG, "%s", statusMessage.c_str());
@@ -80,6 +188,11 @@ void DirConManager::stop() {
 }
 
 void DirConManager::update() {
+  // The DirCon task does the work. Only service the sockets from here if it couldn't be created.
+  if (dirConTaskHandle != nullptr) {
+    return;
+  }
+
   // Return immediately unless DIRCON_MANAGER_DELAY has passed.
   static unsigned long lastUpdate = 0;
   if (millis() - lastUpdate < DIRCON_MANAGER_DELAY) {
@@ -91,18 +204,170 @@ void DirConManager::update() {
     return;
   }
 
+  // Anything found now may have arrived right after the previous poll
+  static unsigned long lastPoll = micros();
+  DirConLock lock(stateMutex);
+  serviceClients(lastPoll);
+  lastPoll = micros();
+}
+
+void DirConManager::serviceClients(unsigned long waitingSince) {
+  // Free the slots of dead clients first, so a reconnecting client finds one
+  checkClientHealth();
+
+  // Publish BLE service changes to mDNS once they settle
+  mdnsAnnouncer.update();
+
+  serviceCaptureRequest();
+
   // Check for new clients
   checkForNewClients();
 
   // Handle data from connected clients
-  handleClientData();
+  uint32_t requestsByMessage[DIRCON_STATS_MESSAGE_TYPES] = {0};
+  size_t requests                                       = handleClientData(requestsByMessage);
+
+  // Send the responses and notifications generated this tick
+  drainNotifications();
+  flushAll();
+
+  static unsigned long lastPublished = 0;
+  if (millis() - lastPublished >= DIRCON_DIAGNOSTICS_PUBLISH_MS) {
+    publishDiagnostics();
+    lastPublished = millis();
+  }
+
+  if (requests > 0) {
+    uint32_t latency = micros() - waitingSince;
+    requestLatency.add(latency, requests);
+    for (int j = 0; j < DIRCON_STATS_MESSAGE_TYPES; j++) {
+      if (requestsByMessage[j] > 0) {
+        messageLatency[j].add(latency, requestsByMessage[j]);
+      }
+    }
+  }
+}
+
+void DirConManager::dirConTask(void* parameter) {
+#ifndef DIRCON_EVENT_DRIVEN
+  unsigned long lastPoll = micros();
+#endif
+  while (true) {
+#ifdef DIRCON_EVENT_DRIVEN
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    int wakeFd = wakeSocket.load();
+    int maxFd  = -1;
+    if (wakeFd >= 0) {
+      FD_SET(wakeFd, &readSet);
+      maxFd = wakeFd;
+    }
+    {
+      DirConLock lock(stateMutex);
+      if (!started) {
+        break;
+      }
+      for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+        int fd = clients[i].socket.fd();
+        if (fd >= 0 && clients[i].socket.connected()) {
+          FD_SET(fd, &readSet);
+          maxFd = std::max(maxFd, fd);
+        }
+      }
+    }
+
+    // Sleep until a client sends something or flush() has frames to send. New connections are picked
+    // up on the timeout.
+    if (maxFd < 0) {
+      vTaskDelay(pdMS_TO_TICKS(DIRCON_SELECT_TIMEOUT_MS));
+    } else {
+      struct timeval timeout = {0, DIRCON_SELECT_TIMEOUT_MS * 1000};
+      if (select(maxFd + 1, &readSet, nullptr, nullptr, &timeout) > 0 && wakeFd >= 0 && FD_ISSET(wakeFd, &readSet)) {
+        drainWakeSocket();
+      }
+    }
+    unsigned long waitingSince = micros();
+#else
+    // Poll every DIRCON_MANAGER_DELAY, or straight away when flush() signals queued notifications.
+    // Anything found may have arrived right after the previous poll.
+    ulTaskNotifyTake(pdTRUE, std::max((TickType_t)pdMS_TO_TICKS(DIRCON_MANAGER_DELAY), (TickType_t)1));
+    unsigned long waitingSince = lastPoll;
+#endif
+
+    DirConLock lock(stateMutex);
+    if (!started) {
+      break;
+    }
+    serviceClients(waitingSince);
+#ifndef DIRCON_EVENT_DRIVEN
+    lastPoll = micros();
+#endif
+  }
+
+  dirConTaskHandle = nullptr;
+  vTaskDelete(nullptr);
+}
+
+bool DirConManager::openWakeSocket() {
+  if (wakeSocket.load() >= 0) {
+    return true;
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  // Any free port on the loopback interface, read back for flush() to send to
+  struct sockaddr_in address = {};
+  address.sin_family         = AF_INET;
+  address.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+  address.sin_port           = 0;
+  socklen_t addressLength    = sizeof(address);
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || getsockname(fd, (struct sockaddr*)&address, &addressLength) < 0) {
+    close(fd);
+    return false;
+  }
+  wakeAddress = address;
+  wakeSocket.store(fd);
+  return true;
+}
+
+void DirConManager::drainWakeSocket() {
+  // Clear the flag first, so a flush() from here on sends a new byte rather than being missed
+  wakePending = false;
+  uint8_t discard[8];
+  while (recv(wakeSocket.load(), discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+  }
+}
+
+const uint32_t DirConLatencyStats::bucketBounds[DIRCON_HISTOGRAM_BUCKETS] = {250, 500, 1000, 2000, 5000, 10000, 20000, UINT32_MAX};
+
+void DirConLatencyStats::add(uint32_t latencyMicros, uint32_t requests) {
+  count += requests;
+  totalMicros += latencyMicros * requests;
+  maxMicros = std::max(maxMicros, latencyMicros);
+
+  size_t bucket = 0;
+  while (latencyMicros > bucketBounds[bucket]) {
+    bucket++;
+  }
+  buckets[bucket] += requests;
+}
+
+DirConLatencyStats DirConManager::getRequestLatency() {
+  DirConLock lock(stateMutex);
+  return requestLatency;
+}
+
+DirConLatencyStats DirConManager::getNotifyFanout() {
+  DirConLock lock(stateMutex);
+  return notifyFanout;
 }
 
 // returns true if we have clients connected
 int DirConManager::connectedClients() {
   int connectedClients = 0;
   for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
-    if (dirConClients[i].connected()) {
+    if (clients[i].socket.connected()) {
       connectedClients++;
     }
   }
@@ -146,53 +411,15 @@ void DirConManager::setupMDNS() {
   MDNS.addServiceTxt(DIRCON_MDNS_SERVICE_NAME, DIRCON_MDNS_SERVICE_PROTOCOL, "mac-address", (const char*)macAddress);
   MDNS.addServiceTxt(DIRCON_MDNS_SERVICE_NAME, DIRCON_MDNS_SERVICE_PROTOCOL, "serial-number", (const char*)serialNumber);
 
-  // Add BLE service UUIDs that this device supports
-  // Initially empty, will be updated when BLE is initialized
-  MDNS.addServiceTxt(DIRCON_MDNS_SERVICE_NAME, DIRCON_MDNS_SERVICE_PROTOCOL, "ble-service-uuids", "");
+  // BLE service UUIDs that this device supports. Announced from serviceClients() once BLE is set up.
+  mdnsAnnouncer.setServiceRegistered(true);
+  mdnsAnnouncer.update();
 
   SS2K_LOG(DIRCON_LOG_TAG, "DirCon MDNS service setup complete");
 }
 void DirConManager::addBleServiceUuid(const NimBLEUUID& serviceUuid) {
-  if (!started) {
-    return;
-  }
-
-  // Create a non-const copy we can call to16() on
-  NimBLEUUID uuid(serviceUuid);
-
-  // Get the 16-bit UUID string representation
-  std::string uuidStr   = uuid.to16().toString();
-  const char* shortUuid = uuidStr.c_str();
-
-  // Check if UUID is already in the list
-  if (strstr(uuidListBuffer, shortUuid) != nullptr) {
-    // UUID already added
-    return;
-  }
-
-  // Calculate if we have enough space for the UUID plus a comma
-  size_t shortUuidLen  = strlen(shortUuid);
-  bool needComma       = (uuidListLength > 0);
-  size_t requiredSpace = shortUuidLen + (needComma ? 1 : 0);
-
-  // Ensure we have enough space
-  if (uuidListLength + requiredSpace >= sizeof(uuidListBuffer) - 1) {
-    SS2K_LOG(DIRCON_LOG_TAG, "Warning: Not enough space to add UUID %s", shortUuid);
-    return;
-  }
-
-  // Add comma if needed
-  if (needComma) {
-    uuidListBuffer[uuidListLength++] = ',';
-  }
-
-  // Add the UUID to our static buffer
-  strcpy(&uuidListBuffer[uuidListLength], shortUuid);
-  uuidListLength += shortUuidLen;
-
-  // Update the MDNS service TXT record with the updated BLE service UUIDs
-  SS2K_LOG(DIRCON_LOG_TAG, "Adding BLE service UUID %s to DirCon MDNS", shortUuid);
-  MDNS.addServiceTxt(DIRCON_MDNS_SERVICE_NAME, DIRCON_MDNS_SERVICE_PROTOCOL, "ble-service-uuids", (const char*)uuidListBuffer);
+  DirConLock lock(stateMutex);
+  mdnsAnnouncer.addService(serviceUuid);
 }
 
 void DirConManager::checkForNewClients() {
@@ -206,28 +433,40 @@ void DirConManager::checkForNewClients() {
   }
 
   // Find a free slot for the new client
-  bool clientAccepted = false;
-  int clientIndex     = -1;
-
-  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
-    if (!dirConClients[i].connected()) {
-      dirConClients[i] = newClient;
-      clientAccepted   = true;
-      clientIndex      = i;
-
-      // Clear receive buffer and subscription state
-      receiveBufferLength[i] = 0;
-      lastSequenceNumber[i]  = 0;
-      for (int j = 0; j < DIRCON_MAX_CHARACTERISTICS; j++) {
-        clientSubscriptions[i][j] = false;
-      }
-
+  int clientIndex = -1;
+  for (size_t i = 0; i < maxClients; i++) {
+    if (!clients[i].active) {
+      clientIndex = i;
       break;
     }
   }
 
+  // All taken. A half-open peer (e.g. a laptop gone to sleep) may be holding one, so let the
+  // newcomer replace a client that has gone quiet.
+  if (clientIndex < 0) {
+    clientIndex = findReclaimableSlot(newClient.remoteIP());
+    if (clientIndex >= 0) {
+      disconnectClient(clientIndex, "replaced by a new connection");
+    }
+  }
+
+  bool clientAccepted = clientIndex >= 0;
   if (clientAccepted) {
-    String clientIP = dirConClients[clientIndex].remoteIP().toString();
+    // Clear receive buffer and subscription state left over from the previous client
+    removeAllSubscriptions(clientIndex);
+    clients[clientIndex].reset();
+    configureSocket(newClient);
+    clients[clientIndex].socket       = newClient;
+    clients[clientIndex].active       = true;
+    clients[clientIndex].lastReceived = millis();
+    // Every connection after the first since start() is a client coming back
+    if (connectionCount++ > 0) {
+      reconnectCount++;
+    }
+
+    capture.record(DirConCaptureRecord::Connect, clientIndex, nullptr, 0);
+
+    String clientIP = clients[clientIndex].socket.remoteIP().toString();
     SS2K_LOG(DIRCON_LOG_TAG, "New DirCon client connected from %s, assigned slot %d", clientIP.c_str(), clientIndex);
     updateStatusMessage();
   } else {
@@ -236,80 +475,135 @@ void DirConManager::checkForNewClients() {
   }
 }
 
-void DirConManager::handleClientData() {
-  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
-    if (!dirConClients[i].connected()) {
-      continue;
+void DirConManager::configureSocket(WiFiClient& socket) {
+  int fd = socket.fd();
+  if (fd < 0) {
+    return;
+  }
+
+  // Small frames go out straight away instead of waiting for Nagle
+  int enable = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+  // Let TCP notice a peer that vanished without closing, e.g. a sleeping laptop or a dropped WiFi link
+  int idle     = DIRCON_KEEPALIVE_IDLE_S;
+  int interval = DIRCON_KEEPALIVE_INTERVAL_S;
+  int count    = DIRCON_KEEPALIVE_COUNT;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+int DirConManager::findReclaimableSlot(const IPAddress& newcomer) {
+  // A slot can go to a newcomer when its client is unhealthy: the socket is dead (keepalive gave up)
+  // or has stopped taking data. Otherwise only when its client has been quiet for a while, which is
+  // a shorter while for a newcomer from the same address, as that is most likely the same app
+  // coming back. A live session next to another app on the same machine keeps its slot either way
+  // as long as it is talking. Prefer the slot that has been silent the longest.
+  int reclaim             = -1;
+  unsigned long now       = millis();
+  unsigned long maxSilent = 0;
+  for (size_t i = 0; i < maxClients; i++) {
+    unsigned long silent = now - clients[i].lastReceived;
+    bool sameAddress     = clients[i].socket.remoteIP() == newcomer;
+    bool stalled         = clients[i].outboundLength > 0 && micros() - clients[i].outboundSince > DIRCON_RECLAIM_STALL_MS * 1000UL;
+    bool unhealthy       = !clients[i].socket.connected() || stalled;
+    bool quiet           = silent >= (sameAddress ? DIRCON_RECLAIM_SAME_ADDRESS_MS : DIRCON_RECLAIM_IDLE_MS);
+    if ((unhealthy || quiet) && (reclaim < 0 || silent > maxSilent)) {
+      reclaim   = i;
+      maxSilent = silent;
     }
+  }
+  return reclaim;
+}
 
-    // Check if client disconnected
-    if (!dirConClients[i].connected()) {
-      String clientIP = dirConClients[i].remoteIP().toString();
-      SS2K_LOG(DIRCON_LOG_TAG, "DirCon client %s disconnected", clientIP.c_str());
-      dirConClients[i].stop();
-      removeAllSubscriptions(i);
-      updateStatusMessage();
+void DirConManager::checkClientHealth() {
+  unsigned long now = millis();
+  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+    if (!clients[i].active) {
       continue;
     }
+    if (!clients[i].socket.connected()) {
+      disconnectClient(i, "disconnected");
+    } else if (idleTimeoutMs > 0 && now - clients[i].lastReceived > idleTimeoutMs) {
+      disconnectClient(i, "idle timeout");
+    } else if (clients[i].outboundLength > 0 && micros() - clients[i].outboundSince > DIRCON_WRITE_STALL_MS * 1000UL) {
+      // outboundSince moves on with every write the socket accepts
+      disconnectClient(i, "not reading");
+    }
+  }
+}
 
-    // Check if data is available
-    if (dirConClients[i].available()) {
-      // Read available data into buffer
-      while (dirConClients[i].available() && receiveBufferLength[i] < DIRCON_RECEIVE_BUFFER_SIZE) {
-        receiveBuffer[i][receiveBufferLength[i]] = dirConClients[i].read();
-        receiveBufferLength[i]++;
-      }
-
-      // Process messages in buffer
-      size_t processedBytes = 0;
-      while (processedBytes < receiveBufferLength[i]) {
-        DirConMessage message;
-        size_t parsedBytes = message.parse(receiveBuffer[i] + processedBytes, receiveBufferLength[i] - processedBytes, lastSequenceNumber[i]);
+void DirConManager::disconnectClient(size_t clientIndex, const char* reason) {
+  String clientIP = clients[clientIndex].socket.remoteIP().toString();
+  SS2K_LOG(DIRCON_LOG_TAG, "DirCon client %s in slot %d dropped: %s", clientIP.c_str(), clientIndex, reason);
+  clients[clientIndex].socket.stop();
+  clients[clientIndex].active = false;
+  capture.record(DirConCaptureRecord::Disconnect, clientIndex, nullptr, 0);
+  resetOutbound(clientIndex);
+  removeAllSubscriptions(clientIndex);
+  updateStatusMessage();
+}
 
-        if (parsedBytes == 0) {
-          // Not enough data for a complete message or invalid message
-          break;
-        }
+size_t DirConManager::handleClientData(uint32_t* requestsByMessage) {
+  size_t requests = 0;
+  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+    // Dead connections are cleaned up by checkClientHealth()
+    if (!clients[i].active || !clients[i].socket.connected()) {
+      continue;
+    }
 
-        // Process the message
-        if (message.Identifier != DIRCON_MSGID_ERROR) {
-          lastSequenceNumber[i] = message.SequenceNumber;
-          processDirConMessage(&message, i);
-        }
+    // Pull everything the client has sent, then handle every complete frame
+    size_t received = clients[i].framer.receive(clients[i].socket);
+    if (received > 0) {
+      clients[i].receivedBytes += received;
+      clients[i].lastReceived = millis();
+    }
 
-        processedBytes += parsedBytes;
+    size_t frameLength;
+    const uint8_t* frame;
+    // Leave requests in the framer until their response is sure to fit
+    while (makeOutboundRoom(i, DIRCON_RESPONSE_HEADROOM) && (frame = clients[i].framer.nextFrame(&frameLength)) != nullptr) {
+      capture.record(DirConCaptureRecord::Inbound, i, frame, frameLength);
+
+      // The view points into the framer, so it must be processed before the next frame is taken
+      DirConMessageView message;
+      if (message.parse(frame, frameLength, clients[i].lastSequenceNumber) == 0) {
+        // The frame is complete, so this is a malformed message rather than a partial one. Drop it.
+        clients[i].parseErrors++;
+        continue;
       }
 
-      // Remove processed bytes from buffer
-      if (processedBytes > 0) {
-        if (processedBytes < receiveBufferLength[i]) {
-          // Move remaining bytes to beginning of buffer
-          memmove(receiveBuffer[i], receiveBuffer[i] + processedBytes, receiveBufferLength[i] - processedBytes);
-          receiveBufferLength[i] -= processedBytes;
-        } else {
-          // All bytes processed
-          receiveBufferLength[i] = 0;
+      // Process the message
+      if (message.Identifier != DIRCON_MSGID_ERROR) {
+        clients[i].lastSequenceNumber = message.SequenceNumber;
+        processDirConMessage(message, i);
+        requests++;
+        if (message.Identifier >= DIRCON_MSGID_DISCOVER_SERVICES && message.Identifier <= DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS) {
+          requestsByMessage[message.Identifier - DIRCON_MSGID_DISCOVER_SERVICES]++;
         }
       }
     }
   }
+  return requests;
 }
 
-bool DirConManager::processDirConMessage(DirConMessage* message, size_t clientIndex) {
-  if (!message->Request) {
+bool DirConManager::processDirConMessage(const DirConMessageView& message, size_t clientIndex) {
+  if (!message.Request) {
     // We only process requests, not responses
     return false;
   }
   bool success = true;
-  DirConMessage response;
-  response.Request        = false;
-  response.SequenceNumber = message->SequenceNumber;
 
-  switch (message->Identifier) {
+  switch (message.Identifier) {
     case DIRCON_MSGID_DISCOVER_SERVICES: {
       // Handle service discovery
-      response.Identifier   = DIRCON_MSGID_DISCOVER_SERVICES;
-      response.ResponseCode = DIRCON_RESPCODE_SUCCESS_REQUEST;
+      DirConMessage response;
+      response.Request        = false;
+      response.SequenceNumber = message.SequenceNumber;
+      response.Identifier     = DIRCON_MSGID_DISCOVER_SERVICES;
+      response.ResponseCode   = DIRCON_RESPCODE_SUCCESS_REQUEST;
 
       // Get all service UUIDs
       std::vector<NimBLEUUID> services = getAvailableServices();
@@ -329,14 +623,17 @@ bool DirConManager::processDirConMessage(DirConMessage* message, size_t clientIn
 
     case DIRCON_MSGID_DISCOVER_CHARACTERISTICS: {
       // Handle characteristic discovery for a service
-      response.Identifier   = DIRCON_MSGID_DISCOVER_CHARACTERISTICS;
-      response.ResponseCode = DIRCON_RESPCODE_SUCCESS_REQUEST;
-      response.UUID         = message->UUID;
+      DirConMessage response;
+      response.Request        = false;
+      response.SequenceNumber = message.SequenceNumber;
+      response.Identifier     = DIRCON_MSGID_DISCOVER_CHARACTERISTICS;
+      response.ResponseCode   = DIRCON_RESPCODE_SUCCESS_REQUEST;
+      response.UUID           = message.getUUID();
 
       // Get BLE service
-      NimBLEService* service = NimBLEDevice::getServer()->getServiceByUUID(message->UUID);
+      NimBLEService* service = BLEHandleTable::findService(response.UUID);
       if (service == nullptr) {
-        sendErrorResponse(DIRCON_MSGID_DISCOVER_CHARACTERISTICS, message->SequenceNumber, DIRCON_RESPCODE_SERVICE_NOT_FOUND, clientIndex);
+        sendErrorResponse(DIRCON_MSGID_DISCOVER_CHARACTERISTICS, message.SequenceNumber, DIRCON_RESPCODE_SERVICE_NOT_FOUND, clientIndex);
         return false;
       }
 
@@ -345,7 +642,7 @@ bool DirConManager::processDirConMessage(DirConMessage* message, size_t clientIn
       for (NimBLECharacteristic* characteristic : characteristics) {
         if (characteristic != nullptr) {
           uint32_t properties = characteristic->getProperties();
-          uint8_t dirconProps = getDirConProperties(properties);
+          uint8_t dirconProps = DirConCharacteristicRegistry::toDirConProperties(properties);
           Serial.printf("Telling client %s is availiable", characteristic->getUUID().toString().c_str());
           response.AdditionalUUIDs.push_back(characteristic->getUUID());
           response.AdditionalData.push_back(dirconProps);
@@ -358,115 +655,97 @@ bool DirConManager::processDirConMessage(DirConMessage* message, size_t clientIn
 
     case DIRCON_MSGID_READ_CHARACTERISTIC: {
       // Handle characteristic read
-      response.Identifier   = DIRCON_MSGID_READ_CHARACTERISTIC;
-      response.ResponseCode = DIRCON_RESPCODE_SUCCESS_REQUEST;
-      response.UUID         = message->UUID;
-
-      // Use the helper function to find the characteristic
-      NimBLECharacteristic* characteristic = findCharacteristic(message->UUID);
+      const DirConCharacteristicEntry* entry = findCharacteristic(message.UUID);
 
-      if (characteristic == nullptr) {
-        sendErrorResponse(DIRCON_MSGID_READ_CHARACTERISTIC, message->SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_NOT_FOUND, clientIndex);
+      if (entry == nullptr) {
+        sendErrorResponse(DIRCON_MSGID_READ_CHARACTERISTIC, message.SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_NOT_FOUND, clientIndex);
         return false;
       }
 
       // Check if read is allowed based on properties
-      if (!(characteristic->getProperties() & NIMBLE_PROPERTY::READ)) {
-        sendErrorResponse(DIRCON_MSGID_READ_CHARACTERISTIC, message->SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_OPERATION_NOT_SUPPORTED, clientIndex);
+      if (!(entry->dirConProperties & DIRCON_CHAR_PROP_FLAG_READ)) {
+        sendErrorResponse(DIRCON_MSGID_READ_CHARACTERISTIC, message.SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_OPERATION_NOT_SUPPORTED, clientIndex);
         return false;
       }
 
-      // Read the value
-      NimBLEAttValue value = characteristic->getValue();
-      size_t length        = value.size();
-
-      for (size_t i = 0; i < length; i++) {
-        response.AdditionalData.push_back(value[i]);
+      // Read the value. NimBLE only hands out a copy of the attribute value.
+      if (entry->characteristic == diagnosticsCharacteristic) {
+        updateDiagnosticsCharacteristic();
       }
-
-      sendResponse(&response, clientIndex);
+      NimBLEAttValue value = entry->characteristic->getValue();
+      sendFrame(DIRCON_MSGID_READ_CHARACTERISTIC, message.SequenceNumber, DIRCON_RESPCODE_SUCCESS_REQUEST, message.UUID, value.data(), value.size(), clientIndex);
       break;
     }
 
     case DIRCON_MSGID_WRITE_CHARACTERISTIC: {
       // Handle characteristic write
-      response.Identifier   = DIRCON_MSGID_WRITE_CHARACTERISTIC;
-      response.ResponseCode = DIRCON_RESPCODE_SUCCESS_REQUEST;
-      response.UUID         = message->UUID;
+      const DirConCharacteristicEntry* entry = findCharacteristic(message.UUID);
 
-      // Use the helper function to find the characteristic
-      NimBLECharacteristic* characteristic = findCharacteristic(message->UUID);
-
-      if (characteristic == nullptr) {
-        sendErrorResponse(DIRCON_MSGID_WRITE_CHARACTERISTIC, message->SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_NOT_FOUND, clientIndex);
-        SS2K_LOG(DIRCON_LOG_TAG, "Write characteristic failed: characteristic %s not found", message->UUID.toString().c_str());
+      if (entry == nullptr) {
+        sendErrorResponse(DIRCON_MSGID_WRITE_CHARACTERISTIC, message.SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_NOT_FOUND, clientIndex);
+        SS2K_LOG(DIRCON_LOG_TAG, "Write characteristic failed: characteristic %s not found", message.getUUID().toString().c_str());
         return false;
       }
 
       // Check if write is allowed based on properties
-      if (!(characteristic->getProperties() & NIMBLE_PROPERTY::WRITE)) {
-        sendErrorResponse(DIRCON_MSGID_WRITE_CHARACTERISTIC, message->SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_OPERATION_NOT_SUPPORTED, clientIndex);
+      NimBLECharacteristic* characteristic = entry->characteristic;
+      if (!(entry->dirConProperties & DIRCON_CHAR_PROP_FLAG_WRITE)) {
+        sendErrorResponse(DIRCON_MSGID_WRITE_CHARACTERISTIC, message.SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_OPERATION_NOT_SUPPORTED, clientIndex);
         // log which characteristic failed
         SS2K_LOG(DIRCON_LOG_TAG, "Write operation not supported for characteristic %s", characteristic->getUUID().toString().c_str());
         return false;
       }
 
-      // Write the value (setValue doesn't return a status in NimBLE)
-      characteristic->setValue(message->AdditionalData.data(), message->AdditionalData.size());
-
-      // handle FTMS control Point Writes
-      if (characteristic->getUUID().equals(FITNESSMACHINECONTROLPOINT_UUID)) {
-        spinBLEServer.writeCache.push(characteristic->getValue());
-        fitnessMachineService.processFTMSWrite();
-        response.AdditionalData = characteristic->getValue();
+      // FTMS control point writes are answered straight away with the result code and carried out later
+      // on the BLE server task, see controlPointWriteDone(). Their indication follows from there.
+      if (entry == controlPointEntry) {
+        acceptControlPointWrite(message, clientIndex);
+        break;
       }
 
-      sendResponse(&response, clientIndex);
+      // Write the value (setValue doesn't return a status in NimBLE)
+      characteristic->setValue(message.AdditionalData, message.AdditionalDataLength);
+      sendFrame(DIRCON_MSGID_WRITE_CHARACTERISTIC, message.SequenceNumber, DIRCON_RESPCODE_SUCCESS_REQUEST, message.UUID, nullptr, 0, clientIndex);
       break;
     }
 
     case DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS: {
       // Handle notification subscription
-      response.Identifier   = DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS;
-      response.ResponseCode = DIRCON_RESPCODE_SUCCESS_REQUEST;
-      response.UUID         = message->UUID;
+      const DirConCharacteristicEntry* entry = findCharacteristic(message.UUID);
 
-      // Use the helper function to find the characteristic
-      NimBLECharacteristic* characteristic = findCharacteristic(message->UUID);
-
-      if (characteristic == nullptr) {
-        sendErrorResponse(DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS, message->SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_NOT_FOUND, clientIndex);
-        SS2K_LOG(DIRCON_LOG_TAG, "Enable notifications failed: characteristic %s not found", message->UUID.toString().c_str());
+      if (entry == nullptr) {
+        sendErrorResponse(DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS, message.SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_NOT_FOUND, clientIndex);
+        SS2K_LOG(DIRCON_LOG_TAG, "Enable notifications failed: characteristic %s not found", message.getUUID().toString().c_str());
         return false;
       }
 
       // Check if notifications are allowed based on properties
-      if (!(characteristic->getProperties() & NIMBLE_PROPERTY::NOTIFY)) {
-        sendErrorResponse(DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS, message->SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_OPERATION_NOT_SUPPORTED, clientIndex);
-        SS2K_LOG(DIRCON_LOG_TAG, "Notifications not supported for characteristic %s", characteristic->getUUID().toString().c_str());
+      if (!(entry->dirConProperties & DIRCON_CHAR_PROP_FLAG_NOTIFY)) {
+        sendErrorResponse(DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS, message.SequenceNumber, DIRCON_RESPCODE_CHARACTERISTIC_OPERATION_NOT_SUPPORTED, clientIndex);
+        SS2K_LOG(DIRCON_LOG_TAG, "Notifications not supported for characteristic %s", entry->characteristic->getUUID().toString().c_str());
         return false;
       }
 
       // Get enable/disable flag
       bool enableNotifications = false;
-      if (message->AdditionalData.size() > 0) {
-        enableNotifications = message->AdditionalData[0] != 0;
+      if (message.AdditionalDataLength > 0) {
+        enableNotifications = message.AdditionalData[0] != 0;
       }
 
       // Update subscription
       if (enableNotifications) {
-        addSubscription(clientIndex, message->UUID);
+        addSubscription(clientIndex, entry);
       } else {
-        removeSubscription(clientIndex, message->UUID);
+        removeSubscription(clientIndex, entry);
       }
 
-      sendResponse(&response, clientIndex);
+      sendFrame(DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS, message.SequenceNumber, DIRCON_RESPCODE_SUCCESS_REQUEST, message.UUID, nullptr, 0, clientIndex);
       break;
     }
 
     default:
       // Unknown message type
-      sendErrorResponse(message->Identifier, message->SequenceNumber, DIRCON_RESPCODE_UNKNOWN_MESSAGE_TYPE, clientIndex);
+      sendErrorResponse(message.Identifier, message.SequenceNumber, DIRCON_RESPCODE_UNKNOWN_MESSAGE_TYPE, clientIndex);
       success = false;
       break;
   }
@@ -474,17 +753,66 @@ bool DirConManager::processDirConMessage(DirConMessage* message, size_t clientIn
   return success;
 }
 
+void DirConManager::acceptControlPointWrite(const DirConMessageView& message, size_t clientIndex) {
+  uint8_t response[CONTROL_POINT_RESPONSE_MAX];
+  size_t responseLength = BLE_Fitness_Machine_Service::controlPointResponse(message.AdditionalData, message.AdditionalDataLength, response);
+
+  // Every write but an empty one is queued, including writes answered with an error, so the BLE side
+  // logs them and sends the same indication a BLE client would get.
+  if (responseLength > 0) {
+    ControlPointQueue& queue = spinBLEServer.controlPointQueue;
+    if (!queue.push(ControlPointSource::DirCon, message.AdditionalData, message.AdditionalDataLength, clientIndex, message.SequenceNumber)) {
+      SS2K_LOG(DIRCON_LOG_TAG, "Control point write %d from client %d refused, %lu writes outstanding", message.SequenceNumber, (int)clientIndex,
+               (unsigned long)queue.depth());
+      response[2]    = FitnessMachineControlPointResultCode::OperationFailed;
+      responseLength = 3;
+      controlPointRefused++;
+    }
+  }
+
+  sendFrame(DIRCON_MSGID_WRITE_CHARACTERISTIC, message.SequenceNumber, DIRCON_RESPCODE_SUCCESS_REQUEST, message.UUID, response, responseLength, clientIndex);
+}
+
+void DirConManager::controlPointWriteDone(const ControlPointCommand& command, bool superseded) {
+  uint32_t latency = micros() - command.enqueuedAt;
+  // BLE server task, only format a line for the slow ones; the histogram has the rest
+  if (latency >= FTMS_CONTROL_POINT_SLOW_MICROS) {
+    SS2K_LOG(DIRCON_LOG_TAG, "Control point write %d from client %d %s %lu us after its response", command.sequenceNumber, command.clientIndex,
+             superseded ? "superseded" : "done", (unsigned long)latency);
+  }
+
+  // Only this task adds to it, so no lock: a DirCon client stalling the DirCon task can't hold up the
+  // BLE server tick here
+  controlPointLatency.add(latency, 1);
+  controlPointLatencySnapshot.publish(controlPointLatency);
+}
+
+DirConLatencyStats DirConManager::getControlPointLatency() { return controlPointLatencySnapshot.read(); }
+
 void DirConManager::sendErrorResponse(uint8_t messageId, uint8_t sequenceNumber, uint8_t errorCode, size_t clientIndex) {
-  DirConMessage errorResponse;
-  errorResponse.Request        = false;
-  errorResponse.Identifier     = messageId;
-  errorResponse.SequenceNumber = sequenceNumber;
-  errorResponse.ResponseCode   = errorCode;
-  sendResponse(&errorResponse, clientIndex);
+  sendFrame(messageId, sequenceNumber, errorCode, nullptr, nullptr, 0, clientIndex);
+}
+
+void DirConManager::sendFrame(uint8_t messageId, uint8_t sequenceNumber, uint8_t responseCode, const uint8_t* uuid, const uint8_t* data, size_t length,
+                              size_t clientIndex) {
+  if (clientIndex >= DIRCON_MAX_CLIENTS || !clients[clientIndex].socket.connected()) {
+    SS2K_LOG(DIRCON_LOG_TAG, "Cannot send response - client %d is not connected", clientIndex);
+    return;
+  }
+
+  size_t encodedLength = DirConMessage::encodeFrame(sendBuffer, sizeof(sendBuffer), messageId, sequenceNumber, responseCode, uuid, data, length);
+  if (encodedLength > 0) {
+#ifdef DEBUG_DIRCON_MESSAGES
+    DirConMessage::printBytesToSerial(sendBuffer, encodedLength, false);
+#endif
+    queueOutbound(clientIndex, sendBuffer, encodedLength);
+  } else {
+    SS2K_LOG(DIRCON_LOG_TAG, "Error: No encoded message to send");
+  }
 }
 
 void DirConManager::sendResponse(DirConMessage* message, size_t clientIndex) {
-  if (clientIndex >= DIRCON_MAX_CLIENTS || !dirConClients[clientIndex].connected()) {
+  if (clientIndex >= DIRCON_MAX_CLIENTS || !clients[clientIndex].socket.connected()) {
     SS2K_LOG(DIRCON_LOG_TAG, "Cannot send response - client %d is not connected", clientIndex);
     return;
   }
@@ -500,67 +828,492 @@ void DirConManager::sendResponse(DirConMessage* message, size_t clientIndex) {
     }
   }
 
-  std::vector<uint8_t>* encodedMessage = message->encode(lastSequenceNumber[clientIndex]);
-  if (encodedMessage != nullptr && encodedMessage->size() > 0) {
-    // SS2K_LOG(DIRCON_LOG_TAG, "Sending %d bytes to client %d", encodedMessage->size(), clientIndex);
-    dirConClients[clientIndex].write(encodedMessage->data(), encodedMessage->size());
+  size_t encodedLength = message->encode(sendBuffer, sizeof(sendBuffer), clients[clientIndex].lastSequenceNumber);
+  if (encodedLength > 0) {
+    // SS2K_LOG(DIRCON_LOG_TAG, "Sending %d bytes to client %d", encodedLength, clientIndex);
+    queueOutbound(clientIndex, sendBuffer, encodedLength);
   } else {
     SS2K_LOG(DIRCON_LOG_TAG, "Error: No encoded message to send");
   }
 }
 
-void DirConManager::notifyCharacteristic(const NimBLEUUID& serviceUuid, const NimBLEUUID& characteristicUuid, uint8_t* data, size_t length) {
-  if (!started || !connectedClients()) {
+void DirConManager::notifyCharacteristic(const NimBLEUUID& serviceUuid, const NimBLEUUID& characteristicUuid, const uint8_t* data, size_t length) {
+  if (!started) {
     return;
   }
 
-  // We can skip the service lookup since we're only validating that the characteristic exists
-  // and we'll directly broadcast to all clients anyway
-  if (findCharacteristic(characteristicUuid) == nullptr) {
+  // The registry is keyed by characteristic UUID only, so the service isn't needed
+  uint8_t wireUuid[16];
+  uuidToBytes(characteristicUuid, wireUuid);
+  const DirConCharacteristicEntry* entry = findCharacteristic(wireUuid);
+  if (entry == nullptr) {
     return;
   }
 
   // Send notifications to subscribed clients
-  broadcastNotification(characteristicUuid, data, length);
+  publishNotification(entry, data, length);
 }
 
-void DirConManager::broadcastNotification(const NimBLEUUID& characteristicUuid, uint8_t* data, size_t length) {
-  // Create a single notification message that will be reused for all clients
-  static DirConMessage notification;  // Static to avoid repeated heap allocations
+void DirConManager::notifyCharacteristic(const NimBLECharacteristic* characteristic, const uint8_t* data, size_t length) {
+  if (!started) {
+    return;
+  }
 
-  // Initialize the notification once
-  notification.Request    = false;
-  notification.Identifier = DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION;
-  notification.UUID       = characteristicUuid;
+  // Nothing to notify before startBLEServer() has built the registry
+  if (!registryBuilt.load(std::memory_order_acquire)) {
+    return;
+  }
+  const DirConCharacteristicEntry* entry = characteristicRegistry.find(characteristic);
+  if (entry == nullptr) {
+    return;
+  }
+
+  publishNotification(entry, data, length);
+}
 
-  // Copy notification data (only done once)
-  notification.AdditionalData.clear();
-  notification.AdditionalData.reserve(length);  // Pre-allocate space to avoid reallocations
-  for (size_t j = 0; j < length; j++) {
-    notification.AdditionalData.push_back(data[j]);
+bool DirConManager::hasSubscribers(const NimBLECharacteristic* characteristic) {
+  if (!started || !registryBuilt.load(std::memory_order_acquire)) {
+    return false;
   }
+  const DirConCharacteristicEntry* entry = characteristicRegistry.find(characteristic);
+  return entry != nullptr && subscriberMask[entry->id] != 0;
+}
+
+void DirConManager::publishNotification(const DirConCharacteristicEntry* entry, const uint8_t* data, size_t length) {
+  // Skip the queue entirely when nobody listens. A single word read, safe from any task.
+  if (subscriberMask[entry->id] == 0) {
+    return;
+  }
+
+  // The queue has a single producer, the task bound by setNotificationProducer(). Refuse any other one.
+  if (xTaskGetCurrentTaskHandle() != notificationProducer.load(std::memory_order_acquire)) {
+    if (foreignNotifications++ == 0) {
+      SS2K_LOG(DIRCON_LOG_TAG, "Notification dropped, notifyCharacteristic() called outside the BLE server task");
+    }
+    return;
+  }
+
+  // Hand the frame to the DirCon task, never touch a socket from here
+  notificationQueue.push(entry, data, length);
+}
+
+void DirConManager::setNotificationProducer() { notificationProducer.store(xTaskGetCurrentTaskHandle(), std::memory_order_release); }
+
+void DirConManager::drainNotifications() {
+  const DirConQueuedNotification* notification;
+  while ((notification = notificationQueue.front()) != nullptr) {
+    broadcastNotification(notification->entry, notification->data, notification->length);
+    notificationQueue.pop();
+  }
+}
+
+bool DirConManager::startCapture(size_t size) {
+  DirConLock lock(stateMutex);
+  captureRecording = capture.start(size);
+  return captureRecording;
+}
+
+void DirConManager::stopCapture() {
+  DirConLock lock(stateMutex);
+  capture.stop();
+  captureRecording = false;
+}
+
+void DirConManager::requestCapture(bool record) { captureRequest = record ? CaptureStart : CaptureStopAndExport; }
+
+void DirConManager::serviceCaptureRequest() {
+  switch (captureRequest.exchange(CaptureNone)) {
+    case CaptureStart:
+      captureRecording = capture.start();
+      break;
+    case CaptureStopAndExport:
+      capture.stop();
+      captureRecording = false;
+      SS2K_LOG(DIRCON_LOG_TAG, "Writing the DirCon capture to Serial, %lu bytes", (unsigned long)capture.writeHexTo(Serial));
+      break;
+    default:
+      break;
+  }
+}
+
+size_t DirConManager::exportCapture(Print& out) {
+  // Holding the lock keeps the DirCon task from recording while the ring is written out
+  DirConLock lock(stateMutex);
+  return capture.writeTo(out);
+}
+
+DirConNotificationQueueStats DirConManager::getNotificationQueueStats() { return notificationQueue.getStats(); }
+
+// Serves the diagnostics characteristic's value fresh on every BLE read
+class DirConDiagnosticsCallbacks : public NimBLECharacteristicCallbacks {
+ public:
+  void onRead(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override {
+    uint8_t diagnostics[DIRCON_DIAGNOSTICS_LENGTH];
+    pCharacteristic->setValue(diagnostics, DirConManager::encodeDiagnostics(diagnostics, sizeof(diagnostics)));
+  }
+};
+
+void DirConManager::setupDiagnosticsCharacteristic(NimBLEService* service) {
+  static DirConDiagnosticsCallbacks diagnosticsCallbacks;
+  diagnosticsCharacteristic = service->createCharacteristic(SMARTSPIN2K_DIRCON_STATS_UUID, NIMBLE_PROPERTY::READ);
+  diagnosticsCharacteristic->setCallbacks(&diagnosticsCallbacks);
+}
+
+void DirConManager::updateDiagnosticsCharacteristic() {
+  // On the DirCon task, so the counters can be read as they are right now
+  uint8_t current[DIRCON_DIAGNOSTICS_LENGTH];
+  diagnosticsCharacteristic->setValue(current, writeDiagnostics(current));
+}
 
-  // Encode the message once
-  std::vector<uint8_t>* encodedMessage = notification.encode(0);
-  if (encodedMessage == nullptr || encodedMessage->size() == 0) {
-    return;  // Nothing to send
+static uint8_t* putUint16(uint8_t* out, uint32_t value) {
+  value  = std::min(value, (uint32_t)UINT16_MAX);
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+  return out + 2;
+}
+
+static uint8_t* putUint32(uint8_t* out, uint32_t value) {
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+  out[2] = (uint8_t)(value >> 16);
+  out[3] = (uint8_t)(value >> 24);
+  return out + 4;
+}
+
+static uint8_t* putLatency(uint8_t* out, const DirConLatencyStats& stats) {
+  out = putUint32(out, stats.count);
+  out = putUint32(out, stats.averageMicros());
+  out = putUint32(out, stats.maxMicros);
+  for (int i = 0; i < DIRCON_HISTOGRAM_BUCKETS; i++) {
+    out = putUint16(out, stats.buckets[i]);  // saturates at 65535
   }
+  return out;
+}
 
-  // Send to all connected clients
+size_t DirConManager::encodeDiagnostics(uint8_t* buffer, size_t size) {
+  if (size < DIRCON_DIAGNOSTICS_LENGTH) {
+    return 0;
+  }
+  DirConDiagnostics published = diagnostics.read();
+  memcpy(buffer, published.bytes, published.length);
+  return published.length;
+}
+
+void DirConManager::publishDiagnostics() {
+  DirConDiagnostics current;
+  current.length = writeDiagnostics(current.bytes);
+  diagnostics.publish(current);
+}
+
+size_t DirConManager::writeDiagnostics(uint8_t* buffer) {
+  uint32_t parseErrors     = 0;
+  uint32_t resyncs         = 0;
+  uint32_t droppedBytes    = 0;
+  uint32_t oversizedFrames = 0;
+  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+    parseErrors += clients[i].parseErrors;
+    resyncs += clients[i].getResyncCount();
+    droppedBytes += clients[i].getDroppedBytes();
+    oversizedFrames += clients[i].getOversizedFrameCount();
+  }
+
+  // Header: version, number of client slots
+  uint8_t* out = buffer;
+  *out++       = DIRCON_DIAGNOSTICS_VERSION;
+  *out++       = DIRCON_MAX_CLIENTS;
+
+  // Counters since start()
+  out = putUint32(out, connectionCount);
+  out = putUint32(out, reconnectCount);
+  out = putUint32(out, parseErrors);
+  out = putUint32(out, getReplacedFrames());
+  out = putUint32(out, getDroppedFrames());
+  out = putUint32(out, getPartialWrites());
+
+  // Framing errors since start(): header resyncs, bytes skipped while resyncing and frames too long
+  // to buffer, whose payload was discarded
+  out = putUint32(out, resyncs);
+  out = putUint32(out, droppedBytes);
+  out = putUint32(out, oversizedFrames);
+
+  // Control point writes from BLE and DirCon since boot: deepest queue, refused, carried out,
+  // superseded by a newer write, and the max and average time queued (us)
+  ControlPointQueueStats controlPointQueue = spinBLEServer.controlPointQueue.getStats();
+  out = putUint32(out, controlPointQueue.maxDepth);
+  out = putUint32(out, controlPointQueue.rejected);
+  out = putUint32(out, controlPointQueue.processed);
+  out = putUint32(out, controlPointQueue.coalesced);
+  out = putUint32(out, controlPointQueue.maxAgeMicros);
+  out = putUint32(out, controlPointQueue.averageAgeMicros);
+
+  // Notification fan-out time, then request latency for message ids 0x01 to 0x05. Each is count,
+  // average, max (us) and the DirConLatencyStats::bucketBounds histogram.
+  out = putLatency(out, notifyFanout);
+  for (int j = 0; j < DIRCON_STATS_MESSAGE_TYPES; j++) {
+    out = putLatency(out, messageLatency[j]);
+  }
+
+  // Bytes received and sent per client slot
   for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
-    if (!dirConClients[i].connected() || !hasSubscription(i, characteristicUuid)) {
+    out = putUint32(out, clients[i].receivedBytes);
+    out = putUint32(out, clients[i].flushedBytes);
+  }
+
+  return out - buffer;
+}
+
+void DirConManager::broadcastNotification(const DirConCharacteristicEntry* entry, const uint8_t* data, size_t length) {
+  size_t frameLength = DIRCON_NOTIFICATION_PREFIX_LENGTH + length;
+  if (frameLength > DIRCON_MAX_FRAME_LENGTH) {
+    SS2K_LOG(DIRCON_LOG_TAG, "Notification too large: %d bytes", length);
+    return;
+  }
+  uint16_t messageLength = 16 + length;
+  unsigned long startTime = micros();
+
+  // Build each frame in place from the characteristic's pre-encoded prefix. Only subscribed
+  // clients are visited, whatever the number of slots.
+  uint32_t entryBit = 1u << entry->id;
+  for (uint32_t subscribers = subscriberMask[entry->id]; subscribers != 0; subscribers &= subscribers - 1) {
+    int i = __builtin_ctz(subscribers);
+    if (!clients[i].socket.connected()) {
       continue;
     }
+
+    uint8_t* frame = nullptr;
+    if (clients[i].pendingNotifications & entryBit) {
+      // The previous sample was never sent. Overwrite it in place, or drop it if the size changed.
+      size_t offset        = clients[i].pendingOffset[entry->id];
+      uint8_t* pending     = clients[i].outboundBuffer + offset;
+      size_t pendingLength = DIRCON_MESSAGE_HEADER_LENGTH + ((pending[4] << 8) | pending[5]);
+      clients[i].replacedFrames++;
+      if (pendingLength == frameLength) {
+        frame = pending;
+      } else {
+        removeOutbound(i, offset, pendingLength);
+      }
+    }
+    if (frame == nullptr) {
+      frame = reserveOutbound(i, frameLength);
+      if (frame == nullptr) {
+        continue;
+      }
+      if (entry->latestValueWins) {
+        clients[i].pendingNotifications |= entryBit;
+        clients[i].pendingOffset[entry->id] = frame - clients[i].outboundBuffer;
+      }
+    }
+
+    memcpy(frame, entry->notificationPrefix, DIRCON_NOTIFICATION_PREFIX_LENGTH);
+    frame[4] = (uint8_t)(messageLength >> 8);
+    frame[5] = (uint8_t)(messageLength);
+    memcpy(frame + DIRCON_NOTIFICATION_PREFIX_LENGTH, data, length);
+    capture.record(DirConCaptureRecord::Outbound, i, frame, frameLength);
 #ifdef DEBUG_DIRCON_MESSAGES
-    bool sentDebug = false;
-    // Print the outgoing raw message bytes to serial
-    if (!sentDebug) DirConMessage::printVectorBytesToSerial(*encodedMessage, false);
-    sentDebug = true;
+    DirConMessage::printBytesToSerial(frame, frameLength, false);
+#endif
+  }
+  notifyFanout.add(micros() - startTime, 1);
+}
+
+uint8_t* DirConManager::reserveOutbound(size_t clientIndex, size_t length) {
+  if (!makeOutboundRoom(clientIndex, length)) {
+    clients[clientIndex].droppedFrames++;
+    SS2K_LOG(DIRCON_LOG_TAG, "Outbound buffer full, dropping %d byte frame for client %d", length, clientIndex);
+    return nullptr;
+  }
+
+  if (clients[clientIndex].outboundLength == 0) {
+    clients[clientIndex].outboundSince = micros();
+  }
+  uint8_t* reserved = clients[clientIndex].outboundBuffer + clients[clientIndex].outboundLength;
+  clients[clientIndex].outboundLength += length;
+  return reserved;
+}
+
+bool DirConManager::makeOutboundRoom(size_t clientIndex, size_t length) {
+  DirConClient& client = clients[clientIndex];
+  if (client.outboundLength + length <= DIRCON_OUTBOUND_BUFFER_SIZE) {
+    return true;
+  }
+
+  // Make room by sending what is already queued
+  flushClient(clientIndex);
+
+  // Then by giving up queued measurement samples, newer ones will follow
+  while (client.outboundLength + length > DIRCON_OUTBOUND_BUFFER_SIZE && client.pendingNotifications != 0) {
+    size_t id            = __builtin_ctz(client.pendingNotifications);
+    size_t offset        = client.pendingOffset[id];
+    const uint8_t* frame = client.outboundBuffer + offset;
+    removeOutbound(clientIndex, offset, DIRCON_MESSAGE_HEADER_LENGTH + ((frame[4] << 8) | frame[5]));
+    client.droppedFrames++;
+  }
+
+  return client.outboundLength + length <= DIRCON_OUTBOUND_BUFFER_SIZE;
+}
+
+void DirConManager::removeOutbound(size_t clientIndex, size_t offset, size_t length) {
+  DirConClient& client = clients[clientIndex];
+  memmove(client.outboundBuffer + offset, client.outboundBuffer + offset + length, client.outboundLength - offset - length);
+  client.outboundLength -= length;
+
+  // Forget the removed frame and move the pending ones that followed it
+  for (uint32_t pending = client.pendingNotifications; pending != 0; pending &= pending - 1) {
+    size_t id = __builtin_ctz(pending);
+    if (client.pendingOffset[id] == offset) {
+      client.pendingNotifications &= ~(1u << id);
+    } else if (client.pendingOffset[id] > offset) {
+      client.pendingOffset[id] -= length;
+    }
+  }
+}
+
+void DirConManager::queueOutbound(size_t clientIndex, const uint8_t* data, size_t length) {
+  uint8_t* reserved = reserveOutbound(clientIndex, length);
+  if (reserved != nullptr) {
+    memcpy(reserved, data, length);
+    capture.record(DirConCaptureRecord::Outbound, clientIndex, data, length);
+  }
+}
+
+void DirConManager::flush() {
+  // Wake the DirCon task to send what this tick queued. Without a task, send it from here.
+  if (dirConTaskHandle != nullptr) {
+#ifdef DIRCON_EVENT_DRIVEN
+    int fd = wakeSocket.load();
+    if (fd >= 0 && !wakePending.exchange(true)) {
+      uint8_t wake = 0;
+      sendto(fd, &wake, sizeof(wake), MSG_DONTWAIT, (const struct sockaddr*)&wakeAddress, sizeof(wakeAddress));
+    }
+#else
+    xTaskNotifyGive(dirConTaskHandle);
 #endif
-    dirConClients[i].write(encodedMessage->data(), encodedMessage->size());
+    return;
+  }
+  DirConLock lock(stateMutex);
+  drainNotifications();
+  flushAll();
+}
+
+void DirConManager::flushAll() {
+  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+    if (clients[i].outboundLength == 0) {
+      continue;
+    }
+    // Within the coalescing window keep collecting, unless the buffer is getting full
+    if (DIRCON_COALESCE_WINDOW_US > 0 && (micros() - clients[i].outboundSince) < DIRCON_COALESCE_WINDOW_US && clients[i].outboundLength < DIRCON_OUTBOUND_BUFFER_SIZE / 2) {
+      continue;
+    }
+    flushClient(i);
+  }
+}
+
+void DirConManager::flushClient(size_t clientIndex) {
+  if (clients[clientIndex].outboundLength == 0) {
+    return;
+  }
+  if (!clients[clientIndex].socket.connected()) {
+    resetOutbound(clientIndex);
+    return;
+  }
+
+  size_t written = clients[clientIndex].socket.write(clients[clientIndex].outboundBuffer, clients[clientIndex].outboundLength);
+  if (written == 0) {
+    return;  // Socket is backed up, try again next flush
+  }
+  clients[clientIndex].flushCount++;
+  clients[clientIndex].flushedBytes += written;
+
+  // Pending samples that went out, even partly, can no longer be replaced. The rest move to the front.
+  for (uint32_t pending = clients[clientIndex].pendingNotifications; pending != 0; pending &= pending - 1) {
+    size_t id = __builtin_ctz(pending);
+    if (clients[clientIndex].pendingOffset[id] < written) {
+      clients[clientIndex].pendingNotifications &= ~(1u << id);
+    } else {
+      clients[clientIndex].pendingOffset[id] -= written;
+    }
+  }
+
+  // Keep whatever the socket didn't take for the next flush
+  clients[clientIndex].outboundLength -= written;
+  if (clients[clientIndex].outboundLength > 0) {
+    clients[clientIndex].partialWrites++;
+    memmove(clients[clientIndex].outboundBuffer, clients[clientIndex].outboundBuffer + written, clients[clientIndex].outboundLength);
+    clients[clientIndex].outboundSince = micros();
   }
 }
 
+void DirConManager::resetOutbound(size_t clientIndex) {
+  clients[clientIndex].outboundLength       = 0;
+  clients[clientIndex].pendingNotifications = 0;
+}
+
+void DirConClient::reset() {
+  framerResyncs += framer.getResyncCount();
+  framerDroppedBytes += framer.getDroppedBytes();
+  framerOversizedFrames += framer.getOversizedFrameCount();
+  framer.reset();
+  lastSequenceNumber   = 0;
+  outboundLength       = 0;
+  outboundSince        = 0;
+  subscriptions        = 0;
+  pendingNotifications = 0;
+}
+
+void DirConManager::setIdleTimeout(uint32_t timeoutMs) {
+  idleTimeoutMs = timeoutMs;
+  SS2K_LOG(DIRCON_LOG_TAG, "DirCon idle timeout set to %lu ms", (unsigned long)idleTimeoutMs);
+}
+
+uint32_t DirConManager::getIdleTimeout() { return idleTimeoutMs; }
+
+void DirConManager::setMaxClients(size_t limit) {
+  maxClients = std::min(std::max(limit, (size_t)1), (size_t)DIRCON_MAX_CLIENTS);
+  SS2K_LOG(DIRCON_LOG_TAG, "DirCon client limit set to %d", maxClients);
+}
+
+size_t DirConManager::getMaxClients() { return maxClients; }
+
+uint32_t DirConManager::getFlushCount() {
+  uint32_t total = 0;
+  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+    total += clients[i].flushCount;
+  }
+  return total;
+}
+
+uint32_t DirConManager::getFlushedBytes() {
+  uint32_t total = 0;
+  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+    total += clients[i].flushedBytes;
+  }
+  return total;
+}
+
+uint32_t DirConManager::getReplacedFrames() {
+  uint32_t total = 0;
+  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+    total += clients[i].replacedFrames;
+  }
+  return total;
+}
+
+uint32_t DirConManager::getDroppedFrames() {
+  uint32_t total = 0;
+  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+    total += clients[i].droppedFrames;
+  }
+  return total;
+}
+
+uint32_t DirConManager::getPartialWrites() {
+  uint32_t total = 0;
+  for (int i = 0; i < DIRCON_MAX_CLIENTS; i++) {
+    total += clients[i].partialWrites;
+  }
+  return total;
+}
+
 // Static variable to hold the available services (initialized once)
 static std::vector<NimBLEUUID> cachedServices;
 static bool servicesInitialized = false;
@@ -583,6 +1336,10 @@ std::vector<NimBLEUUID> DirConManager::getAvailableServices() {
     NimBLEUUID ftmsUuid = NimBLEUUID(FITNESSMACHINESERVICE_UUID);
     cachedServices.push_back(ftmsUuid);
 
+    // For the DirCon stats characteristic
+    NimBLEUUID smartSpin2kUuid = NimBLEUUID(SMARTSPIN2K_SERVICE_UUID);
+    cachedServices.push_back(smartSpin2kUuid);
+
     // Log summary
     SS2K_LOG(DIRCON_LOG_TAG, "Initialized service discovery with %d services", cachedServices.size());
     servicesInitialized = true;
@@ -595,7 +1352,7 @@ std::vector<NimBLECharacteristic*> DirConManager::getCharacteristics(const NimBL
   std::vector<NimBLECharacteristic*> characteristics;
 
   // Get the service
-  NimBLEService* service = NimBLEDevice::getServer()->getServiceByUUID(serviceUuid);
+  NimBLEService* service = BLEHandleTable::findService(serviceUuid);
   if (service == nullptr) {
     return characteristics;
   }
@@ -631,75 +1388,48 @@ std::vector<NimBLECharacteristic*> DirConManager::getCharacteristics(const NimBL
   return characteristics;
 }
 
-NimBLECharacteristic* DirConManager::findCharacteristic(const NimBLEUUID& characteristicUuid) {
-  // Get cached services (doesn't allocate new memory)
-  const std::vector<NimBLEUUID>& services = getAvailableServices();
-
-  // Search through each service for the characteristic
-  for (const NimBLEUUID& serviceUuid : services) {
-    NimBLEService* service = NimBLEDevice::getServer()->getServiceByUUID(serviceUuid);
-    if (service != nullptr) {
-      NimBLECharacteristic* characteristic = service->getCharacteristic(characteristicUuid);
-      if (characteristic != nullptr) {
-        return characteristic;
-      }
-    }
-  }
-
-  return nullptr;
-}
-
-uint8_t DirConManager::getDirConProperties(uint32_t characteristicProperties) {
-  uint8_t properties = 0;
-
-  if (characteristicProperties & NIMBLE_PROPERTY::READ) {
-    properties |= DIRCON_CHAR_PROP_FLAG_READ;
-  }
-
-  if (characteristicProperties & NIMBLE_PROPERTY::WRITE) {
-    properties |= DIRCON_CHAR_PROP_FLAG_WRITE;
-  }
-
-  if (characteristicProperties & NIMBLE_PROPERTY::NOTIFY) {
-    properties |= DIRCON_CHAR_PROP_FLAG_NOTIFY;
+void DirConManager::buildCharacteristicRegistry() {
+  // Built once: subscriptions, queued notifications and the lock-free readers all hold on to its entries
+  if (registryBuilt.load(std::memory_order_acquire)) {
+    SS2K_LOG(DIRCON_LOG_TAG, "Characteristic registry already built, ignoring the rebuild");
+    return;
   }
-
-  return properties;
+  DirConLock lock(stateMutex);
+  characteristicRegistry.build(NimBLEDevice::getServer(), getAvailableServices());
+  uint8_t wireUuid[16];
+  uuidToBytes(FITNESSMACHINECONTROLPOINT_UUID, wireUuid);
+  controlPointEntry = characteristicRegistry.find(wireUuid);
+  registryBuilt.store(true, std::memory_order_release);
+  mdnsAnnouncer.setServicesReady();
 }
 
-size_t DirConManager::charSubscriptionIndex(const NimBLEUUID& characteristicUuid) {
-  // Simple hash function to get an index for the characteristic
-  // In a real implementation, this would be a proper data structure
-  std::string uuidStr = characteristicUuid.toString();
-  uint32_t hash       = 0;
-
-  for (char c : uuidStr) {
-    hash = ((hash << 5) + hash) + c;
+const DirConCharacteristicEntry* DirConManager::findCharacteristic(const uint8_t* wireUuid) {
+  // Empty until startBLEServer() has built it
+  if (!registryBuilt.load(std::memory_order_acquire)) {
+    return nullptr;
   }
-
-  return hash % DIRCON_MAX_CHARACTERISTICS;
+  return characteristicRegistry.find(wireUuid);
 }
 
-void DirConManager::addSubscription(size_t clientIndex, const NimBLEUUID& characteristicUuid) {
-  size_t index                            = charSubscriptionIndex(characteristicUuid);
-  clientSubscriptions[clientIndex][index] = true;
-  SS2K_LOG(DIRCON_LOG_TAG, "Client %d subscribed to characteristic %s", clientIndex, characteristicUuid.toString().c_str());
+void DirConManager::addSubscription(size_t clientIndex, const DirConCharacteristicEntry* entry) {
+  clients[clientIndex].subscriptions |= (1u << entry->id);
+  subscriberMask[entry->id] |= (1u << clientIndex);
+  SS2K_LOG(DIRCON_LOG_TAG, "Client %d subscribed to characteristic %s", clientIndex, entry->characteristic->getUUID().toString().c_str());
 }
 
-void DirConManager::removeSubscription(size_t clientIndex, const NimBLEUUID& characteristicUuid) {
-  size_t index                            = charSubscriptionIndex(characteristicUuid);
-  clientSubscriptions[clientIndex][index] = false;
-  SS2K_LOG(DIRCON_LOG_TAG, "Client %d unsubscribed from characteristic %s", clientIndex, characteristicUuid.toString().c_str());
+void DirConManager::removeSubscription(size_t clientIndex, const DirConCharacteristicEntry* entry) {
+  clients[clientIndex].subscriptions &= ~(1u << entry->id);
+  subscriberMask[entry->id] &= ~(1u << clientIndex);
+  SS2K_LOG(DIRCON_LOG_TAG, "Client %d unsubscribed from characteristic %s", clientIndex, entry->characteristic->getUUID().toString().c_str());
 }
 
 void DirConManager::removeAllSubscriptions(size_t clientIndex) {
-  for (int i = 0; i < DIRCON_MAX_CHARACTERISTICS; i++) {
-    clientSubscriptions[clientIndex][i] = false;
+  // Only visit the characteristics this client actually subscribed to
+  for (uint32_t subscribed = clients[clientIndex].subscriptions; subscribed != 0; subscribed &= subscribed - 1) {
+    subscriberMask[__builtin_ctz(subscribed)] &= ~(1u << clientIndex);
   }
+  clients[clientIndex].subscriptions = 0;
   SS2K_LOG(DIRCON_LOG_TAG, "Removed all subscriptions for client %d", clientIndex);
 }
 
-bool DirConManager::hasSubscription(size_t clientIndex, const NimBLEUUID& characteristicUuid) {
-  size_t index = charSubscriptionIndex(characteristicUuid);
-  return clientSubscriptions[clientIndex][index];
-}
+bool DirConManager::hasSubscription(size_t clientIndex, const DirConCharacteristicEntry* entry) { return (clients[clientIndex].subscriptions >> entry->id) & 1u; }
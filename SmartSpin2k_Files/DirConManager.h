@@ -11,17 +11,142 @@
 #include "Main.h"
 #include "BLE_Common.h"
 #include "DirConMessage.h"
+#include "DirConRegistry.h"
+#include "DirConFramer.h"
+#include "DirConNotificationQueue.h"
+#include "ControlPointQueue.h"
+#include "DirConMdns.h"
+#include "DirConCapture.h"
+#include "DirConBenchmark.h"
 #include <WiFi.h>
 #include <ESPmDNS.h>
+#include <lwip/sockets.h>
+#include <atomic>
 
 // DirCon protocol definitions
 #define DIRCON_MDNS_SERVICE_NAME     "_wahoo-fitness-tnp"
 #define DIRCON_MDNS_SERVICE_PROTOCOL "tcp"
 #define DIRCON_TCP_PORT              8081
-#define DIRCON_MAX_CLIENTS           1
-#define DIRCON_RECEIVE_BUFFER_SIZE   256
-#define DIRCON_SEND_BUFFER_SIZE      256
-#define DIRCON_MAX_CHARACTERISTICS   10   // maximum number of characteristics to track for subscriptions
+#ifndef DIRCON_MAX_CLIENTS
+#define DIRCON_MAX_CLIENTS           3     // client slots compiled in (at most 32), see DirConClient for the memory per slot
+#endif
+#define DIRCON_SEND_BUFFER_SIZE      320
+#define DIRCON_OUTBOUND_BUFFER_SIZE  1024  // per client, frames queued here are sent with one write per flush
+#ifndef DIRCON_COALESCE_WINDOW_US
+#define DIRCON_COALESCE_WINDOW_US    0     // 0 flushes every tick, otherwise hold frames up to this long
+#endif
+#define DIRCON_RESPONSE_HEADROOM     (2 * DIRCON_SEND_BUFFER_SIZE)  // outbound space a request needs before it is handled
+#define DIRCON_MAX_CHARACTERISTICS   DIRCON_REGISTRY_MAX_CHARACTERISTICS  // subscriptions are tracked per registry entry
+#define DIRCON_TASK_STACK_SIZE       4096
+#define DIRCON_TASK_PRIORITY         1
+#define DIRCON_SELECT_TIMEOUT_MS     20    // event driven mode: longest select() wait, and so how often new connections are accepted.
+                                           // Outbound frames don't wait for it, flush() wakes select() through wakeSocket.
+#define DIRCON_KEEPALIVE_IDLE_S      5     // TCP keepalive: first probe after this much silence
+#define DIRCON_KEEPALIVE_INTERVAL_S  1     // then one probe per interval
+#define DIRCON_KEEPALIVE_COUNT       3     // and the connection is dropped after this many unanswered probes
+#define DIRCON_IDLE_TIMEOUT_MS       0     // default for setIdleTimeout(), 0 keeps quiet clients connected
+#define DIRCON_WRITE_STALL_MS        3000  // drop a client whose socket hasn't taken any queued data for this long
+#define DIRCON_RECLAIM_IDLE_MS       1000  // with every slot taken, a newcomer may replace a client silent for this long
+#define DIRCON_RECLAIM_SAME_ADDRESS_MS 250  // or one from its own address silent for this long, likely its earlier connection
+#define DIRCON_RECLAIM_STALL_MS      500   // or any client whose socket hasn't taken queued data for this long
+#define DIRCON_HISTOGRAM_BUCKETS     8     // latency histogram buckets, bounds in DirConLatencyStats::bucketBounds
+#define DIRCON_STATS_MESSAGE_TYPES   5     // per message latency for DIRCON_MSGID_DISCOVER_SERVICES .. DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS
+#define DIRCON_DIAGNOSTICS_VERSION   3
+#define DIRCON_DIAGNOSTICS_PUBLISH_MS 100  // how often the DirCon task refreshes the diagnostics other tasks read
+#define DIRCON_DIAGNOSTICS_LENGTH    (2 + 15 * 4 + (1 + DIRCON_STATS_MESSAGE_TYPES) * (3 * 4 + DIRCON_HISTOGRAM_BUCKETS * 2) + DIRCON_MAX_CLIENTS * 2 * 4)
+
+static_assert(DIRCON_MAX_CLIENTS >= 1 && DIRCON_MAX_CLIENTS <= 32, "DIRCON_MAX_CLIENTS must fit the 32 bit subscriber masks");
+static_assert(DIRCON_MAX_CHARACTERISTICS <= 32, "DIRCON_MAX_CHARACTERISTICS must fit the 32 bit per client subscription set");
+static_assert(DIRCON_RESPONSE_HEADROOM <= DIRCON_OUTBOUND_BUFFER_SIZE, "DIRCON_OUTBOUND_BUFFER_SIZE must hold DIRCON_RESPONSE_HEADROOM");
+static_assert(DIRCON_DIAGNOSTICS_LENGTH <= DIRCON_SEND_BUFFER_SIZE - DIRCON_NOTIFICATION_PREFIX_LENGTH, "DirCon diagnostics must fit a read response");
+
+// Request latency, measured from the earliest moment a request could have been waiting on the socket
+// until its response is handed to the socket. When polling that is the previous poll, so the figure is an
+// upper bound that includes the poll interval. In event driven mode it is when select() woke up.
+// Also used for the notification fan-out time.
+struct DirConLatencyStats {
+  uint32_t count;
+  uint32_t totalMicros;
+  uint32_t maxMicros;
+  uint32_t buckets[DIRCON_HISTOGRAM_BUCKETS];  // count per latency range, see bucketBounds
+
+  // Upper bound of each bucket in microseconds, the last one takes everything above
+  static const uint32_t bucketBounds[DIRCON_HISTOGRAM_BUCKETS];
+
+  void add(uint32_t latencyMicros, uint32_t requests);
+  uint32_t averageMicros() const { return count ? totalMicros / count : 0; }
+};
+
+// Hands a value from the one task that updates it to readers on any other task without a lock, so a
+// reader never waits on the writer. The writer fills the copy readers aren't pointed at and then
+// flips the index; a reader can only get a torn copy if it is held up for two whole publishes.
+template <typename T>
+class DirConSnapshot {
+ public:
+  void publish(const T& value) {
+    uint32_t next = 1 - current.load(std::memory_order_relaxed);
+    copies[next]  = value;
+    current.store(next, std::memory_order_release);
+  }
+  T read() const { return copies[current.load(std::memory_order_acquire)]; }
+
+ private:
+  T copies[2] = {};
+  std::atomic<uint32_t> current{0};
+};
+
+// What encodeDiagnostics() hands out
+struct DirConDiagnostics {
+  uint8_t bytes[DIRCON_DIAGNOSTICS_LENGTH];
+  size_t length;
+};
+
+// Per connection state. Each slot is statically allocated and costs about 2.7 KiB:
+// DIRCON_RECEIVE_BUFFER_SIZE (1024) + DIRCON_MAX_FRAME_LENGTH (534) for the framer,
+// DIRCON_OUTBOUND_BUFFER_SIZE (1024) for coalesced sends, plus the socket handle,
+// subscriptions, pending notification offsets and counters.
+//
+// The outbound buffer is bounded and treats traffic by type. Responses are never dropped: a request
+// is only taken from the framer once DIRCON_RESPONSE_HEADROOM is free, otherwise it waits there and
+// TCP pushes back on the client. A measurement notification (see DirConCharacteristicEntry::latestValueWins)
+// overwrites the same characteristic's sample if that is still unsent, and queued measurements are the
+// first thing evicted when room is needed.
+struct DirConClient {
+  WiFiClient socket;
+  bool active;                 // slot is held, even if the socket has died since
+  unsigned long lastReceived;  // millis() of the last byte received, or of the connect
+  DirConFramer framer;
+  uint8_t lastSequenceNumber;
+  uint32_t subscriptions;  // bit per registry entry id
+
+  // Outbound coalescing
+  uint8_t outboundBuffer[DIRCON_OUTBOUND_BUFFER_SIZE];
+  size_t outboundLength;
+  unsigned long outboundSince;  // micros() when the oldest queued frame was added
+  uint32_t flushCount;
+  uint32_t flushedBytes;
+  uint32_t receivedBytes;
+  uint32_t parseErrors;  // complete frames that didn't parse
+  // The framer's counters from earlier connections, it starts again at zero on every reset()
+  uint32_t framerResyncs;
+  uint32_t framerDroppedBytes;
+  uint32_t framerOversizedFrames;
+
+  // Measurement notifications still waiting in outboundBuffer, by registry entry id
+  uint32_t pendingNotifications;
+  uint16_t pendingOffset[DIRCON_MAX_CHARACTERISTICS];
+  uint32_t replacedFrames;  // measurement samples overwritten by a newer one before being sent
+  uint32_t droppedFrames;   // frames evicted or refused for lack of room
+  uint32_t partialWrites;   // writes the socket only took part of
+
+  // Clear everything but the socket, the activity tracking and the lifetime counters
+  void reset();
+
+  // Framer counters since start(), across connections
+  uint32_t getResyncCount() const { return framerResyncs + framer.getResyncCount(); }
+  uint32_t getDroppedBytes() const { return framerDroppedBytes + framer.getDroppedBytes(); }
+  uint32_t getOversizedFrameCount() const { return framerOversizedFrames + framer.getOversizedFrameCount(); }
+};
 
 class DirConManager {
  public:
@@ -29,51 +154,184 @@ class DirConManager {
   static void stop();
   static void update();
 
-  // Add a BLE service UUID to DirCon MDNS service
+  // Add a BLE service UUID to the DirCon MDNS service. Can be called before start(); the list is
+  // announced once the BLE services are set up, see DirConMdnsAnnouncer.
   static void addBleServiceUuid(const NimBLEUUID& serviceUuid);
 
-  // Notify DirCon clients about BLE characteristic changes
-  static void notifyCharacteristic(const NimBLEUUID& serviceUuid, const NimBLEUUID& characteristicUuid, uint8_t* data, size_t length);
+  // Build the wire UUID lookup table. Called once by startBLEServer() after it has created the services;
+  // later calls are ignored. This also releases the first mDNS service announcement. Until then DirCon
+  // finds no characteristics and drops notifications.
+  static void buildCharacteristicRegistry();
+
+  // Make the calling task the only one allowed to notify, from startBLEServer() on the BLE server task
+  static void setNotificationProducer();
+
+  // Notify DirCon clients about BLE characteristic changes. BLE server task only: both overloads push
+  // into the single producer notificationQueue. Notifications from any task but the one bound by
+  // setNotificationProducer() are dropped and logged rather than racing it.
+  static void notifyCharacteristic(const NimBLEUUID& serviceUuid, const NimBLEUUID& characteristicUuid, const uint8_t* data, size_t length);
+  // Same, without any UUID conversion. Services publish through NotificationHub, which calls this.
+  static void notifyCharacteristic(const NimBLECharacteristic* characteristic, const uint8_t* data, size_t length);
+
+  // True if any DirCon client is subscribed to the characteristic. Safe from any task.
+  static bool hasSubscribers(const NimBLECharacteristic* characteristic);
+
+  // Limit the number of concurrent clients at runtime, between 1 and DIRCON_MAX_CLIENTS.
+  // Clients already connected above a lowered limit stay until they disconnect.
+  static void setMaxClients(size_t limit);
+  static size_t getMaxClients();
+
+  // Disconnect clients that send nothing for this long, 0 to disable. DirCon clients aren't required to
+  // send anything while only receiving notifications, so leave it disabled unless they all poll.
+  static void setIdleTimeout(uint32_t timeoutMs);
+  static uint32_t getIdleTimeout();
+
+  // Hand this tick's notifications to the DirCon task. Called at the end of every BLE server tick.
+  static void flush();
+
+  // Outbound coalescing statistics, summed over all clients
+  static uint32_t getFlushCount();
+  static uint32_t getFlushedBytes();
+  static uint32_t getReplacedFrames();
+  static uint32_t getDroppedFrames();
+  static uint32_t getPartialWrites();
+
+  // Request handling latency since start(), see DirConLatencyStats
+  static DirConLatencyStats getRequestLatency();
+  // Time spent queueing each notification for its subscribers since start(), count is notifications sent
+  static DirConLatencyStats getNotifyFanout();
+
+  // A control point write a DirCon client has already been answered for was carried out, or skipped
+  // because a newer one superseded it. Called by BLE_Fitness_Machine_Service::processFTMSWrite() on
+  // the BLE server task, which owns the FTMS state.
+  static void controlPointWriteDone(const ControlPointCommand& command, bool superseded);
+
+  // Time from answering a control point write to having carried it out, since start(). Safe from any
+  // task, it never waits for the DirCon task.
+  static DirConLatencyStats getControlPointLatency();
+
+  // Depth, drops and worst enqueue time of the BLE to DirCon task notification queue
+  static DirConNotificationQueueStats getNotificationQueueStats();
+
+  // Encode all counters and histograms for remote monitoring, DIRCON_DIAGNOSTICS_LENGTH bytes.
+  // Little endian, layout documented in writeDiagnostics(). Returns bytes written, 0 if it doesn't fit.
+  // Safe from any task, e.g. the NimBLE host task: it copies what the DirCon task last published, at
+  // most DIRCON_DIAGNOSTICS_PUBLISH_MS old, and never waits for stateMutex.
+  static size_t encodeDiagnostics(uint8_t* buffer, size_t size);
+
+  // Record the wire traffic of every client for later replay, see DirConCapture. Starting again discards
+  // the previous capture. Stopping keeps it for exportCapture(), which writes it to e.g. Serial or a file.
+  static bool startCapture(size_t size = DIRCON_CAPTURE_DEFAULT_SIZE);
+  static void stopCapture();
+  static size_t exportCapture(Print& out);
+
+  // Start or stop a capture from another task without waiting for the DirCon task, for the custom
+  // characteristic's capture command. Carried out on the next tick; stopping also writes the capture to
+  // Serial with DirConCapture::writeHexTo(). Building with DIRCON_CAPTURE_AT_START records from start().
+  static void requestCapture(bool record);
+  static bool isCapturing() { return captureRecording; }
+
+  // Add the read only diagnostics characteristic to the SmartSpin2k service, so the same encoding can be
+  // read over BLE or DirCon
+  static void setupDiagnosticsCharacteristic(NimBLEService* service);
 
  private:
+#ifdef DIRCON_BENCHMARK
+  friend class DirConBenchmark;
+#endif
+
   // Core functionality
   static bool started;
   static String statusMessage;
-  static WiFiClient dirConClients[DIRCON_MAX_CLIENTS];
+  static DirConClient clients[DIRCON_MAX_CLIENTS];
+  static size_t maxClients;
+  static uint32_t idleTimeoutMs;
   static WiFiServer* tcpServer;
   static void setupMDNS();
+  static DirConMdnsAnnouncer mdnsAnnouncer;
+  static DirConCapture capture;
+  enum CaptureRequest : uint8_t { CaptureNone, CaptureStart, CaptureStopAndExport };
+  static std::atomic<uint8_t> captureRequest;
+  static std::atomic<bool> captureRecording;  // capture.isRecording() for other tasks
+  static void serviceCaptureRequest();
   static void updateStatusMessage();
   static int connectedClients();
 
+  // Client state is owned by the DirCon task, which holds stateMutex while servicing the sockets.
+  // Public calls from other tasks (start/stop, statistics) take it as well. notifyCharacteristic()
+  // and hasSubscribers() don't: they only touch the lock-free notificationQueue and subscriberMask.
+  static SemaphoreHandle_t stateMutex;
+  static DirConLatencyStats requestLatency;
+  static DirConLatencyStats messageLatency[DIRCON_STATS_MESSAGE_TYPES];
+  static DirConLatencyStats notifyFanout;
+  static uint32_t connectionCount;
+  static uint32_t reconnectCount;
+  static TaskHandle_t dirConTaskHandle;
+  static DirConNotificationQueue notificationQueue;
+  static std::atomic<TaskHandle_t> notificationProducer;  // the task allowed to push into notificationQueue
+  static std::atomic<uint32_t> foreignNotifications;     // notifications refused from other tasks
+  static DirConLatencyStats controlPointLatency;  // owned by the BLE server task, published for the others
+  static DirConSnapshot<DirConLatencyStats> controlPointLatencySnapshot;
+  static uint32_t controlPointRefused;  // writes answered with OperationFailed, the control point queue was full
+  static void dirConTask(void* parameter);
+  // Event driven mode: the DirCon task sleeps in select(), where a task notification can't reach it.
+  // flush() sends a byte to this loopback UDP socket instead, which is in the select() read set.
+  static std::atomic<int> wakeSocket;  // -1 until opened by start(), then kept open
+  static struct sockaddr_in wakeAddress;
+  static std::atomic<bool> wakePending;  // a wake-up byte is in flight, flush() needn't send another
+  static bool openWakeSocket();
+  static void drainWakeSocket();
+  static void serviceClients(unsigned long waitingSince);
+  static void publishNotification(const DirConCharacteristicEntry* entry, const uint8_t* data, size_t length);
+  static void drainNotifications();
+
   // TCP connection handling
   static void checkForNewClients();
-  static void handleClientData();
-  static uint8_t receiveBuffer[DIRCON_MAX_CLIENTS][DIRCON_RECEIVE_BUFFER_SIZE];
-  static size_t receiveBufferLength[DIRCON_MAX_CLIENTS];
+  static void configureSocket(WiFiClient& socket);
+  static int findReclaimableSlot(const IPAddress& newcomer);
+  static void checkClientHealth();
+  static void disconnectClient(size_t clientIndex, const char* reason);
+  static size_t handleClientData(uint32_t* requestsByMessage);
   static uint8_t sendBuffer[DIRCON_SEND_BUFFER_SIZE];
 
+  // Outbound coalescing
+  static uint8_t* reserveOutbound(size_t clientIndex, size_t length);
+  static bool makeOutboundRoom(size_t clientIndex, size_t length);
+  static void removeOutbound(size_t clientIndex, size_t offset, size_t length);
+  static void queueOutbound(size_t clientIndex, const uint8_t* data, size_t length);
+  static void flushAll();
+  static void flushClient(size_t clientIndex);
+  static void resetOutbound(size_t clientIndex);
+
   // Message handling
-  static bool processDirConMessage(DirConMessage* message, size_t clientIndex);
+  static bool processDirConMessage(const DirConMessageView& message, size_t clientIndex);
+  static void acceptControlPointWrite(const DirConMessageView& message, size_t clientIndex);
   static void sendErrorResponse(uint8_t messageId, uint8_t sequenceNumber, uint8_t errorCode, size_t clientIndex);
   static void sendResponse(DirConMessage* message, size_t clientIndex);
-  static void broadcastNotification(const NimBLEUUID& characteristicUuid, uint8_t* data, size_t length);
+  static void sendFrame(uint8_t messageId, uint8_t sequenceNumber, uint8_t responseCode, const uint8_t* uuid, const uint8_t* data, size_t length, size_t clientIndex);
+  static void broadcastNotification(const DirConCharacteristicEntry* entry, const uint8_t* data, size_t length);
 
   // Service and characteristic handling
   static std::vector<NimBLEUUID> getAvailableServices();
   static std::vector<NimBLECharacteristic*> getCharacteristics(const NimBLEUUID& serviceUuid);
-  static uint8_t getDirConProperties(uint32_t characteristicProperties);
-  static NimBLECharacteristic* findCharacteristic(const NimBLEUUID& characteristicUuid);
+  static DirConCharacteristicRegistry characteristicRegistry;
+  static std::atomic<bool> registryBuilt;  // set once characteristicRegistry is complete, it never changes after
+  static const DirConCharacteristicEntry* controlPointEntry;
+  static const DirConCharacteristicEntry* findCharacteristic(const uint8_t* wireUuid);
+  static NimBLECharacteristic* diagnosticsCharacteristic;
+  static void updateDiagnosticsCharacteristic();
+  static DirConSnapshot<DirConDiagnostics> diagnostics;
+  static size_t writeDiagnostics(uint8_t* buffer);  // stateMutex held
+  static void publishDiagnostics();                 // stateMutex held
 
   // Subscription tracking
-  static bool clientSubscriptions[DIRCON_MAX_CLIENTS][DIRCON_MAX_CHARACTERISTICS];  // Simple subscription tracking
-  static size_t charSubscriptionIndex(const NimBLEUUID& characteristicUuid);
-  static void addSubscription(size_t clientIndex, const NimBLEUUID& characteristicUuid);
-  static void removeSubscription(size_t clientIndex, const NimBLEUUID& characteristicUuid);
+  // Indexed by registry entry id, so every exposed characteristic has its own bit and checks never
+  // touch the UUID.
+  static uint32_t subscriberMask[DIRCON_MAX_CHARACTERISTICS];  // bit per client, so notifications only visit subscribers
+  static void addSubscription(size_t clientIndex, const DirConCharacteristicEntry* entry);
+  static void removeSubscription(size_t clientIndex, const DirConCharacteristicEntry* entry);
   static void removeAllSubscriptions(size_t clientIndex);
-  static bool hasSubscription(size_t clientIndex, const NimBLEUUID& characteristicUuid);
-
-  // Sequence number tracking
-  static uint8_t lastSequenceNumber[DIRCON_MAX_CLIENTS];
+  static bool hasSubscription(size_t clientIndex, const DirConCharacteristicEntry* entry);
 };
 
 #endif  // DIRCONMANAGER_H
\ No newline at end of file
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "DirConMdns.h"
+#include "DirConManager.h"
+#include "SS2KLog.h"
+#include <ESPmDNS.h>
+
+#define DIRCON_MDNS_LOG_TAG "DirConMdns"
+
+DirConMdnsAnnouncer::DirConMdnsAnnouncer()
+    : serviceCount(0), serviceRegistered(false), servicesReady(false), published(false), announcedOnce(false), changedAt(0), publishCount(0) {}
+
+bool DirConMdnsAnnouncer::addService(const NimBLEUUID& serviceUuid) {
+  for (size_t i = 0; i < serviceCount; i++) {
+    if (services[i] == serviceUuid) {
+      return true;
+    }
+  }
+  if (serviceCount >= DIRCON_MDNS_MAX_SERVICES) {
+    SS2K_LOG(DIRCON_MDNS_LOG_TAG, "Service set full, %s not announced", serviceUuid.toString().c_str());
+    return false;
+  }
+
+  services[serviceCount++] = serviceUuid;
+  published                = false;
+  changedAt                = millis();
+  return true;
+}
+
+void DirConMdnsAnnouncer::setServiceRegistered(bool registered) {
+  serviceRegistered = registered;
+  // A new mDNS service record starts out without the list
+  published     = false;
+  announcedOnce = false;
+}
+
+void DirConMdnsAnnouncer::setServicesReady() { servicesReady = true; }
+
+void DirConMdnsAnnouncer::update() {
+  if (published || !serviceRegistered || !servicesReady) {
+    return;
+  }
+  // The first announcement goes out at once, later changes are collected first
+  if (announcedOnce && millis() - changedAt < DIRCON_MDNS_DEBOUNCE_MS) {
+    return;
+  }
+  publish();
+}
+
+void DirConMdnsAnnouncer::publish() {
+  char txt[DIRCON_MDNS_TXT_LENGTH + 1];
+  format(txt, sizeof(txt));
+
+  SS2K_LOG(DIRCON_MDNS_LOG_TAG, "Announcing BLE services: %s", txt);
+  MDNS.addServiceTxt(DIRCON_MDNS_SERVICE_NAME, DIRCON_MDNS_SERVICE_PROTOCOL, "ble-service-uuids", (const char*)txt);
+  published     = true;
+  announcedOnce = true;
+  publishCount++;
+}
+
+size_t DirConMdnsAnnouncer::format(char* buffer, size_t size) const {
+  size_t length = 0;
+  buffer[0]     = '\0';
+  for (size_t i = 0; i < serviceCount; i++) {
+    // to16() leaves UUIDs outside the Bluetooth base range at 128 bits
+    NimBLEUUID uuid(services[i]);
+    uuid.to16();
+    std::string uuidString = uuid.toString();
+
+    size_t required = uuidString.length() + (length > 0 ? 1 : 0);
+    if (length + required >= size) {
+      SS2K_LOG(DIRCON_MDNS_LOG_TAG, "TXT record full, %s not announced", uuidString.c_str());
+      continue;
+    }
+    if (length > 0) {
+      buffer[length++] = ',';
+    }
+    memcpy(buffer + length, uuidString.c_str(), uuidString.length() + 1);
+    length += uuidString.length();
+  }
+  return length;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <NimBLEUUID.h>
+
+#define DIRCON_MDNS_MAX_SERVICES  12   // BLE services that can be announced
+#define DIRCON_MDNS_TXT_LENGTH    238  // longest ble-service-uuids value, a TXT string holds 255 bytes including the key
+#define DIRCON_MDNS_DEBOUNCE_MS   500  // changes after the first announcement wait this long for more to arrive
+
+// Keeps the set of BLE service UUIDs announced in the DirCon mDNS "ble-service-uuids" TXT record.
+//
+// Adding services only updates the set. The record is written by update(), once when both the mDNS
+// service and the BLE services are ready, and afterwards only when the set changed and then stayed the
+// same for DIRCON_MDNS_DEBOUNCE_MS. Each write makes the responder announce, so at boot the whole
+// service list goes out in one announcement rather than one per service.
+class DirConMdnsAnnouncer {
+ public:
+  DirConMdnsAnnouncer();
+
+  // Returns false if the set is full. Adding a service already in the set does nothing.
+  bool addService(const NimBLEUUID& serviceUuid);
+
+  // The mDNS service record exists, the TXT record may be written
+  void setServiceRegistered(bool registered);
+  // All BLE services are set up, so the first announcement is complete
+  void setServicesReady();
+
+  // Write the TXT record if due. Cheap when there is nothing to do.
+  void update();
+
+  size_t size() const { return serviceCount; }
+  uint32_t getPublishCount() const { return publishCount; }
+
+ private:
+  NimBLEUUID services[DIRCON_MDNS_MAX_SERVICES];
+  size_t serviceCount;
+  bool serviceRegistered;
+  bool servicesReady;
+  bool published;  // the TXT record matches the set
+  bool announcedOnce;
+  unsigned long changedAt;
+  uint32_t publishCount;
+
+  // Comma separated list. Bluetooth base UUIDs in 16 bit form ("0x1826"), others as full 128 bit UUIDs.
+  size_t format(char* buffer, size_t size) const;
+  void publish();
+};
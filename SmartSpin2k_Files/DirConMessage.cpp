@@ -8,6 +8,7 @@
 #include "SS2KLog.h"
 #include "settings.h"
 #include "BLE_Common.h"
+#include "BLE_Handle_Table.h"
 
 #define DIRCON_LOG_TAG "DirConMessage"
 
@@ -35,18 +36,24 @@ void DirConMessage::printVectorBytesToSerial(const std::vector<uint8_t>& data, b
     printRawBytesToSerial(data.data(), data.size(), isIncoming);
   }
 }
+
+void DirConMessage::printBytesToSerial(const uint8_t* data, size_t length, bool isIncoming) {
+  if (length > 0) {
+    printRawBytesToSerial(data, length, isIncoming);
+  }
+}
 #endif
 
 // Helper functions for UUID conversion - matching the expected DirCon protocol format
-void uuidToBytes(NimBLEUUID& uuid, std::vector<uint8_t>& message) {
-  // Log the UUID being processed for debugging
-  //SS2K_LOG(DIRCON_LOG_TAG, "Processing UUID: %s", uuid.toString().c_str());
-
-  uint8_t *uuidBytes = (uint8_t*)uuid.to128().getBase();
+// Writes the 16 UUID bytes in wire (reversed) order to out. out must have room for 16 bytes.
+void uuidToBytes(const NimBLEUUID& uuid, uint8_t* out) {
+  // Work on a copy so the caller's UUID isn't converted in place. NimBLEUUID lives on the stack.
+  NimBLEUUID uuid128(uuid);
+  const uint8_t* uuidBytes = (const uint8_t*)uuid128.to128().getBase();
 
   // Add the bytes to the message
-  for(size_t i = 16; i > 0; i--) {
-    message.push_back(uuidBytes[i]);
+  for (size_t i = 16; i > 0; i--) {
+    *out++ = uuidBytes[i];
   }
 }
 
@@ -61,98 +68,129 @@ NimBLEUUID bytesToUuid(uint8_t* data, size_t offset) {
   return reversed;
 }
 
-DirConMessage::DirConMessage() {}
-
-std::vector<uint8_t>* DirConMessage::encode(uint8_t sequenceNumber) {
-  if (this->Identifier != DIRCON_MSGID_ERROR) {
-    this->encodedMessage.clear();
-    this->MessageVersion = 1;
+// Bounds checked cursor used by the encoder. Keeps counting past the end of the buffer so the
+// caller can tell how many bytes the message needs. A null buffer only counts.
+struct DirConEncodeCursor {
+  uint8_t* buffer;
+  size_t bufferSize;
+  size_t position;
 
-    // Handle sequence number logic
-    if (this->Request) {
-      if (this->SequenceNumber < 255) {
-        this->SequenceNumber++;
-      } else {
-        this->SequenceNumber = 0;
-      }
-    } else if (this->Identifier == DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION) {
-      this->SequenceNumber = 0;
-    } else {
-      this->SequenceNumber = sequenceNumber;
+  void putByte(uint8_t value) {
+    if (buffer != nullptr && position < bufferSize) {
+      buffer[position] = value;
     }
+    position++;
+  }
 
-    // Add message header
-    this->encodedMessage.push_back(this->MessageVersion);
-    this->encodedMessage.push_back(this->Identifier);
-    this->encodedMessage.push_back(this->SequenceNumber);
-    this->encodedMessage.push_back(this->ResponseCode);
-
-    // Handle error responses
-    if (!this->Request && this->ResponseCode != DIRCON_RESPCODE_SUCCESS_REQUEST) {
-      this->Length = 0;
-      this->encodedMessage.push_back((uint8_t)(this->Length >> 8));
-      this->encodedMessage.push_back((uint8_t)(this->Length));
+  void putLength(uint16_t length) {
+    putByte((uint8_t)(length >> 8));
+    putByte((uint8_t)(length));
+  }
+
+  void putUuid(const NimBLEUUID& uuid) {
+    if (buffer != nullptr && position + 16 <= bufferSize) {
+      uuidToBytes(uuid, buffer + position);
     }
-    // Handle discover services request/response
-    else if (this->Identifier == DIRCON_MSGID_DISCOVER_SERVICES) {
-      if (this->Request) {
-        this->Length = 0;
-        this->encodedMessage.push_back((uint8_t)(this->Length >> 8));
-        this->encodedMessage.push_back((uint8_t)(this->Length));
-      } else {
-        // Calculate length - each UUID is 16 bytes
-        this->Length = this->AdditionalUUIDs.size() * 16;
-        this->encodedMessage.push_back((uint8_t)(this->Length >> 8));
-        this->encodedMessage.push_back((uint8_t)(this->Length));
+    position += 16;
+  }
+};
 
-        // Debug log to show number of UUIDs being added
-        SS2K_LOG(DIRCON_LOG_TAG, "Adding %d service UUIDs to discovery response", this->AdditionalUUIDs.size());
+DirConMessage::DirConMessage() {}
 
-        // Add each UUID to the encoded message
-        for (size_t counter = 0; counter < this->AdditionalUUIDs.size(); counter++) {
-          NimBLEUUID& uuidToAdd = this->AdditionalUUIDs[counter];
-          SS2K_LOG(DIRCON_LOG_TAG, "Adding service %d UUID: %s", counter, uuidToAdd.toString().c_str());
+size_t DirConMessage::encodeInto(uint8_t* buffer, size_t bufferSize) const {
+  if (this->Identifier == DIRCON_MSGID_ERROR) {
+    return 0;
+  }
 
-          // Add the UUID bytes to the message
-          uuidToBytes(uuidToAdd, this->encodedMessage);
-        }
+  DirConEncodeCursor cursor = {buffer, bufferSize, 0};
+
+  // Add message header
+  cursor.putByte(this->MessageVersion);
+  cursor.putByte(this->Identifier);
+  cursor.putByte(this->SequenceNumber);
+  cursor.putByte(this->ResponseCode);
+
+  // Handle error responses
+  if (!this->Request && this->ResponseCode != DIRCON_RESPCODE_SUCCESS_REQUEST) {
+    cursor.putLength(0);
+  }
+  // Handle discover services request/response
+  else if (this->Identifier == DIRCON_MSGID_DISCOVER_SERVICES) {
+    if (this->Request) {
+      cursor.putLength(0);
+    } else {
+      // Calculate length - each UUID is 16 bytes
+      cursor.putLength(this->AdditionalUUIDs.size() * 16);
+      for (const NimBLEUUID& uuid : this->AdditionalUUIDs) {
+        cursor.putUuid(uuid);
       }
     }
-    // Handle discover characteristics response
-    else if (this->Identifier == DIRCON_MSGID_DISCOVER_CHARACTERISTICS && !this->Request) {
-      this->Length = 16 + this->AdditionalUUIDs.size() * 17;
-      this->encodedMessage.push_back((uint8_t)(this->Length >> 8));
-      this->encodedMessage.push_back((uint8_t)(this->Length));
-      uuidToBytes(this->UUID, this->encodedMessage);
-
-      size_t dataIndex = 0;
-      for (size_t counter = 0; counter < this->AdditionalUUIDs.size(); counter++) {
-        uuidToBytes(this->AdditionalUUIDs[counter], this->encodedMessage);
-        this->encodedMessage.push_back(this->AdditionalData[dataIndex]);
-        dataIndex++;
-      }
+  }
+  // Handle discover characteristics response
+  else if (this->Identifier == DIRCON_MSGID_DISCOVER_CHARACTERISTICS && !this->Request) {
+    cursor.putLength(16 + this->AdditionalUUIDs.size() * 17);
+    cursor.putUuid(this->UUID);
+    for (size_t counter = 0; counter < this->AdditionalUUIDs.size(); counter++) {
+      cursor.putUuid(this->AdditionalUUIDs[counter]);
+      cursor.putByte(counter < this->AdditionalData.size() ? this->AdditionalData[counter] : 0);
     }
-    // Handle read characteristic request or discover characteristics request or notification response
-    else if (((this->Identifier == DIRCON_MSGID_READ_CHARACTERISTIC || this->Identifier == DIRCON_MSGID_DISCOVER_CHARACTERISTICS) && this->Request) ||
-             (this->Identifier == DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS && !this->Request)) {
-      this->Length = 16;
-      this->encodedMessage.push_back((uint8_t)(this->Length >> 8));
-      this->encodedMessage.push_back((uint8_t)(this->Length));
-      uuidToBytes(this->UUID, this->encodedMessage);
+  }
+  // Handle read characteristic request or discover characteristics request or notification response
+  else if (((this->Identifier == DIRCON_MSGID_READ_CHARACTERISTIC || this->Identifier == DIRCON_MSGID_DISCOVER_CHARACTERISTICS) && this->Request) ||
+           (this->Identifier == DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS && !this->Request)) {
+    cursor.putLength(16);
+    cursor.putUuid(this->UUID);
+  }
+  // Handle write characteristic, unsolicited notification, read response, or notification enabling
+  else if (this->Identifier == DIRCON_MSGID_WRITE_CHARACTERISTIC || this->Identifier == DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION ||
+           (this->Identifier == DIRCON_MSGID_READ_CHARACTERISTIC && !this->Request) || (this->Identifier == DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS && this->Request)) {
+    cursor.putLength(16 + this->AdditionalData.size());
+    cursor.putUuid(this->UUID);
+    if (buffer != nullptr && cursor.position + this->AdditionalData.size() <= bufferSize) {
+      memcpy(buffer + cursor.position, this->AdditionalData.data(), this->AdditionalData.size());
     }
-    // Handle write characteristic, unsolicited notification, read response, or notification enabling
-    else if (this->Identifier == DIRCON_MSGID_WRITE_CHARACTERISTIC || this->Identifier == DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION ||
-             (this->Identifier == DIRCON_MSGID_READ_CHARACTERISTIC && !this->Request) || (this->Identifier == DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS && this->Request)) {
-      this->Length = 16 + this->AdditionalData.size();
-      this->encodedMessage.push_back((uint8_t)(this->Length >> 8));
-      this->encodedMessage.push_back((uint8_t)(this->Length));
-      uuidToBytes(this->UUID, this->encodedMessage);
-
-      for (size_t counter = 0; counter < this->AdditionalData.size(); counter++) {
-        this->encodedMessage.push_back(this->AdditionalData[counter]);
-      }
+    cursor.position += this->AdditionalData.size();
+  }
+
+  return cursor.position;
+}
+
+size_t DirConMessage::getEncodedLength() const { return this->encodeInto(nullptr, 0); }
+
+size_t DirConMessage::encode(uint8_t* buffer, size_t bufferSize, uint8_t sequenceNumber) {
+  if (this->Identifier == DIRCON_MSGID_ERROR) {
+    return 0;
+  }
+  this->MessageVersion = 1;
+
+  // Handle sequence number logic
+  if (this->Request) {
+    if (this->SequenceNumber < 255) {
+      this->SequenceNumber++;
+    } else {
+      this->SequenceNumber = 0;
     }
+  } else if (this->Identifier == DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION) {
+    this->SequenceNumber = 0;
+  } else {
+    this->SequenceNumber = sequenceNumber;
+  }
+
+  size_t encodedLength = this->encodeInto(buffer, bufferSize);
+  if (encodedLength > bufferSize) {
+    SS2K_LOG(DIRCON_LOG_TAG, "Error encoding DirCon message: %d bytes needed, buffer holds %d", encodedLength, bufferSize);
+    return 0;
   }
+  if (encodedLength >= DIRCON_MESSAGE_HEADER_LENGTH) {
+    this->Length = encodedLength - DIRCON_MESSAGE_HEADER_LENGTH;
+  }
+  return encodedLength;
+}
+
+std::vector<uint8_t>* DirConMessage::encode(uint8_t sequenceNumber) {
+  this->encodedMessage.resize(this->getEncodedLength());
+  size_t encodedLength = this->encode(this->encodedMessage.data(), this->encodedMessage.size(), sequenceNumber);
+  this->encodedMessage.resize(encodedLength);
   return &(this->encodedMessage);
 }
 
@@ -220,7 +258,7 @@ size_t DirConMessage::parse(uint8_t* data, size_t len, uint8_t sequenceNumber) {
           size_t index = 16;
           while (this->Length >= index + 17) {
             // Ensure consistent byte order for characteristic UUIDs
-            NimBLEService* pService                                   = spinBLEServer.pServer->getServiceByUUID(this->UUID);
+            NimBLEService* pService                                   = BLEHandleTable::findService(this->UUID);
             const std::vector<NimBLECharacteristic*> pCharacteristics = pService->getCharacteristics();
             for (NimBLECharacteristic* pCharacteristic : pCharacteristics) {
               this->AdditionalUUIDs.push_back(pCharacteristic->getUUID());
@@ -331,4 +369,121 @@ size_t DirConMessage::parse(uint8_t* data, size_t len, uint8_t sequenceNumber) {
 
 bool DirConMessage::isRequest(int sequenceNumber) {
   return this->ResponseCode == DIRCON_RESPCODE_SUCCESS_REQUEST && (sequenceNumber <= 0 || sequenceNumber != this->SequenceNumber);
+}
+
+size_t DirConMessage::encodeFrame(uint8_t* buffer, size_t bufferSize, uint8_t identifier, uint8_t sequenceNumber, uint8_t responseCode, const uint8_t* uuid,
+                                  const uint8_t* data, size_t dataLength) {
+  size_t length        = (uuid != nullptr ? 16 : 0) + dataLength;
+  size_t encodedLength = DIRCON_MESSAGE_HEADER_LENGTH + length;
+  if (encodedLength > bufferSize || length > UINT16_MAX) {
+    SS2K_LOG(DIRCON_LOG_TAG, "Error encoding DirCon frame: %d bytes needed, buffer holds %d", encodedLength, bufferSize);
+    return 0;
+  }
+
+  buffer[0] = 1;  // MessageVersion
+  buffer[1] = identifier;
+  buffer[2] = sequenceNumber;
+  buffer[3] = responseCode;
+  buffer[4] = (uint8_t)(length >> 8);
+  buffer[5] = (uint8_t)(length);
+
+  size_t position = DIRCON_MESSAGE_HEADER_LENGTH;
+  if (uuid != nullptr) {
+    memcpy(buffer + position, uuid, 16);
+    position += 16;
+  }
+  if (dataLength > 0) {
+    memcpy(buffer + position, data, dataLength);
+  }
+  return encodedLength;
+}
+
+size_t DirConMessageView::parse(const uint8_t* data, size_t len, uint8_t sequenceNumber) {
+  this->Identifier = DIRCON_MSGID_ERROR;
+  if (len < DIRCON_MESSAGE_HEADER_LENGTH) {
+    return 0;
+  }
+
+  this->MessageVersion       = data[0];
+  this->SequenceNumber       = data[2];
+  this->ResponseCode         = data[3];
+  this->Length               = (data[4] << 8) | data[5];
+  this->Request              = false;
+  this->UUID                 = nullptr;
+  this->AdditionalData       = nullptr;
+  this->AdditionalDataLength = 0;
+
+  if ((len - DIRCON_MESSAGE_HEADER_LENGTH) < this->Length) {
+    return 0;
+  }
+
+#ifdef DEBUG_DIRCON_MESSAGES
+  DirConMessage::printBytesToSerial(data, DIRCON_MESSAGE_HEADER_LENGTH + this->Length, true);
+#endif
+
+  const uint8_t* content = data + DIRCON_MESSAGE_HEADER_LENGTH;
+  bool isRequest         = this->ResponseCode == DIRCON_RESPCODE_SUCCESS_REQUEST && (sequenceNumber == 0 || sequenceNumber != this->SequenceNumber);
+  uint8_t identifier     = data[1];
+
+  switch (identifier) {
+    case DIRCON_MSGID_DISCOVER_SERVICES:
+      if (!this->Length) {
+        this->Request = isRequest;
+      } else if ((this->Length % 16) == 0) {
+        this->AdditionalData       = content;
+        this->AdditionalDataLength = this->Length;
+      } else {
+        SS2K_LOG(DIRCON_LOG_TAG, "Error parsing DirCon message: Length %d isn't a multiple of 16", this->Length);
+        return 0;
+      }
+      break;
+
+    case DIRCON_MSGID_DISCOVER_CHARACTERISTICS:
+    case DIRCON_MSGID_READ_CHARACTERISTIC:
+    case DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS:
+      if (this->Length < 16) {
+        SS2K_LOG(DIRCON_LOG_TAG, "Error parsing DirCon message: Length %d < 16", this->Length);
+        return 0;
+      }
+      if (this->Length == 16) {
+        this->Request = isRequest;
+      } else if (identifier == DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS) {
+        // A CCCD payload (typically 1-2 bytes) after the UUID is always a request
+        this->Request = true;
+      }
+      break;
+
+    case DIRCON_MSGID_WRITE_CHARACTERISTIC:
+    case DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION:
+      if (this->Length <= 16) {
+        SS2K_LOG(DIRCON_LOG_TAG, "Error parsing DirCon message: Length %d < 16", this->Length);
+        return 0;
+      }
+      if (identifier == DIRCON_MSGID_WRITE_CHARACTERISTIC) {
+        this->Request = isRequest;
+      }
+      break;
+
+    default:
+      SS2K_LOG(DIRCON_LOG_TAG, "Error parsing DirCon message: Unknown identifier %d", identifier);
+      return 0;
+  }
+
+  if (identifier != DIRCON_MSGID_DISCOVER_SERVICES) {
+    this->UUID                 = content;
+    this->AdditionalData       = content + 16;
+    this->AdditionalDataLength = this->Length - 16;
+  }
+  this->Identifier = identifier;
+
+  return DIRCON_MESSAGE_HEADER_LENGTH + this->Length;
+}
+
+NimBLEUUID DirConMessageView::getUUID() const {
+  if (this->UUID == nullptr) {
+    return NimBLEUUID();
+  }
+  NimBLEUUID uuid(this->UUID, 16);
+  uuid.reverseByteOrder();
+  return uuid;
 }
\ No newline at end of file
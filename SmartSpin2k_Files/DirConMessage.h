@@ -37,6 +37,10 @@
 #define DIRCON_RESPCODE_CHARACTERISTIC_WRITE_FAILED 0x06
 #define DIRCON_RESPCODE_UNKNOWN_PROTOCOL 0x07
 
+// Helper functions for UUID conversion between NimBLE and the DirCon wire format (reversed 128-bit)
+void uuidToBytes(const NimBLEUUID& uuid, uint8_t* out);
+NimBLEUUID bytesToUuid(uint8_t* data, size_t offset);
+
 class DirConMessage {
 public:
     DirConMessage();
@@ -53,15 +57,51 @@ public:
     
     // Encode message for sending to client
     std::vector<uint8_t>* encode(uint8_t sequenceNumber);
+
+    // Encode message directly into a caller supplied buffer (e.g. DirConManager::sendBuffer).
+    // Returns the number of bytes written, or 0 if the message doesn't fit. Never allocates.
+    size_t encode(uint8_t* buffer, size_t bufferSize, uint8_t sequenceNumber);
+
+    // Number of bytes encode() will write for the current message contents.
+    size_t getEncodedLength() const;
     
     // Parse received message data
     size_t parse(uint8_t* data, size_t len, uint8_t sequenceNumber);
 
+    // Encode a frame from raw parts: header, optional 16 byte wire-order UUID and optional payload.
+    // Covers every message except discovery responses. Returns bytes written, or 0 if it doesn't fit.
+    static size_t encodeFrame(uint8_t* buffer, size_t bufferSize, uint8_t identifier, uint8_t sequenceNumber, uint8_t responseCode, const uint8_t* uuid,
+                              const uint8_t* data, size_t dataLength);
+
     static void printVectorBytesToSerial(const std::vector<uint8_t>& data, bool isIncoming);
+    static void printBytesToSerial(const uint8_t* data, size_t length, bool isIncoming);
 
 private:
     bool isRequest(int last_seq_number);
+    size_t encodeInto(uint8_t* buffer, size_t bufferSize) const;
     std::vector<uint8_t> encodedMessage;
 };
 
+// Non-copying parse of a DirCon message. Header fields are decoded, while the UUID and payload
+// point into the buffer that was parsed, so that buffer must outlive the view.
+class DirConMessageView {
+public:
+    uint8_t MessageVersion = 0;
+    uint8_t Identifier = DIRCON_MSGID_ERROR;
+    uint8_t SequenceNumber = 0;
+    uint8_t ResponseCode = DIRCON_RESPCODE_SUCCESS_REQUEST;
+    uint16_t Length = 0;
+    const uint8_t* UUID = nullptr;            // 16 bytes in wire order, nullptr if the message has none
+    const uint8_t* AdditionalData = nullptr;  // Payload following the UUID (or the UUID list for discover services)
+    size_t AdditionalDataLength = 0;
+    bool Request = false;
+
+    // Same validation rules as DirConMessage::parse(). Returns the frame length, or 0 if the data is
+    // incomplete or invalid.
+    size_t parse(const uint8_t* data, size_t len, uint8_t sequenceNumber);
+
+    // Converts the wire UUID to a NimBLEUUID. Only needed for logging and NimBLE lookups.
+    NimBLEUUID getUUID() const;
+};
+
 #endif // DIRCONMESSAGE_H
\ No newline at end of file
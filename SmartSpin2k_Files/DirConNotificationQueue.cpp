@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "DirConNotificationQueue.h"
+
+DirConNotificationQueue::DirConNotificationQueue() : head(0), tail(0), maxDepth(0), dropped(0), maxEnqueueMicros(0) {}
+
+bool DirConNotificationQueue::push(const DirConCharacteristicEntry* entry, const uint8_t* data, size_t length) {
+  unsigned long startTime = micros();
+
+  uint32_t currentHead = head.load(std::memory_order_relaxed);
+  uint32_t depth       = currentHead - tail.load(std::memory_order_acquire);
+  if (depth >= DIRCON_NOTIFICATION_QUEUE_LENGTH || length > DIRCON_NOTIFICATION_MAX_LENGTH) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  DirConQueuedNotification& slot = slots[currentHead & (DIRCON_NOTIFICATION_QUEUE_LENGTH - 1)];
+  slot.entry                      = entry;
+  slot.length                     = (uint8_t)length;
+  memcpy(slot.data, data, length);
+  head.store(currentHead + 1, std::memory_order_release);
+
+  // Only the producer raises these, so plain compare-and-store is enough
+  if (depth + 1 > maxDepth.load(std::memory_order_relaxed)) {
+    maxDepth.store(depth + 1, std::memory_order_relaxed);
+  }
+  uint32_t elapsed = micros() - startTime;
+  if (elapsed > maxEnqueueMicros.load(std::memory_order_relaxed)) {
+    maxEnqueueMicros.store(elapsed, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+const DirConQueuedNotification* DirConNotificationQueue::front() const {
+  uint32_t currentTail = tail.load(std::memory_order_relaxed);
+  if (currentTail == head.load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+  return &slots[currentTail & (DIRCON_NOTIFICATION_QUEUE_LENGTH - 1)];
+}
+
+void DirConNotificationQueue::pop() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+DirConNotificationQueueStats DirConNotificationQueue::getStats(bool reset) {
+  DirConNotificationQueueStats stats;
+  stats.depth            = head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  stats.maxDepth         = maxDepth.load(std::memory_order_relaxed);
+  stats.dropped          = dropped.load(std::memory_order_relaxed);
+  stats.maxEnqueueMicros = maxEnqueueMicros.load(std::memory_order_relaxed);
+  if (reset) {
+    maxDepth.store(0, std::memory_order_relaxed);
+    dropped.store(0, std::memory_order_relaxed);
+    maxEnqueueMicros.store(0, std::memory_order_relaxed);
+  }
+  return stats;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+#include "DirConRegistry.h"
+
+#define DIRCON_NOTIFICATION_QUEUE_LENGTH 16  // slots, must be a power of two
+#define DIRCON_NOTIFICATION_MAX_LENGTH   64  // payload bytes per slot, larger notifications are dropped
+
+static_assert((DIRCON_NOTIFICATION_QUEUE_LENGTH & (DIRCON_NOTIFICATION_QUEUE_LENGTH - 1)) == 0, "DIRCON_NOTIFICATION_QUEUE_LENGTH must be a power of two");
+
+struct DirConQueuedNotification {
+  const DirConCharacteristicEntry* entry;
+  uint8_t length;
+  uint8_t data[DIRCON_NOTIFICATION_MAX_LENGTH];
+};
+
+struct DirConNotificationQueueStats {
+  uint32_t depth;               // notifications waiting right now
+  uint32_t maxDepth;            // high water mark
+  uint32_t dropped;             // queue full or payload too large
+  uint32_t maxEnqueueMicros;    // worst time spent in push()
+};
+
+// Lock-free single producer, single consumer ring carrying notifications from the BLE side to the
+// DirCon task. push() never blocks: when the ring is full the notification is dropped and counted.
+class DirConNotificationQueue {
+ public:
+  DirConNotificationQueue();
+
+  // Producer side, one task only. DirConManager enforces this in publishNotification().
+  bool push(const DirConCharacteristicEntry* entry, const uint8_t* data, size_t length);
+
+  // Consumer side. front() returns nullptr when empty; the slot stays valid until pop().
+  const DirConQueuedNotification* front() const;
+  void pop();
+
+  // Either side. Resets the high water mark, drop count and worst enqueue time when asked to.
+  DirConNotificationQueueStats getStats(bool reset = false);
+
+ private:
+  DirConQueuedNotification slots[DIRCON_NOTIFICATION_QUEUE_LENGTH];
+  std::atomic<uint32_t> head;  // next slot to write, only advanced by the producer
+  std::atomic<uint32_t> tail;  // next slot to read, only advanced by the consumer
+
+  std::atomic<uint32_t> maxDepth;
+  std::atomic<uint32_t> dropped;
+  std::atomic<uint32_t> maxEnqueueMicros;
+};
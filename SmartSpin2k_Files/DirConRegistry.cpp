@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "DirConRegistry.h"
+#include "DirConMessage.h"
+#include "SS2KLog.h"
+#include <Constants.h>
+
+#define DIRCON_REGISTRY_LOG_TAG "DirConRegistry"
+
+DirConCharacteristicRegistry::DirConCharacteristicRegistry() { clear(); }
+
+void DirConCharacteristicRegistry::clear() {
+  entryCount = 0;
+  memset(uuidSlots, -1, sizeof(uuidSlots));
+  memset(characteristicSlots, -1, sizeof(characteristicSlots));
+}
+
+void DirConCharacteristicRegistry::build(NimBLEServer* pServer, const std::vector<NimBLEUUID>& serviceUuids) {
+  clear();
+  if (pServer == nullptr) {
+    return;
+  }
+
+  for (const NimBLEUUID& serviceUuid : serviceUuids) {
+    NimBLEService* service = pServer->getServiceByUUID(serviceUuid);
+    if (service == nullptr) {
+      continue;
+    }
+    for (NimBLECharacteristic* characteristic : service->getCharacteristics()) {
+      if (characteristic != nullptr && !add(characteristic, service)) {
+        SS2K_LOG(DIRCON_REGISTRY_LOG_TAG, "Registry full, characteristic %s not exposed", characteristic->getUUID().toString().c_str());
+      }
+    }
+  }
+
+  SS2K_LOG(DIRCON_REGISTRY_LOG_TAG, "Registered %d characteristics", entryCount);
+}
+
+bool DirConCharacteristicRegistry::add(NimBLECharacteristic* characteristic, NimBLEService* service) {
+  if (entryCount >= DIRCON_REGISTRY_MAX_CHARACTERISTICS) {
+    return false;
+  }
+
+  DirConCharacteristicEntry& entry = entries[entryCount];
+  entry.id = (uint8_t)entryCount;
+  uuidToBytes(characteristic->getUUID(), entry.wireUuid);
+  entry.characteristic   = characteristic;
+  entry.service          = service;
+  entry.dirConProperties = toDirConProperties(characteristic->getProperties());
+  entry.latestValueWins  = isMeasurement(characteristic->getUUID());
+  DirConMessage::encodeFrame(entry.notificationPrefix, sizeof(entry.notificationPrefix), DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION, 0,
+                             DIRCON_RESPCODE_SUCCESS_REQUEST, entry.wireUuid, nullptr, 0);
+
+  // A characteristic UUID can appear in more than one service, DirCon addresses it by UUID only
+  // so the first one registered wins, matching the old service walk.
+  if (find(entry.wireUuid) != nullptr) {
+    return true;
+  }
+
+  // Linear probing. The tables are at least twice the entry count, so a free slot always exists.
+  size_t slot = hashUuid(entry.wireUuid);
+  while (uuidSlots[slot] >= 0) {
+    slot = (slot + 1) & (DIRCON_REGISTRY_TABLE_SIZE - 1);
+  }
+  uuidSlots[slot] = (int8_t)entryCount;
+
+  slot = hashPointer(characteristic);
+  while (characteristicSlots[slot] >= 0) {
+    slot = (slot + 1) & (DIRCON_REGISTRY_TABLE_SIZE - 1);
+  }
+  characteristicSlots[slot] = (int8_t)entryCount;
+
+  entryCount++;
+  return true;
+}
+
+const DirConCharacteristicEntry* DirConCharacteristicRegistry::find(const uint8_t* wireUuid) const {
+  if (wireUuid == nullptr) {
+    return nullptr;
+  }
+  for (size_t slot = hashUuid(wireUuid); uuidSlots[slot] >= 0; slot = (slot + 1) & (DIRCON_REGISTRY_TABLE_SIZE - 1)) {
+    const DirConCharacteristicEntry* entry = &entries[uuidSlots[slot]];
+    if (memcmp(entry->wireUuid, wireUuid, sizeof(entry->wireUuid)) == 0) {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+const DirConCharacteristicEntry* DirConCharacteristicRegistry::find(const NimBLECharacteristic* characteristic) const {
+  if (characteristic == nullptr) {
+    return nullptr;
+  }
+  for (size_t slot = hashPointer(characteristic); characteristicSlots[slot] >= 0; slot = (slot + 1) & (DIRCON_REGISTRY_TABLE_SIZE - 1)) {
+    const DirConCharacteristicEntry* entry = &entries[characteristicSlots[slot]];
+    if (entry->characteristic == characteristic) {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+size_t DirConCharacteristicRegistry::hashUuid(const uint8_t* wireUuid) {
+  // Fold the UUID into 32 bits, then Fibonacci hash. For Bluetooth base UUIDs only the first word
+  // differs, which the fold keeps intact.
+  uint32_t words[4];
+  memcpy(words, wireUuid, sizeof(words));
+  uint32_t hash = (words[0] ^ words[1] ^ words[2] ^ words[3]) * 2654435769u;
+  return (hash >> 16) & (DIRCON_REGISTRY_TABLE_SIZE - 1);
+}
+
+size_t DirConCharacteristicRegistry::hashPointer(const void* pointer) {
+  uint32_t hash = (uint32_t)((uintptr_t)pointer >> 2) * 2654435769u;
+  return (hash >> 16) & (DIRCON_REGISTRY_TABLE_SIZE - 1);
+}
+
+uint8_t DirConCharacteristicRegistry::toDirConProperties(uint32_t characteristicProperties) {
+  uint8_t properties = 0;
+
+  if (characteristicProperties & NIMBLE_PROPERTY::READ) {
+    properties |= DIRCON_CHAR_PROP_FLAG_READ;
+  }
+
+  if (characteristicProperties & NIMBLE_PROPERTY::WRITE) {
+    properties |= DIRCON_CHAR_PROP_FLAG_WRITE;
+  }
+
+  if (characteristicProperties & NIMBLE_PROPERTY::NOTIFY) {
+    properties |= DIRCON_CHAR_PROP_FLAG_NOTIFY;
+  }
+
+  return properties;
+}
+
+bool DirConCharacteristicRegistry::isMeasurement(const NimBLEUUID& characteristicUuid) {
+  // Control point indications and status changes are events and must all be delivered
+  return characteristicUuid == FITNESSMACHINEINDOORBIKEDATA_UUID || characteristicUuid == CYCLINGPOWERMEASUREMENT_UUID || characteristicUuid == CSCMEASUREMENT_UUID ||
+         characteristicUuid == HEARTCHARACTERISTIC_UUID;
+}
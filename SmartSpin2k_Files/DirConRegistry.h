@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <NimBLEDevice.h>
+#include <vector>
+
+#define DIRCON_REGISTRY_MAX_CHARACTERISTICS 32  // characteristics exposed over DirCon
+#define DIRCON_REGISTRY_TABLE_SIZE          64  // hash slots, power of two and at least twice the entries
+#define DIRCON_NOTIFICATION_PREFIX_LENGTH   22  // header + wire UUID
+
+// A characteristic exposed over DirCon, with everything the request and notification paths need
+// precomputed so they never touch NimBLEUUID or walk the service list.
+struct DirConCharacteristicEntry {
+  uint8_t id;                            // dense index in registration order, 0 .. size() - 1
+  uint8_t wireUuid[16];                  // UUID in DirCon wire order, ready to copy into frames
+  NimBLECharacteristic* characteristic;
+  NimBLEService* service;
+  uint8_t dirConProperties;              // DIRCON_CHAR_PROP_FLAG_*
+  bool latestValueWins;                  // periodic measurement, a newer sample replaces one still waiting to be sent
+  // Pre-encoded notification header and UUID. Only the length bytes (4 and 5) depend on the payload.
+  uint8_t notificationPrefix[DIRCON_NOTIFICATION_PREFIX_LENGTH];
+};
+
+// Lookup table from DirCon wire UUID bytes (or characteristic pointer) to the exposed
+// characteristic. Built once after the BLE server has created its services.
+class DirConCharacteristicRegistry {
+ public:
+  DirConCharacteristicRegistry();
+
+  // Register every characteristic of the given services. Replaces any previous contents.
+  void build(NimBLEServer* pServer, const std::vector<NimBLEUUID>& serviceUuids);
+  void clear();
+
+  // O(1) lookups. Return nullptr if the characteristic isn't exposed over DirCon.
+  const DirConCharacteristicEntry* find(const uint8_t* wireUuid) const;
+  const DirConCharacteristicEntry* find(const NimBLECharacteristic* characteristic) const;
+
+  size_t size() const { return entryCount; }
+
+  // Map NimBLE characteristic properties to DirCon property flags
+  static uint8_t toDirConProperties(uint32_t characteristicProperties);
+
+  // True for the measurement characteristics whose notifications are samples rather than events
+  static bool isMeasurement(const NimBLEUUID& characteristicUuid);
+
+ private:
+  DirConCharacteristicEntry entries[DIRCON_REGISTRY_MAX_CHARACTERISTICS];
+  size_t entryCount;
+  int8_t uuidSlots[DIRCON_REGISTRY_TABLE_SIZE];            // entry index, -1 if empty
+  int8_t characteristicSlots[DIRCON_REGISTRY_TABLE_SIZE];  // entry index, -1 if empty
+
+  static size_t hashUuid(const uint8_t* wireUuid);
+  static size_t hashPointer(const void* pointer);
+  bool add(NimBLECharacteristic* characteristic, NimBLEService* service);
+};
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "NotificationHub.h"
+#include "DirConManager.h"
+
+NotificationHub::Entry NotificationHub::entries[NotificationHubCharacteristic::Count] = {};
+
+void NotificationHub::registerCharacteristic(NotificationHubCharacteristic::Types id, NimBLECharacteristic* characteristic) {
+  entries[id].characteristic = characteristic;
+  entries[id].bleSubscribers.store(0, std::memory_order_relaxed);
+}
+
+bool NotificationHub::hasSubscribers(NotificationHubCharacteristic::Types id) {
+  const Entry& entry = entries[id];
+  if (entry.characteristic == nullptr) {
+    return false;
+  }
+  return entry.bleSubscribers.load(std::memory_order_relaxed) > 0 || DirConManager::hasSubscribers(entry.characteristic);
+}
+
+void NotificationHub::publish(NotificationHubCharacteristic::Types id, const uint8_t* data, size_t length) {
+  Entry& entry = entries[id];
+  if (entry.characteristic == nullptr) {
+    return;
+  }
+
+  // Always keep the value, so reads see it even when nobody is subscribed
+  entry.characteristic->setValue(data, length);
+  if (entry.bleSubscribers.load(std::memory_order_relaxed) > 0) {
+    entry.characteristic->notify();
+  }
+  // Returns straight away when no DirCon client is subscribed
+  DirConManager::notifyCharacteristic(entry.characteristic, data, length);
+}
+
+void NotificationHub::onSubscribe(const NimBLECharacteristic* characteristic, uint16_t connHandle, uint16_t subValue) {
+  for (Entry& entry : entries) {
+    if (entry.characteristic != characteristic) {
+      continue;
+    }
+
+    uint8_t count = entry.bleSubscribers.load(std::memory_order_relaxed);
+    int found     = -1;
+    for (int i = 0; i < count; i++) {
+      if (entry.bleConnections[i] == connHandle) {
+        found = i;
+        break;
+      }
+    }
+
+    if (subValue != 0 && found < 0 && count < NOTIFICATION_HUB_MAX_BLE_SUBSCRIBERS) {
+      entry.bleConnections[count] = connHandle;
+      entry.bleSubscribers.store(count + 1, std::memory_order_relaxed);
+    } else if (subValue == 0 && found >= 0) {
+      entry.bleConnections[found] = entry.bleConnections[count - 1];
+      entry.bleSubscribers.store(count - 1, std::memory_order_relaxed);
+    }
+    return;
+  }
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <NimBLEDevice.h>
+#include <atomic>
+
+#define NOTIFICATION_HUB_MAX_BLE_SUBSCRIBERS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
+// Characteristics the services publish through the hub, or whose subscriptions BLEUpdateScheduler follows
+struct NotificationHubCharacteristic {
+  enum Types : uint8_t {
+    FitnessMachineIndoorBikeData = 0,
+    FitnessMachineControlPoint,
+    FitnessMachineStatus,
+    FitnessMachineTrainingStatus,
+    HeartRateMeasurement,
+    CyclingPowerMeasurement,
+    CSCMeasurement,
+    Count
+  };
+};
+
+// Single place a service hands a new characteristic value to. It stores the value for reads and
+// notifies whoever is subscribed over BLE and DirCon, skipping a transport nobody listens on.
+// Services can ask hasSubscribers() first and not build the payload at all.
+class NotificationHub {
+ public:
+  // Bind an id to its characteristic, from the service's setupService(). The characteristic must use
+  // MyCharacteristicCallbacks, otherwise BLE subscriptions aren't seen.
+  static void registerCharacteristic(NotificationHubCharacteristic::Types id, NimBLECharacteristic* characteristic);
+
+  // True if a BLE central or a DirCon client is subscribed. Safe from any task.
+  static bool hasSubscribers(NotificationHubCharacteristic::Types id);
+  static bool isRegistered(NotificationHubCharacteristic::Types id) { return entries[id].characteristic != nullptr; }
+
+  // Set the value and notify the subscribers on both transports
+  static void publish(NotificationHubCharacteristic::Types id, const uint8_t* data, size_t length);
+
+  // BLE subscription changes, from MyCharacteristicCallbacks::onSubscribe() on the NimBLE host task
+  static void onSubscribe(const NimBLECharacteristic* characteristic, uint16_t connHandle, uint16_t subValue);
+
+ private:
+  struct Entry {
+    NimBLECharacteristic* characteristic;
+    uint16_t bleConnections[NOTIFICATION_HUB_MAX_BLE_SUBSCRIBERS];  // subscribed connection handles, only touched by the host task
+    std::atomic<uint8_t> bleSubscribers;                            // number of handles in use, read from any task
+  };
+  static Entry entries[NotificationHubCharacteristic::Count];
+};
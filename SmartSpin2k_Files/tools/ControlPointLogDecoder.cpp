@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+// Control point log decoder, a host tool for firmware built with CONTROL_POINT_LOG_RAW.
+//
+// Reads a saved log (serial, web or UDP), finds the CONTROL_POINT_LOG_RECORD_PREFIX records the
+// ControlPointLog task wrote, and prints each one as the text the device would have formatted,
+// preceded by its time relative to the first record. Other lines pass through untouched with -a.
+//
+// Build and run on Linux or macOS:
+//   g++ -std=c++17 -O2 -o cpl-decode SmartSpin2k_Files/tools/ControlPointLogDecoder.cpp
+//   ./cpl-decode [-a] [log file]     (reads stdin without a file)
+
+#ifndef ARDUINO
+
+#include "../ControlPointLog.h"
+#include <cstdlib>
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Decode the record following the prefix. False if it's cut short or not hex.
+static bool parseRecord(const char* hex, ControlPointLogEvent& event) {
+  uint8_t record[CONTROL_POINT_LOG_RECORD_LENGTH];
+  for (int i = 0; i < CONTROL_POINT_LOG_RECORD_LENGTH; i++) {
+    int high = hexValue(hex[i * 2]);
+    int low  = (high < 0) ? -1 : hexValue(hex[i * 2 + 1]);
+    if (low < 0) {
+      return false;
+    }
+    record[i] = (uint8_t)(high << 4 | low);
+  }
+  event.decode(record);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  bool passThrough = false;
+  const char* path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-a") == 0) {
+      passThrough = true;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-a] [log file]\n", argv[0]);
+      return 2;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  FILE* in = (path != nullptr) ? fopen(path, "r") : stdin;
+  if (in == nullptr) {
+    perror(path);
+    return 1;
+  }
+
+  char line[1024];
+  char text[256];
+  bool haveFirst     = false;
+  uint32_t first     = 0;
+  unsigned decoded   = 0;
+  unsigned malformed = 0;
+  while (fgets(line, sizeof(line), in) != nullptr) {
+    const char* record = strstr(line, CONTROL_POINT_LOG_RECORD_PREFIX);
+    if (record == nullptr) {
+      if (passThrough) {
+        fputs(line, stdout);
+      }
+      continue;
+    }
+
+    ControlPointLogEvent event;
+    if (!parseRecord(record + strlen(CONTROL_POINT_LOG_RECORD_PREFIX), event)) {
+      malformed++;
+      continue;
+    }
+    if (!haveFirst) {
+      first     = event.timestamp;
+      haveFirst = true;
+    }
+    event.format(text, sizeof(text));
+    // micros() wraps after about 71 minutes, unsigned subtraction keeps neighbouring records right
+    printf("%10.3f ms  %s\n", (uint32_t)(event.timestamp - first) / 1000.0, text);
+    decoded++;
+  }
+
+  if (in != stdin) {
+    fclose(in);
+  }
+  fprintf(stderr, "%u records decoded, %u malformed\n", decoded, malformed);
+  return 0;
+}
+
+#endif  // ARDUINO
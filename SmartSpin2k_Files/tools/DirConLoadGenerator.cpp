@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+// DirCon load generator, a host tool for sizing how many clients one SmartSpin2k can serve.
+//
+// Opens N DirCon connections, subscribes each to Indoor Bike Data and the FTMS control point, then
+// keeps writing Set Target Power to the control point. Reports notifications per second, request
+// latency percentiles and the CPU time this generator process spent per message. The gateway's own
+// CPU time per message is reported by the host server, dircon-server in tools/host.
+//
+// Build and run on Linux or macOS:
+//   g++ -std=c++17 -O2 -o dircon-loadgen SmartSpin2k_Files/tools/DirConLoadGenerator.cpp
+//   ./dircon-loadgen <host> [-p port] [-c clients] [-d seconds] [-r writes/s per client] [-w outstanding writes]
+//
+// A rate of 0 writes back to back. Latency is measured from sending a request until its response
+// arrives, so it includes the network and whatever the gateway is doing. Set Target Power is answered
+// with OpCodeNotSupported when no power meter is connected; that doesn't matter for the load.
+//
+// Every connection comes from this machine's address, so to the gateway they look like one device
+// reconnecting. With more clients than the gateway has slots (DIRCON_MAX_CLIENTS), the extra
+// connections are turned away or, through the gateway's same-address slot reclaim, replace this
+// generator's own sessions that have been quiet for a moment (DIRCON_RECLAIM_SAME_ADDRESS_MS); they
+// don't model more devices. Run generators on several machines for that.
+// Exits with status 1 if no request was answered.
+
+#ifndef ARDUINO
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Protocol definitions, the same values as DirConMessage.h
+#define DIRCON_MESSAGE_VERSION                            1
+#define DIRCON_MESSAGE_HEADER_LENGTH                      6
+#define DIRCON_MSGID_WRITE_CHARACTERISTIC                 0x04
+#define DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS  0x05
+#define DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION 0x06
+#define DIRCON_RESPCODE_SUCCESS_REQUEST                   0x00
+
+#define LOADGEN_RECEIVE_BUFFER_SIZE 4096
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // macOS, where SIGPIPE is ignored below instead
+#endif
+
+static const uint16_t indoorBikeDataUuid = 0x2AD2;
+static const uint16_t controlPointUuid   = 0x2AD9;
+
+struct LoadGenClient {
+  int fd;
+  bool connected;
+  uint8_t nextSequence;
+  uint32_t outstanding;                  // control point writes without a response yet
+  uint64_t sentAt[256];                  // by sequence number, 0 when no request is outstanding
+  uint64_t nextWriteAt;                  // earliest time for the next control point write
+  uint8_t receiveBuffer[LOADGEN_RECEIVE_BUFFER_SIZE];
+  size_t receivedLength;
+};
+
+struct LoadGenTotals {
+  uint64_t notifications;
+  uint64_t responses;
+  uint64_t errors;  // responses with a non-zero response code
+  uint64_t bytesReceived;
+  std::vector<uint32_t> latencyMicros;
+};
+
+static uint64_t nowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t cpuMicros() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// 16 bit SIG UUID expanded to DirCon wire order, which is the string order of the 128 bit UUID
+static void wireUuid(uint16_t uuid16, uint8_t* out) {
+  static const uint8_t base[16] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb};
+  memcpy(out, base, sizeof(base));
+  out[2] = uuid16 >> 8;
+  out[3] = uuid16 & 0xff;
+}
+
+static bool sendFrame(LoadGenClient& client, uint8_t messageId, uint16_t uuid16, const uint8_t* data, size_t length) {
+  uint8_t frame[DIRCON_MESSAGE_HEADER_LENGTH + 16 + 32];
+  size_t payloadLength = 16 + length;
+  frame[0]             = DIRCON_MESSAGE_VERSION;
+  frame[1]             = messageId;
+  frame[2]             = client.nextSequence;
+  frame[3]             = DIRCON_RESPCODE_SUCCESS_REQUEST;
+  frame[4]             = payloadLength >> 8;
+  frame[5]             = payloadLength & 0xff;
+  wireUuid(uuid16, frame + DIRCON_MESSAGE_HEADER_LENGTH);
+  memcpy(frame + DIRCON_MESSAGE_HEADER_LENGTH + 16, data, length);
+
+  size_t frameLength = DIRCON_MESSAGE_HEADER_LENGTH + payloadLength;
+  // Frames are small, a short write means the gateway has stopped reading
+  if (send(client.fd, frame, frameLength, MSG_NOSIGNAL) != (ssize_t)frameLength) {
+    return false;
+  }
+  client.sentAt[client.nextSequence] = nowMicros();
+  client.nextSequence++;
+  return true;
+}
+
+static int connectClient(const char* host, const char* port) {
+  struct addrinfo hints = {};
+  hints.ai_family       = AF_UNSPEC;
+  hints.ai_socktype     = SOCK_STREAM;
+  struct addrinfo* result;
+  if (getaddrinfo(host, port, &hints, &result) != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo* address = result; address != nullptr; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(result);
+
+  if (fd >= 0) {
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+  return fd;
+}
+
+// Handle every complete frame in the receive buffer
+static void processFrames(LoadGenClient& client, LoadGenTotals& totals) {
+  size_t offset = 0;
+  while (client.receivedLength - offset >= DIRCON_MESSAGE_HEADER_LENGTH) {
+    const uint8_t* frame = client.receiveBuffer + offset;
+    size_t frameLength   = DIRCON_MESSAGE_HEADER_LENGTH + ((frame[4] << 8) | frame[5]);
+    if (client.receivedLength - offset < frameLength) {
+      break;
+    }
+
+    if (frame[1] == DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION) {
+      totals.notifications++;
+    } else if (client.sentAt[frame[2]] != 0) {
+      uint64_t latency        = nowMicros() - client.sentAt[frame[2]];
+      client.sentAt[frame[2]] = 0;
+      if (frame[1] == DIRCON_MSGID_WRITE_CHARACTERISTIC && client.outstanding > 0) {
+        client.outstanding--;
+      }
+      totals.responses++;
+      totals.latencyMicros.push_back((uint32_t)std::min<uint64_t>(latency, UINT32_MAX));
+      if (frame[3] != DIRCON_RESPCODE_SUCCESS_REQUEST) {
+        totals.errors++;
+      }
+    }
+    offset += frameLength;
+  }
+
+  memmove(client.receiveBuffer, client.receiveBuffer + offset, client.receivedLength - offset);
+  client.receivedLength -= offset;
+}
+
+static uint32_t percentile(std::vector<uint32_t>& sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index = std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+  return sorted[index];
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "usage: %s <host> [-p port] [-c clients] [-d seconds] [-r writes/s per client] [-w outstanding writes]\n", program);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argv[1][0] == '-') {
+    usage(argv[0]);
+  }
+  const char* host     = argv[1];
+  const char* port     = "8081";
+  int clientCount      = 3;
+  int durationSeconds  = 30;
+  int writesPerSecond  = 10;
+  uint32_t maxInFlight = 1;
+  int option;
+  optind = 2;
+  while ((option = getopt(argc, argv, "p:c:d:r:w:")) != -1) {
+    switch (option) {
+      case 'p':
+        port = optarg;
+        break;
+      case 'c':
+        clientCount = atoi(optarg);
+        break;
+      case 'd':
+        durationSeconds = atoi(optarg);
+        break;
+      case 'r':
+        writesPerSecond = atoi(optarg);
+        break;
+      case 'w':
+        maxInFlight = std::max(1, atoi(optarg));
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (clientCount < 1) {
+    usage(argv[0]);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<LoadGenClient> clients(clientCount);
+  for (int i = 0; i < clientCount; i++) {
+    LoadGenClient& client = clients[i];
+    memset(&client, 0, sizeof(client));
+    client.fd = connectClient(host, port);
+    if (client.fd < 0) {
+      fprintf(stderr, "client %d: connect to %s:%s failed: %s\n", i, host, port, strerror(errno));
+      continue;
+    }
+    client.connected      = true;
+    const uint8_t enable  = 1;
+    const uint8_t request = 0x00;  // Request Control
+    if (!sendFrame(client, DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS, indoorBikeDataUuid, &enable, 1) ||
+        !sendFrame(client, DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS, controlPointUuid, &enable, 1) ||
+        !sendFrame(client, DIRCON_MSGID_WRITE_CHARACTERISTIC, controlPointUuid, &request, 1)) {
+      fprintf(stderr, "client %d: setup failed\n", i);
+      close(client.fd);
+      client.connected = false;
+      continue;
+    }
+    client.outstanding = 1;  // the Request Control write
+  }
+
+  LoadGenTotals totals = {};
+  uint64_t writeInterval = writesPerSecond > 0 ? 1000000 / writesPerSecond : 0;
+  uint64_t startTime     = nowMicros();
+  uint64_t endTime       = startTime + (uint64_t)durationSeconds * 1000000;
+  uint64_t startCpu      = cpuMicros();
+  uint64_t lastReport    = startTime;
+  uint64_t lastNotifications = 0;
+  uint64_t lastResponses     = 0;
+  uint16_t targetWatts       = 100;
+  std::vector<struct pollfd> pollSet(clientCount);
+
+  while (true) {
+    uint64_t now = nowMicros();
+    if (now >= endTime) {
+      break;
+    }
+
+    // Keep every client's control point busy
+    int connected = 0;
+    for (LoadGenClient& client : clients) {
+      if (!client.connected) {
+        continue;
+      }
+      connected++;
+      if (client.outstanding < maxInFlight && now >= client.nextWriteAt) {
+        targetWatts            = targetWatts >= 400 ? 100 : targetWatts + 1;
+        const uint8_t power[3] = {0x05, (uint8_t)(targetWatts & 0xff), (uint8_t)(targetWatts >> 8)};  // Set Target Power
+        if (sendFrame(client, DIRCON_MSGID_WRITE_CHARACTERISTIC, controlPointUuid, power, sizeof(power))) {
+          client.outstanding++;
+          client.nextWriteAt = now + writeInterval;
+        }
+      }
+    }
+    if (connected == 0) {
+      fprintf(stderr, "no clients connected\n");
+      return 1;
+    }
+
+    for (int i = 0; i < clientCount; i++) {
+      pollSet[i].fd     = clients[i].connected ? clients[i].fd : -1;
+      pollSet[i].events = POLLIN;
+    }
+    poll(pollSet.data(), pollSet.size(), 1);
+
+    for (int i = 0; i < clientCount; i++) {
+      LoadGenClient& client = clients[i];
+      if (!client.connected || !(pollSet[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      ssize_t bytesRead = recv(client.fd, client.receiveBuffer + client.receivedLength, sizeof(client.receiveBuffer) - client.receivedLength, 0);
+      if (bytesRead <= 0) {
+        if (bytesRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+          fprintf(stderr, "client %d: disconnected by the gateway\n", i);
+          close(client.fd);
+          client.connected = false;
+        }
+        continue;
+      }
+      totals.bytesReceived += bytesRead;
+      client.receivedLength += bytesRead;
+      processFrames(client, totals);
+    }
+
+    if (now - lastReport >= 1000000) {
+      printf("%3llus  clients %d  notifications/s %llu  responses/s %llu\n", (unsigned long long)((now - startTime) / 1000000), connected,
+             (unsigned long long)(totals.notifications - lastNotifications), (unsigned long long)(totals.responses - lastResponses));
+      lastNotifications = totals.notifications;
+      lastResponses     = totals.responses;
+      lastReport        = now;
+    }
+  }
+
+  uint64_t elapsed  = nowMicros() - startTime;
+  uint64_t cpu      = cpuMicros() - startCpu;
+  uint64_t messages = totals.notifications + totals.responses;
+  std::sort(totals.latencyMicros.begin(), totals.latencyMicros.end());
+
+  printf("\n%d clients for %.1f s against %s:%s\n", clientCount, elapsed / 1e6, host, port);
+  printf("notifications  %llu (%.1f/s)\n", (unsigned long long)totals.notifications, totals.notifications * 1e6 / elapsed);
+  printf("responses      %llu (%.1f/s), %llu with an error code\n", (unsigned long long)totals.responses, totals.responses * 1e6 / elapsed,
+         (unsigned long long)totals.errors);
+  printf("latency        p50 %u us  p99 %u us  max %u us\n", percentile(totals.latencyMicros, 0.50), percentile(totals.latencyMicros, 0.99),
+         totals.latencyMicros.empty() ? 0 : totals.latencyMicros.back());
+  printf("received       %llu bytes (%.1f KiB/s)\n", (unsigned long long)totals.bytesReceived, totals.bytesReceived * 1e6 / elapsed / 1024);
+  printf("loadgen CPU    %.2f us per message received, this process only\n", messages ? (double)cpu / messages : 0.0);
+
+  for (LoadGenClient& client : clients) {
+    if (client.connected) {
+      close(client.fd);
+    }
+  }
+  return totals.responses > 0 ? 0 : 1;
+}
+
+#endif  // ARDUINO
@@ -0,0 +1,544 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+// DirCon capture replayer, a host tool for reproducing client interop problems.
+//
+// Reads a capture exported with DirConManager::exportCapture() (format in DirConCapture.h) and plays
+// the recorded client side back against a SmartSpin2k: one connection per recorded client slot, each
+// inbound frame sent at its original time divided by the speed factor. Every response is compared to
+// the one recorded for the same message id and sequence number, and the differences are listed.
+// The capture can also be a saved serial log with the hex lines of the custom characteristic's DirCon
+// capture command (DirConCapture::writeHexTo()); the last capture in the log is used.
+//
+// Build and run on Linux or macOS:
+//   g++ -std=c++17 -O2 -o dircon-replay SmartSpin2k_Files/tools/DirConReplay.cpp
+//   ./dircon-replay <capture> <host> [-p port] [-s speed]
+//
+// A speed of 2 replays twice as fast, 0 sends every frame as soon as the previous response is in.
+// Notifications are counted but not compared, their content and timing follow the live trainer.
+//
+// The host build in tools/host compiles this with DIRCON_REPLAY_IN_PROCESS and the firmware sources.
+// Without a host it then replays against a DirConManager and BLE server running in this process on a
+// loopback port, so every frame goes through DirConMessage::parse() and processDirConMessage() with no
+// hardware, as a regression test:
+//   ./dircon-replay <capture> [host] [-p port] [-s speed]
+
+#ifndef ARDUINO
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef DIRCON_REPLAY_IN_PROCESS
+#include "HostRuntime.h"
+#include "BLE_Common.h"
+#include "DirConManager.h"
+#endif
+
+// Capture format, the same values as DirConCapture.h
+#define DIRCON_CAPTURE_VERSION              1
+#define DIRCON_CAPTURE_HEADER_LENGTH        8
+#define DIRCON_CAPTURE_RECORD_HEADER_LENGTH 7
+#define DIRCON_CAPTURE_INBOUND              0
+#define DIRCON_CAPTURE_OUTBOUND             1
+#define DIRCON_CAPTURE_CONNECT              2
+#define DIRCON_CAPTURE_DISCONNECT           3
+#define DIRCON_CAPTURE_HEX_PREFIX           "dcap: "
+
+// Protocol definitions, the same values as DirConMessage.h
+#define DIRCON_MESSAGE_HEADER_LENGTH                         6
+#define DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION 0x06
+
+#define REPLAY_SLOTS              64     // client slots a capture can hold, 6 bits in the record
+#define REPLAY_RECEIVE_SIZE       4096
+#define REPLAY_DRAIN_MS           1000   // how long to wait for the last responses
+#define REPLAY_RESPONSE_TIMEOUT_MS 2000  // speed 0: give up on a response after this long
+#define REPLAY_MAX_REPORTED_DIFFS 20
+#define REPLAY_TICK_MS            20     // in process: BLE server tick
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // macOS, where SIGPIPE is ignored instead
+#endif
+
+struct CaptureRecord {
+  uint64_t time;  // micros since the first record
+  uint8_t type;
+  uint8_t slot;
+  std::vector<uint8_t> frame;
+  int expected;  // inbound only: index of the recorded response, -1 if there is none
+};
+
+struct PendingResponse {
+  uint64_t sentAt;
+  int expected;
+};
+
+struct ReplayConnection {
+  int fd = -1;
+  uint8_t receiveBuffer[REPLAY_RECEIVE_SIZE];
+  size_t receivedLength = 0;
+  std::map<uint16_t, PendingResponse> pending;  // by message id << 8 | sequence number
+};
+
+struct ReplayTotals {
+  uint32_t sent          = 0;
+  uint32_t responses     = 0;
+  uint32_t identical     = 0;
+  uint32_t different     = 0;
+  uint32_t unexpected    = 0;  // responses to requests that weren't recorded with one
+  uint32_t notifications = 0;
+  std::vector<uint32_t> latencyMicros;
+};
+
+static uint64_t nowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint16_t frameKey(const std::vector<uint8_t>& frame) { return frame[1] << 8 | frame[2]; }
+
+static void printHex(const char* label, const uint8_t* data, size_t length) {
+  printf("    %s", label);
+  for (size_t i = 0; i < length; i++) {
+    printf("%02x", data[i]);
+  }
+  printf("\n");
+}
+
+// The bytes of the last "dcap: begin" ... "dcap: end" block in a serial log
+static bool extractHexCapture(const std::vector<uint8_t>& log, std::vector<uint8_t>& capture) {
+  const std::string prefix = DIRCON_CAPTURE_HEX_PREFIX;
+  std::vector<uint8_t> block;
+  bool inBlock = false;
+  bool found   = false;
+  size_t start = 0;
+  while (start < log.size()) {
+    size_t end = start;
+    while (end < log.size() && log[end] != '\n') {
+      end++;
+    }
+    std::string line(log.begin() + start, log.begin() + end);
+    start = end + 1;
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+      line.pop_back();
+    }
+
+    size_t at = line.find(prefix);
+    if (at == std::string::npos) {
+      continue;
+    }
+    std::string text = line.substr(at + prefix.size());
+    if (text == "begin") {
+      block.clear();
+      inBlock = true;
+    } else if (text == "end") {
+      if (inBlock) {
+        capture = block;
+        found   = true;
+      }
+      inBlock = false;
+    } else if (inBlock) {
+      for (size_t i = 0; i + 1 < text.size(); i += 2) {
+        block.push_back((uint8_t)strtoul(text.substr(i, 2).c_str(), nullptr, 16));
+      }
+    }
+  }
+  return found;
+}
+
+static bool loadCapture(const char* path, std::vector<CaptureRecord>& records) {
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) {
+    fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  std::vector<uint8_t> contents;
+  uint8_t chunk[4096];
+  size_t chunkLength;
+  while ((chunkLength = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    contents.insert(contents.end(), chunk, chunk + chunkLength);
+  }
+  fclose(file);
+
+  std::vector<uint8_t> capture;
+  if (contents.size() >= 4 && memcmp(contents.data(), "DCAP", 4) == 0) {
+    capture = std::move(contents);
+  } else if (!extractHexCapture(contents, capture)) {
+    fprintf(stderr, "%s is neither a capture nor a log with one\n", path);
+    return false;
+  }
+
+  if (capture.size() < DIRCON_CAPTURE_HEADER_LENGTH || memcmp(capture.data(), "DCAP", 4) != 0 || capture[4] != DIRCON_CAPTURE_VERSION) {
+    fprintf(stderr, "%s is not a version %d DirCon capture\n", path, DIRCON_CAPTURE_VERSION);
+    return false;
+  }
+
+  // Timestamps are 32 bit micros() and wrap, so only the step from one record to the next is used
+  uint64_t time          = 0;
+  uint32_t lastTimestamp = 0;
+  size_t offset          = DIRCON_CAPTURE_HEADER_LENGTH;
+  while (capture.size() - offset >= DIRCON_CAPTURE_RECORD_HEADER_LENGTH) {
+    const uint8_t* recordHeader = capture.data() + offset;
+    uint32_t timestamp          = recordHeader[0] | recordHeader[1] << 8 | recordHeader[2] << 16 | (uint32_t)recordHeader[3] << 24;
+    size_t length               = recordHeader[5] | recordHeader[6] << 8;
+    offset += DIRCON_CAPTURE_RECORD_HEADER_LENGTH;
+    if (capture.size() - offset < length) {
+      fprintf(stderr, "%s is truncated\n", path);
+      break;
+    }
+    if (!records.empty()) {
+      time += (uint32_t)(timestamp - lastTimestamp);
+    }
+    lastTimestamp = timestamp;
+
+    CaptureRecord record;
+    record.time     = time;
+    record.type     = recordHeader[4] >> 6;
+    record.slot     = recordHeader[4] & 0x3f;
+    record.expected = -1;
+    record.frame.assign(capture.begin() + offset, capture.begin() + offset + length);
+    offset += length;
+    records.push_back(std::move(record));
+  }
+
+  // Pair every request with the response recorded for it
+  for (size_t i = 0; i < records.size(); i++) {
+    if (records[i].type != DIRCON_CAPTURE_INBOUND || records[i].frame.size() < DIRCON_MESSAGE_HEADER_LENGTH) {
+      continue;
+    }
+    for (size_t j = i + 1; j < records.size(); j++) {
+      const CaptureRecord& later = records[j];
+      if (later.slot != records[i].slot) {
+        continue;
+      }
+      if (later.type == DIRCON_CAPTURE_DISCONNECT || (later.type == DIRCON_CAPTURE_INBOUND && frameKey(later.frame) == frameKey(records[i].frame))) {
+        break;
+      }
+      if (later.type == DIRCON_CAPTURE_OUTBOUND && later.frame.size() >= DIRCON_MESSAGE_HEADER_LENGTH &&
+          later.frame[1] != DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION && frameKey(later.frame) == frameKey(records[i].frame)) {
+        records[i].expected = j;
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+#ifdef DIRCON_REPLAY_IN_PROCESS
+static bool inProcess = false;
+
+// The firmware's DirCon server in this process on a free port. Tasks are off so DirConManager::update()
+// services the sockets from tickGateway(), which keeps a run repeatable.
+static bool startInProcessGateway(std::string& port) {
+  HostRuntime::setTasks(false);
+  HostRuntime::setListenPort(0);
+  startBLEServer();
+  if (!DirConManager::start()) {
+    return false;
+  }
+  port      = std::to_string(HostRuntime::getListenPort());
+  inProcess = true;
+  return true;
+}
+#endif
+
+// In process, tick the BLE and DirCon servers as the device's main loop would and return how long to
+// wait for responses before the next tick. Otherwise just wait.
+static uint64_t tickGateway(uint64_t timeoutMicros) {
+#ifdef DIRCON_REPLAY_IN_PROCESS
+  if (inProcess) {
+    static uint64_t lastTick = 0;
+    if (nowMicros() - lastTick >= REPLAY_TICK_MS * 1000ULL) {
+      spinBLEServer.update();
+      DirConManager::update();
+      lastTick = nowMicros();
+    }
+    return std::min<uint64_t>(timeoutMicros, REPLAY_TICK_MS * 1000ULL);
+  }
+#endif
+  return timeoutMicros;
+}
+
+static int connectGateway(const char* host, const char* port) {
+  struct addrinfo hints = {};
+  hints.ai_family       = AF_UNSPEC;
+  hints.ai_socktype     = SOCK_STREAM;
+  struct addrinfo* result;
+  if (getaddrinfo(host, port, &hints, &result) != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo* address = result; address != nullptr; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(result);
+
+  if (fd >= 0) {
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+  return fd;
+}
+
+static void handleResponse(ReplayConnection& connection, const uint8_t* frame, size_t frameLength, const std::vector<CaptureRecord>& records, ReplayTotals& totals) {
+  if (frame[1] == DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION) {
+    totals.notifications++;
+    return;
+  }
+
+  auto request = connection.pending.find(frame[1] << 8 | frame[2]);
+  if (request == connection.pending.end()) {
+    totals.unexpected++;
+    return;
+  }
+  totals.responses++;
+  totals.latencyMicros.push_back((uint32_t)std::min<uint64_t>(nowMicros() - request->second.sentAt, UINT32_MAX));
+
+  if (request->second.expected < 0) {
+    totals.unexpected++;
+  } else {
+    const std::vector<uint8_t>& expected = records[request->second.expected].frame;
+    if (expected.size() == frameLength && memcmp(expected.data(), frame, frameLength) == 0) {
+      totals.identical++;
+    } else {
+      totals.different++;
+      if (totals.different <= REPLAY_MAX_REPORTED_DIFFS) {
+        printf("  response to message %d sequence %d differs\n", frame[1], frame[2]);
+        printHex("recorded ", expected.data(), expected.size());
+        printHex("replayed ", frame, frameLength);
+      }
+    }
+  }
+  connection.pending.erase(request);
+}
+
+// Wait up to timeoutMicros for data on any connection and handle the complete frames
+static void pollConnections(ReplayConnection* connections, uint64_t timeoutMicros, const std::vector<CaptureRecord>& records, ReplayTotals& totals) {
+  timeoutMicros = tickGateway(timeoutMicros);
+  std::vector<struct pollfd> pollSet;
+  std::vector<int> slots;
+  for (int slot = 0; slot < REPLAY_SLOTS; slot++) {
+    if (connections[slot].fd >= 0) {
+      pollSet.push_back({connections[slot].fd, POLLIN, 0});
+      slots.push_back(slot);
+    }
+  }
+  if (pollSet.empty()) {
+    usleep(timeoutMicros);
+    return;
+  }
+  if (poll(pollSet.data(), pollSet.size(), (int)((timeoutMicros + 999) / 1000)) <= 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < pollSet.size(); i++) {
+    if (!(pollSet[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+    ReplayConnection& connection = connections[slots[i]];
+    ssize_t bytesRead = recv(connection.fd, connection.receiveBuffer + connection.receivedLength, REPLAY_RECEIVE_SIZE - connection.receivedLength, 0);
+    if (bytesRead <= 0) {
+      if (bytesRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        printf("  slot %d: closed by the gateway\n", slots[i]);
+        close(connection.fd);
+        connection.fd = -1;
+      }
+      continue;
+    }
+    connection.receivedLength += bytesRead;
+
+    size_t offset = 0;
+    while (connection.receivedLength - offset >= DIRCON_MESSAGE_HEADER_LENGTH) {
+      const uint8_t* frame = connection.receiveBuffer + offset;
+      size_t frameLength   = DIRCON_MESSAGE_HEADER_LENGTH + (frame[4] << 8 | frame[5]);
+      if (connection.receivedLength - offset < frameLength) {
+        break;
+      }
+      handleResponse(connection, frame, frameLength, records, totals);
+      offset += frameLength;
+    }
+    memmove(connection.receiveBuffer, connection.receiveBuffer + offset, connection.receivedLength - offset);
+    connection.receivedLength -= offset;
+  }
+}
+
+static bool anyPending(ReplayConnection* connections) {
+  for (int slot = 0; slot < REPLAY_SLOTS; slot++) {
+    if (connections[slot].fd >= 0 && !connections[slot].pending.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()))];
+}
+
+static void usage(const char* program) {
+#ifdef DIRCON_REPLAY_IN_PROCESS
+  fprintf(stderr, "usage: %s <capture> [host] [-p port] [-s speed]\n", program);
+#else
+  fprintf(stderr, "usage: %s <capture> <host> [-p port] [-s speed]\n", program);
+#endif
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argv[1][0] == '-') {
+    usage(argv[0]);
+  }
+  const char* capturePath = argv[1];
+  const char* host        = argc > 2 && argv[2][0] != '-' ? argv[2] : nullptr;
+  std::string port        = "8081";
+  double speed            = 1.0;
+  int option;
+  optind = host != nullptr ? 3 : 2;
+  while ((option = getopt(argc, argv, "p:s:")) != -1) {
+    switch (option) {
+      case 'p':
+        port = optarg;
+        break;
+      case 's':
+        speed = atof(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (host == nullptr) {
+#ifdef DIRCON_REPLAY_IN_PROCESS
+    if (!startInProcessGateway(port)) {
+      fprintf(stderr, "the in process DirCon server failed to start\n");
+      return 1;
+    }
+    host = "127.0.0.1";
+#else
+    usage(argv[0]);
+#endif
+  }
+
+  std::vector<CaptureRecord> records;
+  if (!loadCapture(capturePath, records)) {
+    return 1;
+  }
+  printf("%zu records over %.3f s, replaying at ", records.size(), records.empty() ? 0.0 : records.back().time / 1e6);
+  if (speed > 0) {
+    printf("%gx\n", speed);
+  } else {
+    printf("full speed\n");
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  static ReplayConnection connections[REPLAY_SLOTS];
+  ReplayTotals totals;
+  uint64_t startTime = nowMicros();
+
+  for (const CaptureRecord& record : records) {
+    ReplayConnection& connection = connections[record.slot];
+    if (record.type == DIRCON_CAPTURE_OUTBOUND) {
+      continue;
+    }
+
+    // Keep the original pace, or with speed 0 wait for the previous responses instead
+    if (speed > 0) {
+      uint64_t due = startTime + (uint64_t)(record.time / speed);
+      for (uint64_t now = nowMicros(); now < due; now = nowMicros()) {
+        pollConnections(connections, due - now, records, totals);
+      }
+    } else {
+      uint64_t giveUp = nowMicros() + REPLAY_RESPONSE_TIMEOUT_MS * 1000ULL;
+      while (anyPending(connections) && nowMicros() < giveUp) {
+        pollConnections(connections, 1000, records, totals);
+      }
+    }
+
+    if (record.type == DIRCON_CAPTURE_DISCONNECT) {
+      if (connection.fd >= 0) {
+        close(connection.fd);
+        connection.fd = -1;
+      }
+      continue;
+    }
+
+    // Connect on the recorded connect, or on the first frame of a client already connected when the capture started
+    if (connection.fd < 0) {
+      connection.fd             = connectGateway(host, port.c_str());
+      connection.receivedLength = 0;
+      connection.pending.clear();
+      if (connection.fd < 0) {
+        fprintf(stderr, "slot %d: connect to %s:%s failed: %s\n", record.slot, host, port.c_str(), strerror(errno));
+        return 1;
+      }
+    }
+    if (record.type != DIRCON_CAPTURE_INBOUND) {
+      continue;
+    }
+
+    if (send(connection.fd, record.frame.data(), record.frame.size(), MSG_NOSIGNAL) != (ssize_t)record.frame.size()) {
+      fprintf(stderr, "slot %d: send failed\n", record.slot);
+      continue;
+    }
+    totals.sent++;
+    if (record.frame.size() >= DIRCON_MESSAGE_HEADER_LENGTH) {
+      connection.pending[frameKey(record.frame)] = {nowMicros(), record.expected};
+    }
+  }
+
+  // Collect the last responses
+  uint64_t drainUntil = nowMicros() + REPLAY_DRAIN_MS * 1000ULL;
+  while (anyPending(connections) && nowMicros() < drainUntil) {
+    pollConnections(connections, 1000, records, totals);
+  }
+
+  uint32_t missing = 0;
+  for (ReplayConnection& connection : connections) {
+    missing += connection.pending.size();
+    if (connection.fd >= 0) {
+      close(connection.fd);
+    }
+  }
+
+  std::sort(totals.latencyMicros.begin(), totals.latencyMicros.end());
+  printf("\nsent %u frames in %.3f s\n", totals.sent, (nowMicros() - startTime) / 1e6);
+  printf("responses      %u: %u identical, %u different, %u without a recorded one, %u missing\n", totals.responses, totals.identical, totals.different,
+         totals.unexpected, missing);
+  printf("notifications  %u\n", totals.notifications);
+  printf("latency        p50 %u us  p99 %u us  max %u us\n", percentile(totals.latencyMicros, 0.50), percentile(totals.latencyMicros, 0.99),
+         totals.latencyMicros.empty() ? 0 : totals.latencyMicros.back());
+  return totals.different > 0 || missing > 0 ? 1 : 0;
+}
+
+#endif  // ARDUINO
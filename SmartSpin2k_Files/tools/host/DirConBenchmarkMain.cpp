@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+// Runs DirConBenchmark against the BLE server set up as on the device and prints its results.
+// Exits non-zero when a case that must not allocate did, so it can gate changes to the codec.
+
+#ifndef ARDUINO
+
+#include "HostRuntime.h"
+#include "BLE_Common.h"
+#include "DirConBenchmark.h"
+
+int main() {
+  HostRuntime::setLogging(true);
+  startBLEServer();
+  return DirConBenchmark::run() ? 0 : 1;
+}
+
+#endif  // ARDUINO
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+// Checks that the buffer encoders write exactly what the original std::vector encoder did. That
+// encoder is kept below as the reference; every message type, request and response, response code,
+// UUID size, payload and UUID list length and sequence number is encoded both ways and compared:
+//   - DirConMessage::encode(sequenceNumber), the vector wrapper
+//   - DirConMessage::encode(buffer, size, sequenceNumber) and getEncodedLength()
+//   - DirConMessage::encodeFrame() for every message it covers
+// along with the SequenceNumber and Length the encoders leave in the message.
+
+#ifndef ARDUINO
+
+#include "DirConMessage.h"
+#include <Constants.h>
+
+// The encoder as it was before the buffer encoders, less its logging
+static std::vector<uint8_t> referenceEncode(DirConMessage& message, uint8_t sequenceNumber) {
+  std::vector<uint8_t> encoded;
+  auto putUuid = [&encoded](NimBLEUUID uuid) {
+    const uint8_t* uuidBytes = (const uint8_t*)uuid.to128().getBase();
+    for (size_t i = 16; i > 0; i--) {
+      encoded.push_back(uuidBytes[i]);
+    }
+  };
+  auto putLength = [&encoded, &message](uint16_t length) {
+    message.Length = length;
+    encoded.push_back((uint8_t)(length >> 8));
+    encoded.push_back((uint8_t)length);
+  };
+
+  message.MessageVersion = 1;
+  if (message.Request) {
+    message.SequenceNumber = message.SequenceNumber < 255 ? message.SequenceNumber + 1 : 0;
+  } else if (message.Identifier == DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION) {
+    message.SequenceNumber = 0;
+  } else {
+    message.SequenceNumber = sequenceNumber;
+  }
+
+  encoded.push_back(message.MessageVersion);
+  encoded.push_back(message.Identifier);
+  encoded.push_back(message.SequenceNumber);
+  encoded.push_back(message.ResponseCode);
+
+  if (!message.Request && message.ResponseCode != DIRCON_RESPCODE_SUCCESS_REQUEST) {
+    putLength(0);
+  } else if (message.Identifier == DIRCON_MSGID_DISCOVER_SERVICES) {
+    if (message.Request) {
+      putLength(0);
+    } else {
+      putLength(message.AdditionalUUIDs.size() * 16);
+      for (const NimBLEUUID& uuid : message.AdditionalUUIDs) {
+        putUuid(uuid);
+      }
+    }
+  } else if (message.Identifier == DIRCON_MSGID_DISCOVER_CHARACTERISTICS && !message.Request) {
+    putLength(16 + message.AdditionalUUIDs.size() * 17);
+    putUuid(message.UUID);
+    for (size_t i = 0; i < message.AdditionalUUIDs.size(); i++) {
+      putUuid(message.AdditionalUUIDs[i]);
+      encoded.push_back(message.AdditionalData[i]);
+    }
+  } else if (((message.Identifier == DIRCON_MSGID_READ_CHARACTERISTIC || message.Identifier == DIRCON_MSGID_DISCOVER_CHARACTERISTICS) && message.Request) ||
+             (message.Identifier == DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS && !message.Request)) {
+    putLength(16);
+    putUuid(message.UUID);
+  } else if (message.Identifier == DIRCON_MSGID_WRITE_CHARACTERISTIC || message.Identifier == DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION ||
+             (message.Identifier == DIRCON_MSGID_READ_CHARACTERISTIC && !message.Request) ||
+             (message.Identifier == DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS && message.Request)) {
+    putLength(16 + message.AdditionalData.size());
+    putUuid(message.UUID);
+    encoded.insert(encoded.end(), message.AdditionalData.begin(), message.AdditionalData.end());
+  }
+  return encoded;
+}
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void check(bool passed, const char* what, const DirConMessage& message) {
+  checks++;
+  if (!passed) {
+    failures++;
+    if (failures <= 20) {
+      fprintf(stderr, "FAIL %s: identifier 0x%02x, %s, response code %u, %zu data bytes, %zu UUIDs\n", what, message.Identifier,
+              message.Request ? "request" : "response", message.ResponseCode, message.AdditionalData.size(), message.AdditionalUUIDs.size());
+    }
+  }
+}
+
+static void checkMessage(const DirConMessage& prototype, uint8_t sequenceNumber) {
+  DirConMessage reference = prototype;
+  std::vector<uint8_t> expected = referenceEncode(reference, sequenceNumber);
+
+  DirConMessage vectorMessage = prototype;
+  std::vector<uint8_t> vectorEncoded = *vectorMessage.encode(sequenceNumber);
+  check(vectorEncoded == expected, "encode(sequenceNumber) bytes", prototype);
+  check(vectorMessage.SequenceNumber == reference.SequenceNumber && vectorMessage.Length == reference.Length, "encode(sequenceNumber) fields", prototype);
+
+  DirConMessage bufferMessage = prototype;
+  check(bufferMessage.getEncodedLength() == expected.size(), "getEncodedLength()", prototype);
+  uint8_t buffer[1024];
+  memset(buffer, 0xa5, sizeof(buffer));
+  size_t length = bufferMessage.encode(buffer, sizeof(buffer), sequenceNumber);
+  check(length == expected.size() && memcmp(buffer, expected.data(), length) == 0, "encode(buffer) bytes", prototype);
+  check(buffer[length] == 0xa5, "encode(buffer) stays in bounds", prototype);
+  check(bufferMessage.SequenceNumber == reference.SequenceNumber && bufferMessage.Length == reference.Length, "encode(buffer) fields", prototype);
+
+  // One byte short must fail rather than write a partial frame
+  DirConMessage shortMessage = prototype;
+  memset(buffer, 0xa5, sizeof(buffer));
+  check(expected.empty() || shortMessage.encode(buffer, expected.size() - 1, sequenceNumber) == 0, "encode(buffer) too small", prototype);
+  check(expected.empty() || buffer[expected.size() - 1] == 0xa5, "encode(buffer) too small stays in bounds", prototype);
+
+  // encodeFrame() covers everything but the UUID lists of the discovery responses
+  const DirConMessage& m = prototype;
+  bool hasUuid, hasData;
+  if (!m.Request && m.ResponseCode != DIRCON_RESPCODE_SUCCESS_REQUEST) {
+    hasUuid = false;
+    hasData = false;
+  } else if (m.Identifier == DIRCON_MSGID_DISCOVER_SERVICES || (m.Identifier == DIRCON_MSGID_DISCOVER_CHARACTERISTICS && !m.Request)) {
+    return;
+  } else if (((m.Identifier == DIRCON_MSGID_READ_CHARACTERISTIC || m.Identifier == DIRCON_MSGID_DISCOVER_CHARACTERISTICS) && m.Request) ||
+             (m.Identifier == DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS && !m.Request)) {
+    hasUuid = true;
+    hasData = false;
+  } else if (m.Identifier == DIRCON_MSGID_WRITE_CHARACTERISTIC || m.Identifier == DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION ||
+             m.Identifier == DIRCON_MSGID_READ_CHARACTERISTIC || m.Identifier == DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS) {
+    hasUuid = true;
+    hasData = true;
+  } else {
+    // Unknown identifiers encode as a bare header without a length, which no frame is
+    return;
+  }
+  uint8_t uuid[16];
+  uuidToBytes(m.UUID, uuid);
+  memset(buffer, 0xa5, sizeof(buffer));
+  length = DirConMessage::encodeFrame(buffer, sizeof(buffer), m.Identifier, reference.SequenceNumber, m.ResponseCode, hasUuid ? uuid : nullptr,
+                                      hasData ? m.AdditionalData.data() : nullptr, hasData ? m.AdditionalData.size() : 0);
+  check(length == expected.size() && memcmp(buffer, expected.data(), length) == 0, "encodeFrame() bytes", prototype);
+  check(DirConMessage::encodeFrame(buffer, expected.size() - 1, m.Identifier, reference.SequenceNumber, m.ResponseCode, hasUuid ? uuid : nullptr,
+                                   hasData ? m.AdditionalData.data() : nullptr, hasData ? m.AdditionalData.size() : 0) == 0,
+        "encodeFrame() too small", prototype);
+}
+
+int main() {
+  const uint8_t identifiers[]   = {DIRCON_MSGID_DISCOVER_SERVICES,
+                                   DIRCON_MSGID_DISCOVER_CHARACTERISTICS,
+                                   DIRCON_MSGID_READ_CHARACTERISTIC,
+                                   DIRCON_MSGID_WRITE_CHARACTERISTIC,
+                                   DIRCON_MSGID_ENABLE_CHARACTERISTIC_NOTIFICATIONS,
+                                   DIRCON_MSGID_UNSOLICITED_CHARACTERISTIC_NOTIFICATION,
+                                   DIRCON_MSGID_UNKNOWN};
+  const uint8_t responseCodes[] = {DIRCON_RESPCODE_SUCCESS_REQUEST, DIRCON_RESPCODE_UNKNOWN_MESSAGE_TYPE, DIRCON_RESPCODE_CHARACTERISTIC_NOT_FOUND};
+  const NimBLEUUID uuids[]      = {FITNESSMACHINECONTROLPOINT_UUID, SMARTSPIN2K_CHARACTERISTIC_UUID};
+  const size_t dataLengths[]    = {0, 1, 3, 19, 64};
+  const size_t uuidCounts[]     = {0, 1, 5};
+  const uint8_t sequences[]     = {0, 7, 255};
+
+  for (uint8_t identifier : identifiers) {
+    for (bool request : {false, true}) {
+      for (uint8_t responseCode : responseCodes) {
+        for (const NimBLEUUID& uuid : uuids) {
+          for (size_t dataLength : dataLengths) {
+            for (size_t uuidCount : uuidCounts) {
+              // The reference encoder reads one data byte per listed UUID
+              if (dataLength < uuidCount) {
+                continue;
+              }
+              for (uint8_t sequenceNumber : sequences) {
+                DirConMessage message;
+                message.Identifier     = identifier;
+                message.Request        = request;
+                message.ResponseCode   = responseCode;
+                message.UUID           = uuid;
+                message.SequenceNumber = 255 - sequenceNumber;  // requests increment it, wrapping at 255
+                for (size_t i = 0; i < dataLength; i++) {
+                  message.AdditionalData.push_back((uint8_t)(i * 37 + identifier));
+                }
+                for (size_t i = 0; i < uuidCount; i++) {
+                  message.AdditionalUUIDs.push_back(uuids[i % 2]);
+                }
+                checkMessage(message, sequenceNumber);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  printf("%u checks, %u failed\n", checks, failures);
+  return failures == 0 ? 0 : 1;
+}
+
+#endif  // ARDUINO
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+// DirCon server on Linux: the firmware's DirConManager and BLE server on POSIX sockets, fed by the
+// FTMS service and the simulated trainer in HostRuntime. Point tools/DirConLoadGenerator.cpp or a
+// training app at it to load test the DirCon code without a device.
+//
+//   ./dircon-server [-p port] [-d seconds] [-c capture file] [-v]
+//
+// The DirCon task runs on its own thread as on the device, the BLE server ticks on the main thread.
+// Prints the request and notification rates each second and the server's CPU time per message at the
+// end. -c records the session with DirConManager::startCapture() and writes it out on exit, for
+// tools/DirConReplay.cpp. -v shows the firmware's log. Runs until interrupted without -d.
+
+#ifndef ARDUINO
+
+#include "HostRuntime.h"
+#include "BLE_Common.h"
+#include "DirConManager.h"
+#include <csignal>
+#include <unistd.h>
+
+#define DIRCON_SERVER_TICK_MS 20  // BLE server tick
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) { stopRequested = 1; }
+
+static void usage(const char* program) {
+  fprintf(stderr, "usage: %s [-p port] [-d seconds] [-c capture file] [-v]\n", program);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  int port                = DIRCON_TCP_PORT;
+  int durationSeconds     = 0;
+  bool verbose            = false;
+  const char* capturePath = nullptr;
+  int option;
+  while ((option = getopt(argc, argv, "p:d:c:v")) != -1) {
+    switch (option) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'd':
+        durationSeconds = atoi(optarg);
+        break;
+      case 'c':
+        capturePath = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  signal(SIGINT, requestStop);
+  signal(SIGTERM, requestStop);
+  signal(SIGPIPE, SIG_IGN);
+
+  HostRuntime::setLogging(verbose);
+  HostRuntime::setListenPort(port);
+  startBLEServer();
+  if (!DirConManager::start()) {
+    fprintf(stderr, "DirCon server failed to start\n");
+    return 1;
+  }
+  if (capturePath != nullptr && !DirConManager::startCapture()) {
+    fprintf(stderr, "capture buffer allocation failed\n");
+    return 1;
+  }
+  printf("DirCon server listening on port %u\n", HostRuntime::getListenPort());
+  fflush(stdout);
+
+  unsigned long startTime    = millis();
+  unsigned long lastReport   = startTime;
+  uint64_t startCpu          = HostRuntime::cpuMicros();
+  uint32_t lastRequests      = 0;
+  uint32_t lastNotifications = 0;
+  while (!stopRequested && (durationSeconds == 0 || millis() - startTime < (unsigned long)durationSeconds * 1000)) {
+    HostRuntime::simulateTrainer();
+    spinBLEServer.update();
+    DirConManager::update();
+    delay(DIRCON_SERVER_TICK_MS);
+
+    unsigned long now = millis();
+    if (now - lastReport >= 1000) {
+      uint32_t requests      = DirConManager::getRequestLatency().count;
+      uint32_t notifications = DirConManager::getNotifyFanout().count;
+      printf("%3lus  requests/s %lu  notifications/s %lu\n", (now - startTime) / 1000, (unsigned long)(requests - lastRequests),
+             (unsigned long)(notifications - lastNotifications));
+      fflush(stdout);
+      lastRequests      = requests;
+      lastNotifications = notifications;
+      lastReport        = now;
+    }
+  }
+
+  double elapsed                   = (millis() - startTime) / 1000.0;
+  uint64_t cpu                     = HostRuntime::cpuMicros() - startCpu;
+  DirConLatencyStats requests      = DirConManager::getRequestLatency();
+  DirConLatencyStats notifications = DirConManager::getNotifyFanout();
+  uint64_t messages                = (uint64_t)requests.count + notifications.count;
+
+  DirConManager::stopCapture();
+  if (capturePath != nullptr) {
+    FILE* file = fopen(capturePath, "wb");
+    if (file == nullptr) {
+      perror(capturePath);
+    } else {
+      FilePrint out(file);
+      printf("capture        %zu bytes written to %s\n", DirConManager::exportCapture(out), capturePath);
+      fclose(file);
+    }
+  }
+  DirConManager::stop();
+
+  printf("\n%.1f s, %lu bytes sent in %lu writes\n", elapsed, (unsigned long)DirConManager::getFlushedBytes(), (unsigned long)DirConManager::getFlushCount());
+  printf("requests       %lu (%.1f/s), latency avg %lu us, max %lu us\n", (unsigned long)requests.count, requests.count / elapsed,
+         (unsigned long)requests.averageMicros(), (unsigned long)requests.maxMicros);
+  printf("notifications  %lu (%.1f/s)\n", (unsigned long)notifications.count, notifications.count / elapsed);
+  printf("server CPU     %.1f%% of a core, %.2f us per request or notification\n", cpu / elapsed / 1e4, messages ? (double)cpu / messages : 0.0);
+  return 0;
+}
+
+#endif  // ARDUINO
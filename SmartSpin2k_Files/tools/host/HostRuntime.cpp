@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+// Host implementation of the Arduino, FreeRTOS and firmware globals the DirCon and BLE server sources
+// use. Tasks are detached threads with a notification counter each; mutexes are std::recursive_timed_mutex.
+
+#ifndef ARDUINO
+
+#include "HostRuntime.h"
+#include "Main.h"
+#include "BLE_Common.h"
+#include "BLE_Fitness_Machine_Service.h"
+#include <ESPmDNS.h>
+#include <WiFi.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <sys/resource.h>
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+MDNSResponder MDNS;
+
+static RuntimeParameters runtimeParameters;
+static userParameters userParameterValues;
+static SS2K ss2kState;
+RuntimeParameters* rtConfig = &runtimeParameters;
+userParameters* userConfig  = &userParameterValues;
+SS2K* ss2k                  = &ss2kState;
+
+static bool tasksEnabled   = true;
+static bool loggingEnabled = false;
+
+void HostRuntime::setTasks(bool enabled) { tasksEnabled = enabled; }
+void HostRuntime::setLogging(bool enabled) { loggingEnabled = enabled; }
+
+uint64_t HostRuntime::cpuMicros() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Time
+
+static const std::chrono::steady_clock::time_point bootTime = std::chrono::steady_clock::now();
+
+unsigned long micros() {
+  // Wraps at 32 bits like the ESP32's
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+unsigned long millis() { return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - bootTime).count(); }
+
+void delay(unsigned long ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+// Logging
+
+int HardwareSerial::printf(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int written = vprintf(format, args);
+  va_end(args);
+  return written;
+}
+
+void ss2k_log_write(const char* tag, const char* format, ...) {
+  if (!loggingEnabled) {
+    return;
+  }
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  printf("%8lu [%s] %s\n", millis(), tag, line);
+}
+
+int ss2k_log_hex_to_buffer(const byte* data, const size_t data_length, char* buffer, const int buffer_offset, const size_t buffer_length) {
+  int written = 0;
+  for (size_t i = 0; i < data_length; i++) {
+    int result = snprintf(buffer + buffer_offset + written, buffer_length - buffer_offset - written, "%02x ", data[i]);
+    if (result < 0 || (size_t)(buffer_offset + written + result) >= buffer_length) {
+      break;
+    }
+    written += result;
+  }
+  return written;
+}
+
+// Tasks
+
+namespace {
+struct HostTask {
+  std::mutex lock;
+  std::condition_variable wake;
+  uint32_t notifications = 0;
+};
+
+thread_local HostTask* currentTask = nullptr;
+}  // namespace
+
+static HostTask* getCurrentTask() {
+  // Threads the host program started itself, main included, get one the first time they ask
+  if (currentTask == nullptr) {
+    currentTask = new HostTask();
+  }
+  return currentTask;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char* name, uint32_t stackDepth, void* parameter, UBaseType_t priority, TaskHandle_t* handle) {
+  if (!tasksEnabled) {
+    return pdFAIL;
+  }
+  // Never freed, a handle may still be notified after its task has ended
+  HostTask* hostTask = new HostTask();
+  if (handle != nullptr) {
+    *handle = hostTask;
+  }
+  std::thread([task, parameter, hostTask]() {
+    currentTask = hostTask;
+    task(parameter);
+  }).detach();
+  return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stackDepth, void* parameter, UBaseType_t priority, TaskHandle_t* handle,
+                                   BaseType_t core) {
+  return xTaskCreate(task, name, stackDepth, parameter, priority, handle);
+}
+
+// Only ever called by a task on itself as its last statement, returning ends the thread
+void vTaskDelete(TaskHandle_t task) {}
+
+void vTaskDelay(TickType_t ticks) { std::this_thread::sleep_for(std::chrono::milliseconds(ticks)); }
+
+TickType_t xTaskGetTickCount() { return millis(); }
+
+TaskHandle_t xTaskGetCurrentTaskHandle() { return getCurrentTask(); }
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+  HostTask* task = getCurrentTask();
+  std::unique_lock<std::mutex> lock(task->lock);
+  auto notified  = [task]() { return task->notifications > 0; };
+  if (ticks == portMAX_DELAY) {
+    task->wake.wait(lock, notified);
+  } else {
+    task->wake.wait_for(lock, std::chrono::milliseconds(ticks), notified);
+  }
+  uint32_t value = task->notifications;
+  if (value > 0) {
+    task->notifications = clearOnExit ? 0 : value - 1;
+  }
+  return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t handle) {
+  HostTask* task = (HostTask*)handle;
+  {
+    std::lock_guard<std::mutex> lock(task->lock);
+    task->notifications++;
+  }
+  task->wake.notify_one();
+  return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return new std::recursive_timed_mutex(); }
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks) {
+  std::recursive_timed_mutex* hostMutex = (std::recursive_timed_mutex*)mutex;
+  if (ticks == portMAX_DELAY) {
+    hostMutex->lock();
+    return pdTRUE;
+  }
+  return hostMutex->try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex) {
+  ((std::recursive_timed_mutex*)mutex)->unlock();
+  return pdTRUE;
+}
+
+// Simulated trainer
+
+void HostRuntime::simulateTrainer() {
+  static unsigned long lastUpdate = millis();
+  static double power             = 150;
+  unsigned long now               = millis();
+  double seconds                  = now / 1000.0;
+  if (now - lastUpdate < 100) {
+    return;
+  }
+  lastUpdate = now;
+
+  // ERG holds the target, otherwise the grade sets the effort
+  double target;
+  if (rtConfig->getFTMSMode() == FitnessMachineControlPointProcedure::SetTargetPower && rtConfig->watts.getTarget() > 0) {
+    target = rtConfig->watts.getTarget();
+  } else {
+    target = 150 + rtConfig->getTargetIncline() / 100.0 * 25 + 20 * sin(seconds / 7);
+  }
+  power += (target - power) * 0.2;
+  rtConfig->watts.setValue((int)lround(power + 3 * sin(seconds * 3)));
+  rtConfig->cad.setValue((int)lround(90 + 4 * sin(seconds / 5)));
+  rtConfig->hr.setValue((int)lround(110 + power / 5 + 2 * sin(seconds / 11)));
+
+  // The stepper moves towards the incline target
+  int32_t position = ss2k->getCurrentPosition();
+  int32_t goal     = (int32_t)(rtConfig->getTargetIncline() * 10);
+  ss2k->setCurrentPosition(position + (goal - position) / 4);
+}
+
+#endif  // ARDUINO
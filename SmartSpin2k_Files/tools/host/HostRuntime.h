@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Controls for the host build of the DirCon and BLE server sources, see CMakeLists.txt
+
+#include <Arduino.h>
+
+namespace HostRuntime {
+
+// xTaskCreate() runs each task on its own thread, the default. With tasks off it fails instead, so
+// DirConManager services its sockets from update() on the caller's thread, which makes a run
+// repeatable.
+void setTasks(bool enabled);
+
+// SS2K_LOG lines go to stdout, off by default
+void setLogging(bool enabled);
+
+// The port the next WiFiServer::begin() listens on instead of the one the firmware asks for, 0 for
+// any free port, -1 for the firmware's again
+void setListenPort(int port);
+// The port the last WiFiServer::begin() is listening on
+uint16_t getListenPort();
+
+// The bike: power follows an ERG target or the sim grade, cadence and heart rate wander around a
+// steady ride and the stepper follows the incline. Call once per BLE server tick, before update().
+void simulateTrainer();
+
+// CPU time this process has used, user and system
+uint64_t cpuMicros();
+
+}  // namespace HostRuntime
+
+// Writes a capture or anything else printed to it into a file
+class FilePrint : public Print {
+ public:
+  explicit FilePrint(FILE* file) : file(file) {}
+  size_t write(const uint8_t* buffer, size_t size) override { return fwrite(buffer, 1, size, file); }
+
+ private:
+  FILE* file;
+};
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+// Host stand-ins for the BLE services and client whose sources aren't part of the host build. The
+// measurement services encode the tick's snapshot and publish it through the NotificationHub, so
+// DirCon clients get heart rate, cycling power and CSC notifications as well as FTMS ones.
+
+#ifndef ARDUINO
+
+#include "BLE_Common.h"
+#include "BLE_Custom_Characteristic.h"
+#include "BLE_Cycling_Power_Service.h"
+#include "BLE_Cycling_Speed_Cadence.h"
+#include "BLE_Heart_Service.h"
+#include "BLE_Handle_Table.h"
+#include "DirConManager.h"
+#include "NotificationHub.h"
+
+SpinBLEClient spinBLEClient;
+
+void SpinBLEClient::FTMSControlPointWrite(const uint8_t* pData, int length) {}
+
+void SpinBLEAdvertisedDevice::clearState(bool resetAdvertisedDevice) {}
+
+void BLEFirmwareSetup(NimBLEServer* pServer) {}
+
+static NimBLECharacteristic* createMeasurement(NimBLEServer* pServer, const NimBLEUUID& serviceUuid, const NimBLEUUID& characteristicUuid,
+                                               MyCharacteristicCallbacks* chrCallbacks) {
+  NimBLEService* service               = pServer->createService(serviceUuid);
+  NimBLECharacteristic* characteristic = service->createCharacteristic(characteristicUuid, NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY);
+  characteristic->setCallbacks(chrCallbacks);
+  service->start();
+  return characteristic;
+}
+
+void BLE_Heart_Service::setupService(NimBLEServer* pServer, MyCharacteristicCallbacks* chrCallbacks) {
+  heartRateMeasurementCharacteristic = createMeasurement(pServer, HEARTSERVICE_UUID, HEARTCHARACTERISTIC_UUID, chrCallbacks);
+}
+
+void BLE_Heart_Service::update() {
+  const SpinBLESnapshot& snapshot = spinBLEServer.getSnapshot();
+  uint8_t heartRateMeasurement[2] = {0x00, (uint8_t)snapshot.heartRate};
+  NotificationHub::publish(NotificationHubCharacteristic::HeartRateMeasurement, heartRateMeasurement, sizeof(heartRateMeasurement));
+}
+
+void BLE_Cycling_Power_Service::setupService(NimBLEServer* pServer, MyCharacteristicCallbacks* chrCallbacks) {
+  cyclingPowerMeasurementCharacteristic = createMeasurement(pServer, CYCLINGPOWERSERVICE_UUID, CYCLINGPOWERMEASUREMENT_UUID, chrCallbacks);
+}
+
+void BLE_Cycling_Power_Service::update() {
+  const SpinBLESnapshot& snapshot = spinBLEServer.getSnapshot();
+  // Crank revolution data present
+  uint16_t crankRevolutions     = snapshot.crankRevolutions;
+  uint16_t lastCrankEventTime   = (uint16_t)snapshot.lastCrankEventTime;
+  uint8_t cyclingPowerMeasurement[8] = {0x20,
+                                        0x00,
+                                        (uint8_t)(snapshot.power & 0xff),
+                                        (uint8_t)(snapshot.power >> 8),
+                                        (uint8_t)(crankRevolutions & 0xff),
+                                        (uint8_t)(crankRevolutions >> 8),
+                                        (uint8_t)(lastCrankEventTime & 0xff),
+                                        (uint8_t)(lastCrankEventTime >> 8)};
+  NotificationHub::publish(NotificationHubCharacteristic::CyclingPowerMeasurement, cyclingPowerMeasurement, sizeof(cyclingPowerMeasurement));
+}
+
+void BLE_Cycling_Speed_Cadence::setupService(NimBLEServer* pServer, MyCharacteristicCallbacks* chrCallbacks) {
+  cscMeasurementCharacteristic = createMeasurement(pServer, CSCSERVICE_UUID, CSCMEASUREMENT_UUID, chrCallbacks);
+}
+
+void BLE_Cycling_Speed_Cadence::update() {
+  const SpinBLESnapshot& snapshot = spinBLEServer.getSnapshot();
+  // Wheel and crank revolution data present
+  uint32_t wheelRevolutions   = snapshot.wheelRevolutions;
+  uint16_t lastWheelEventTime = (uint16_t)(snapshot.lastWheelEventTime);
+  uint16_t crankRevolutions   = snapshot.crankRevolutions;
+  uint16_t lastCrankEventTime = (uint16_t)snapshot.lastCrankEventTime;
+  uint8_t cscMeasurement[11]  = {0x03,
+                                 (uint8_t)(wheelRevolutions & 0xff),
+                                 (uint8_t)(wheelRevolutions >> 8),
+                                 (uint8_t)(wheelRevolutions >> 16),
+                                 (uint8_t)(wheelRevolutions >> 24),
+                                 (uint8_t)(lastWheelEventTime & 0xff),
+                                 (uint8_t)(lastWheelEventTime >> 8),
+                                 (uint8_t)(crankRevolutions & 0xff),
+                                 (uint8_t)(crankRevolutions >> 8),
+                                 (uint8_t)(lastCrankEventTime & 0xff),
+                                 (uint8_t)(lastCrankEventTime >> 8)};
+  NotificationHub::publish(NotificationHubCharacteristic::CSCMeasurement, cscMeasurement, sizeof(cscMeasurement));
+}
+
+void BLE_ss2kCustomCharacteristic::setupService(NimBLEServer* pServer) {
+  pSmartSpin2kService       = pServer->createService(SMARTSPIN2K_SERVICE_UUID);
+  smartSpin2kCharacteristic = pSmartSpin2kService->createCharacteristic(SMARTSPIN2K_CHARACTERISTIC_UUID,
+                                                                        NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::INDICATE | NIMBLE_PROPERTY::NOTIFY);
+  smartSpin2kCharacteristic->setValue(ss2kCustomCharacteristicValue, sizeof(ss2kCustomCharacteristicValue));
+  DirConManager::setupDiagnosticsCharacteristic(pSmartSpin2kService);
+  pSmartSpin2kService->start();
+  BLEHandleTable::registerService(BLEHandle::SmartSpin2kService, pSmartSpin2kService);
+  BLEHandleTable::registerCharacteristic(BLEHandle::SmartSpin2kCharacteristic, smartSpin2kCharacteristic);
+}
+
+#endif  // ARDUINO
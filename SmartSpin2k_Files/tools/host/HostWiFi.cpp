@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+// WiFiClient and WiFiServer on POSIX sockets, see shim/WiFi.h
+
+#ifndef ARDUINO
+
+#include "HostRuntime.h"
+#include <WiFi.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int listenPortOverride = -1;
+static uint16_t boundPort     = 0;
+
+void HostRuntime::setListenPort(int port) { listenPortOverride = port; }
+uint16_t HostRuntime::getListenPort() { return boundPort; }
+
+String IPAddress::toString() const {
+  char text[INET_ADDRSTRLEN];
+  struct in_addr in;
+  in.s_addr = address;
+  inet_ntop(AF_INET, &in, text, sizeof(text));
+  return text;
+}
+
+// Closed when the last WiFiClient copy goes, or by stop()
+struct WiFiClient::Socket {
+  explicit Socket(int fd) : fd(fd) {}
+  ~Socket() { close(); }
+  void close() {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+  int fd;
+};
+
+WiFiClient::WiFiClient(int fd) : socket(std::make_shared<Socket>(fd)) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); }
+
+int WiFiClient::fd() const { return socket ? socket->fd : -1; }
+
+uint8_t WiFiClient::connected() {
+  if (fd() < 0) {
+    return 0;
+  }
+  // Still connected while there is data to read or a read would block, like the ESP32 client
+  uint8_t peek;
+  ssize_t result = recv(fd(), &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (result > 0 || (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))) {
+    return 1;
+  }
+  socket->close();
+  return 0;
+}
+
+int WiFiClient::available() {
+  int count = 0;
+  if (fd() < 0 || ioctl(fd(), FIONREAD, &count) < 0) {
+    return 0;
+  }
+  return count;
+}
+
+int WiFiClient::read() {
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t size) {
+  if (fd() < 0) {
+    return -1;
+  }
+  ssize_t result = recv(fd(), buffer, size, MSG_DONTWAIT);
+  return result < 0 ? -1 : (int)result;
+}
+
+size_t WiFiClient::write(const uint8_t* buffer, size_t size) {
+  if (fd() < 0) {
+    return 0;
+  }
+  ssize_t result = send(fd(), buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (result < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      socket->close();
+    }
+    return 0;
+  }
+  return (size_t)result;
+}
+
+void WiFiClient::stop() {
+  if (socket) {
+    socket->close();
+  }
+}
+
+IPAddress WiFiClient::remoteIP() const {
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  if (fd() < 0 || getpeername(fd(), (struct sockaddr*)&address, &length) < 0 || address.sin_family != AF_INET) {
+    return IPAddress();
+  }
+  return IPAddress(address.sin_addr.s_addr);
+}
+
+void WiFiClient::setNoDelay(bool noDelay) {
+  int enable = noDelay ? 1 : 0;
+  if (fd() >= 0) {
+    setsockopt(fd(), IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  }
+}
+
+void WiFiServer::begin() {
+  close();
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenFd < 0) {
+    perror("socket");
+    return;
+  }
+  int enable = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+  struct sockaddr_in address = {};
+  address.sin_family         = AF_INET;
+  address.sin_addr.s_addr    = htonl(INADDR_ANY);
+  address.sin_port           = htons(listenPortOverride >= 0 ? listenPortOverride : port);
+  if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listenFd, 8) < 0) {
+    perror("bind");
+    ::close(listenFd);
+    listenFd = -1;
+    return;
+  }
+  fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+
+  socklen_t length = sizeof(address);
+  getsockname(listenFd, (struct sockaddr*)&address, &length);
+  boundPort = ntohs(address.sin_port);
+}
+
+bool WiFiServer::hasClient() {
+  if (acceptedFd < 0 && listenFd >= 0) {
+    acceptedFd = ::accept(listenFd, nullptr, nullptr);
+  }
+  return acceptedFd >= 0;
+}
+
+WiFiClient WiFiServer::accept() {
+  if (!hasClient()) {
+    return WiFiClient();
+  }
+  WiFiClient client(acceptedFd);
+  acceptedFd = -1;
+  return client;
+}
+
+void WiFiServer::close() {
+  if (acceptedFd >= 0) {
+    ::close(acceptedFd);
+    acceptedFd = -1;
+  }
+  if (listenFd >= 0) {
+    ::close(listenFd);
+    listenFd = -1;
+  }
+}
+
+#endif  // ARDUINO
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Request latency of the DirCon server polling and event driven (DIRCON_EVENT_DRIVEN), side by side.
+# Runs the same load against each build in turn and prints what the load generator measured from the
+# client side, and what the server measured itself. Fails if either run got no response.
+#
+#   dircon-latency.sh <dircon-server> <dircon-server-event> <dircon-loadgen> [port]
+
+if [ $# -lt 3 ]; then
+  echo "usage: $0 <dircon-server> <dircon-server-event> <dircon-loadgen> [port]" >&2
+  exit 2
+fi
+LOADGEN=$3
+PORT=${4:-18082}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+status=0
+for mode in poll event; do
+  if [ $mode = poll ]; then server=$1; else server=$2; fi
+  "$server" -p "$PORT" -d 4 > "$OUT/$mode.server" 2>&1 &
+  sleep 1
+  "$LOADGEN" 127.0.0.1 -p "$PORT" -c 2 -d 2 -r 20 > "$OUT/$mode.loadgen" 2>&1 || status=1
+  wait
+done
+
+printf "%-6s  %-44s  %s\n" mode "client round trip (load generator)" "server, arrival to response"
+for mode in poll event; do
+  client=$(grep '^latency' "$OUT/$mode.loadgen" | sed 's/^latency *//')
+  server=$(grep '^requests' "$OUT/$mode.server" | sed 's/.*latency //')
+  printf "%-6s  %-44s  %s\n" $mode "${client:-none}" "${server:-none}"
+done
+exit $status
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in for the parts of Arduino-ESP32 and FreeRTOS the DirCon and BLE server sources use.
+// Tasks are threads, see HostRuntime.cpp.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+class String : public std::string {
+ public:
+  String() {}
+  String(const char* s) : std::string(s != nullptr ? s : "") {}
+  String(const std::string& s) : std::string(s) {}
+  explicit String(int value) : std::string(std::to_string(value)) {}
+  explicit String(unsigned value) : std::string(std::to_string(value)) {}
+  explicit String(long value) : std::string(std::to_string(value)) {}
+  explicit String(unsigned long value) : std::string(std::to_string(value)) {}
+  explicit String(double value) : std::string(std::to_string(value)) {}
+
+  String& remove(size_t index, size_t count) {
+    erase(index, count);
+    return *this;
+  }
+  String operator+(const String& other) const { return String(std::string(*this) + std::string(other)); }
+  String operator+(const char* other) const { return String(std::string(*this) + other); }
+  friend String operator+(const char* a, const String& b) { return String(std::string(a) + std::string(b)); }
+  String& operator+=(const char* other) {
+    append(other);
+    return *this;
+  }
+  String& operator+=(const String& other) {
+    append(other);
+    return *this;
+  }
+  String& operator+=(int value) {
+    append(std::to_string(value));
+    return *this;
+  }
+  String& operator+=(unsigned value) {
+    append(std::to_string(value));
+    return *this;
+  }
+  String& operator+=(char c) {
+    push_back(c);
+    return *this;
+  }
+};
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+  size_t write(uint8_t b) { return write(&b, 1); }
+};
+
+class HardwareSerial : public Print {
+ public:
+  size_t write(const uint8_t* buffer, size_t size) override { return fwrite(buffer, 1, size, stdout); }
+  void print(const char* s) { fputs(s, stdout); }
+  void print(const String& s) { fputs(s.c_str(), stdout); }
+  void print(size_t value) { printf("%zu", value); }
+  void println() { fputs("\n", stdout); }
+  void println(const char* s) { printf("%s\n", s); }
+  int printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+extern HardwareSerial Serial;
+
+class IPAddress {
+ public:
+  IPAddress() {}
+  explicit IPAddress(uint32_t address) : address(address) {}  // network byte order
+  bool operator==(const IPAddress& other) const { return address == other.address; }
+  operator uint32_t() const { return address; }
+  String toString() const;
+
+ private:
+  uint32_t address = 0;
+};
+
+struct EspClass {
+  uint32_t getFreeHeap() { return 0; }
+  uint32_t getMaxAllocHeap() { return 0; }
+  uint32_t getPsramSize() { return 0; }
+};
+extern EspClass ESP;
+
+inline bool psramFound() { return false; }
+inline void* ps_malloc(size_t size) { return malloc(size); }
+
+// FreeRTOS
+typedef void* TaskHandle_t;
+typedef void* QueueHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void (*TaskFunction_t)(void*);
+
+#define pdTRUE             1
+#define pdFALSE            0
+#define pdPASS             1
+#define pdFAIL             0
+#define portMAX_DELAY      0xffffffffUL
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
+#define tskNO_AFFINITY     0x7fffffff
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char* name, uint32_t stackDepth, void* parameter, UBaseType_t priority, TaskHandle_t* handle);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stackDepth, void* parameter, UBaseType_t priority, TaskHandle_t* handle,
+                                   BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+TaskHandle_t xTaskGetCurrentTaskHandle();
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 0; }
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex);
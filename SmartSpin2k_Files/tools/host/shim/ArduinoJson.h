@@ -0,0 +1,10 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Included by BLE_Server.cpp, nothing the host build compiles uses it
@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in for the SmartSpin2k custom characteristic. setupService() creates the service and the
+// DirCon diagnostics characteristic like the firmware does; writes to the custom characteristic itself
+// aren't acted on.
+
+#include "BLE_Common.h"
+
+class BLE_ss2kCustomCharacteristic {
+ public:
+  void setupService(NimBLEServer* pServer);
+  void update() {}
+
+  NimBLEService* pSmartSpin2kService                = nullptr;
+  NimBLECharacteristic* smartSpin2kCharacteristic   = nullptr;
+  uint8_t ss2kCustomCharacteristicValue[3]          = {0x77, 0x77, 0x77};
+};
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in for the cycling speed and cadence service, see HostServices.cpp
+
+#include "BLE_Common.h"
+
+class BLE_Cycling_Speed_Cadence {
+ public:
+  void setupService(NimBLEServer* pServer, MyCharacteristicCallbacks* chrCallbacks);
+  void update();
+
+ private:
+  NimBLECharacteristic* cscMeasurementCharacteristic = nullptr;
+};
@@ -0,0 +1,17 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in, the device information service isn't set up
+
+#include "BLE_Common.h"
+
+class BLE_Device_Information_Service {
+ public:
+  void setupService(NimBLEServer* pServer) {}
+};
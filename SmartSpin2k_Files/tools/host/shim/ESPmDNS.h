@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in, nothing is announced. Connect to the host's address directly.
+
+#include <Arduino.h>
+
+class MDNSResponder {
+ public:
+  bool addService(const char* service, const char* protocol, uint16_t port) { return true; }
+  bool addServiceTxt(const char* service, const char* protocol, const char* key, const char* value) { return true; }
+};
+extern MDNSResponder MDNS;
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in for the firmware's runtime state, reduced to what the BLE server and DirCon sources
+// use. The simulated trainer in HostRuntime.cpp plays the part of the bike.
+
+#include <Arduino.h>
+#include "settings.h"
+#include "SS2KLog.h"
+
+class Measurement {
+ public:
+  int getValue() const { return value; }
+  void setValue(int newValue) {
+    value     = newValue;
+    timestamp = millis();
+  }
+  int getTarget() const { return target; }
+  void setTarget(int newTarget) { target = newTarget; }
+  bool getSimulate() const { return simulate; }
+  void setSimulate(bool newSimulate) { simulate = newSimulate; }
+  unsigned long getTimestamp() const { return timestamp; }
+
+ private:
+  int value               = 0;
+  int target              = 0;
+  bool simulate           = false;
+  unsigned long timestamp = 0;
+};
+
+class RuntimeParameters {
+ public:
+  Measurement watts;
+  Measurement hr;
+  Measurement resistance;
+  Measurement cad;
+  Measurement batt;
+
+  float getSimulatedSpeed() { return simulatedSpeed; }
+  void setSimulatedSpeed(float speed) { simulatedSpeed = speed; }
+  void setFTMSMode(uint8_t mode) { ftmsMode = mode; }
+  uint8_t getFTMSMode() { return ftmsMode; }
+  void setTargetIncline(float incline) { targetIncline = incline; }
+  float getTargetIncline() { return targetIncline; }
+  void setTargetCadence(float cadence) { targetCadence = cadence; }
+  float getTargetCadence() { return targetCadence; }
+  void setSimTargetWatts(bool simulate) { simTargetWatts = simulate; }
+  bool getSimTargetWatts() { return simTargetWatts; }
+  int getMinResistance() { return minResistance; }
+  void setMinResistance(int resistance) { minResistance = resistance; }
+  int getMaxResistance() { return maxResistance; }
+  void setMaxResistance(int resistance) { maxResistance = resistance; }
+  int32_t getMinStep() { return minStep; }
+  void setMinStep(int32_t step) { minStep = step; }
+  int32_t getMaxStep() { return maxStep; }
+  void setMaxStep(int32_t step) { maxStep = step; }
+
+ private:
+  float simulatedSpeed = 0;
+  uint8_t ftmsMode     = 0;
+  float targetIncline  = 0;
+  float targetCadence  = 0;
+  bool simTargetWatts  = false;
+  int minResistance    = 0;
+  int maxResistance    = 100;
+  int32_t minStep      = -200000;
+  int32_t maxStep      = 200000;
+};
+
+class userParameters {
+ public:
+  const char* getConnectedHeartMonitor() { return "none"; }
+  int32_t getHMin() { return INT32_MIN; }
+  int32_t getHMax() { return INT32_MIN; }
+  float getPowerCorrectionFactor() { return 1; }
+  const char* getDeviceName() { return "SmartSpin2k"; }
+};
+
+class SS2K {
+ public:
+  int32_t getCurrentPosition() { return currentPosition; }
+  void setCurrentPosition(int32_t position) { currentPosition = position; }
+  bool isUpdating = false;
+  bool rebootFlag = false;
+
+ private:
+  int32_t currentPosition = 0;
+};
+
+extern RuntimeParameters* rtConfig;
+extern userParameters* userConfig;
+extern SS2K* ss2k;
+
+// As in the firmware, after the runtime classes it depends on
+#include "BLE_Common.h"
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in for the NimBLE-Arduino server classes. Services and characteristics hold their values
+// like the real ones; there is no radio, so notify() and indicate() go nowhere.
+
+#include <Arduino.h>
+#include <NimBLEUUID.h>
+
+#define BLE_HS_CONN_HANDLE_NONE          0xffff
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 9
+
+namespace NIMBLE_PROPERTY {
+enum { BROADCAST = 0x01, READ = 0x02, WRITE_NR = 0x04, WRITE = 0x08, NOTIFY = 0x10, INDICATE = 0x20 };
+}
+
+class NimBLEAttValue : public std::vector<uint8_t> {
+ public:
+  NimBLEAttValue() {}
+  NimBLEAttValue(const uint8_t* data, size_t length) : std::vector<uint8_t>(data, data + length) {}
+  NimBLEAttValue(const std::vector<uint8_t>& value) : std::vector<uint8_t>(value) {}
+  NimBLEAttValue(const std::string& value) : std::vector<uint8_t>(value.begin(), value.end()) {}
+  operator std::string() const { return std::string(begin(), end()); }
+  size_t length() const { return size(); }
+};
+
+class NimBLEAddress {
+ public:
+  NimBLEAddress() {}
+  NimBLEAddress(const char*, int) {}
+  std::string toString() const { return "00:00:00:00:00:00"; }
+};
+
+class NimBLEConnInfo {
+ public:
+  NimBLEAddress getAddress() const { return NimBLEAddress(); }
+  uint16_t getConnHandle() const { return connHandle; }
+  uint16_t connHandle = 0;
+};
+
+class NimBLECharacteristic;
+class NimBLEService;
+class NimBLEServer;
+
+class NimBLECharacteristicCallbacks {
+ public:
+  virtual ~NimBLECharacteristicCallbacks() {}
+  virtual void onRead(NimBLECharacteristic* characteristic, NimBLEConnInfo& connInfo) {}
+  virtual void onWrite(NimBLECharacteristic* characteristic, NimBLEConnInfo& connInfo) {}
+  virtual void onStatus(NimBLECharacteristic* characteristic, int code) {}
+  virtual void onSubscribe(NimBLECharacteristic* characteristic, NimBLEConnInfo& connInfo, uint16_t subValue) {}
+};
+
+class NimBLECharacteristic {
+ public:
+  NimBLECharacteristic(const NimBLEUUID& uuid, uint16_t properties, NimBLEService* service) : uuid(uuid), properties(properties), service(service) {}
+
+  const NimBLEUUID& getUUID() const { return uuid; }
+  uint16_t getProperties() const { return properties; }
+  NimBLEService* getService() const { return service; }
+
+  void setValue(const uint8_t* data, size_t length) { value = NimBLEAttValue(data, length); }
+  void setValue(const std::vector<uint8_t>& newValue) { value = newValue; }
+  void setValue(const NimBLEAttValue& newValue) { value = newValue; }
+  void setValue(const std::string& newValue) { value = NimBLEAttValue(newValue); }
+  NimBLEAttValue getValue() const { return value; }
+
+  bool notify(uint16_t connHandle = BLE_HS_CONN_HANDLE_NONE) const { return true; }
+  bool notify(const uint8_t* data, size_t length, uint16_t connHandle = BLE_HS_CONN_HANDLE_NONE) const { return true; }
+  bool indicate(uint16_t connHandle = BLE_HS_CONN_HANDLE_NONE) const { return true; }
+
+  void setCallbacks(NimBLECharacteristicCallbacks* newCallbacks) { callbacks = newCallbacks; }
+  NimBLECharacteristicCallbacks* getCallbacks() const { return callbacks; }
+
+ private:
+  NimBLEUUID uuid;
+  uint16_t properties;
+  NimBLEService* service;
+  NimBLEAttValue value;
+  NimBLECharacteristicCallbacks* callbacks = nullptr;
+};
+
+class NimBLEService {
+ public:
+  explicit NimBLEService(const NimBLEUUID& uuid) : uuid(uuid) {}
+
+  NimBLECharacteristic* createCharacteristic(const NimBLEUUID& characteristicUuid, uint16_t properties) {
+    NimBLECharacteristic* characteristic = new NimBLECharacteristic(characteristicUuid, properties, this);
+    characteristics.push_back(characteristic);
+    return characteristic;
+  }
+  NimBLECharacteristic* getCharacteristic(const NimBLEUUID& characteristicUuid, uint16_t instanceId = 0) const {
+    for (NimBLECharacteristic* characteristic : characteristics) {
+      if (characteristic->getUUID() == characteristicUuid) {
+        return characteristic;
+      }
+    }
+    return nullptr;
+  }
+  const std::vector<NimBLECharacteristic*>& getCharacteristics() const { return characteristics; }
+  const NimBLEUUID& getUUID() const { return uuid; }
+  bool start() { return true; }
+
+ private:
+  NimBLEUUID uuid;
+  std::vector<NimBLECharacteristic*> characteristics;
+};
+
+struct ble_gap_upd_params {};
+
+class NimBLEServerCallbacks {
+ public:
+  virtual ~NimBLEServerCallbacks() {}
+};
+
+class NimBLEServer {
+ public:
+  NimBLEService* createService(const NimBLEUUID& uuid) {
+    NimBLEService* service = new NimBLEService(uuid);
+    services.push_back(service);
+    return service;
+  }
+  NimBLEService* getServiceByUUID(const NimBLEUUID& uuid, uint16_t instanceId = 0) const {
+    for (NimBLEService* service : services) {
+      if (service->getUUID() == uuid) {
+        return service;
+      }
+    }
+    return nullptr;
+  }
+  void setCallbacks(NimBLEServerCallbacks* callbacks) {}
+  size_t getConnectedCount() const { return 0; }
+
+ private:
+  std::vector<NimBLEService*> services;
+};
+
+class NimBLEAdvertisementData {
+ public:
+  void setFlags(uint8_t) {}
+  void setCompleteServices(const NimBLEUUID&) {}
+  void setCompleteServices16(const std::vector<NimBLEUUID>&) {}
+};
+
+class NimBLEAdvertising {
+ public:
+  void enableScanResponse(bool) {}
+  void setAdvertisementData(const NimBLEAdvertisementData&) {}
+  void setScanResponseData(const NimBLEAdvertisementData&) {}
+  void setName(const char*) {}
+  void setMaxInterval(int) {}
+  void setMinInterval(int) {}
+  bool start() { return true; }
+};
+
+class NimBLEAdvertisedDevice {};
+class NimBLEClient {};
+class NimBLERemoteCharacteristic {};
+class NimBLEScanResults {};
+
+class NimBLEScanCallbacks {
+ public:
+  virtual ~NimBLEScanCallbacks() {}
+  virtual void onResult(const NimBLEAdvertisedDevice* advertisedDevice) {}
+  virtual void onScanEnd(const NimBLEScanResults& results, int reason) {}
+};
+
+class NimBLEClientCallbacks {
+ public:
+  virtual ~NimBLEClientCallbacks() {}
+  virtual void onConnect(NimBLEClient* client) {}
+  virtual void onDisconnect(NimBLEClient* client, int reason) {}
+};
+
+class NimBLEDevice {
+ public:
+  static NimBLEServer* createServer() {
+    static NimBLEServer server;
+    return &server;
+  }
+  static NimBLEServer* getServer() { return createServer(); }
+  static NimBLEAdvertising* getAdvertising() {
+    static NimBLEAdvertising advertising;
+    return &advertising;
+  }
+  static void startAdvertising() {}
+  static void stopAdvertising() {}
+  static void setMTU(uint16_t) {}
+};
+
+typedef NimBLEUUID BLEUUID;
+typedef NimBLEDevice BLEDevice;
+typedef NimBLEService BLEService;
+typedef NimBLECharacteristic BLECharacteristic;
+typedef NimBLEAdvertising BLEAdvertising;
+typedef NimBLERemoteCharacteristic BLERemoteCharacteristic;
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in for NimBLEUUID. Values are stored little endian, as NimBLE does.
+
+#include <Arduino.h>
+
+struct ble_uuid_t {
+  uint8_t type;
+};
+
+struct ble_uuid_any_t {
+  uint8_t type;
+  uint8_t value[16];
+};
+
+class NimBLEUUID {
+ public:
+  NimBLEUUID() { memset(&uuid, 0, sizeof(uuid)); }
+  NimBLEUUID(uint16_t value) {
+    memset(&uuid, 0, sizeof(uuid));
+    uuid.type     = 16;
+    uuid.value[0] = value & 0xff;
+    uuid.value[1] = value >> 8;
+  }
+  NimBLEUUID(const char* text) : NimBLEUUID(std::string(text)) {}
+  NimBLEUUID(const std::string& text) {
+    memset(&uuid, 0, sizeof(uuid));
+    std::string hex;
+    for (char c : text) {
+      if (c != '-') {
+        hex += c;
+      }
+    }
+    if (hex.size() == 4) {
+      *this = NimBLEUUID((uint16_t)strtoul(hex.c_str(), nullptr, 16));
+      return;
+    }
+    if (hex.size() != 32) {
+      return;
+    }
+    uuid.type = 128;
+    for (int i = 0; i < 16; i++) {
+      uuid.value[15 - i] = (uint8_t)strtoul(hex.substr(i * 2, 2).c_str(), nullptr, 16);
+    }
+  }
+  NimBLEUUID(const uint8_t* data, size_t length) {
+    memset(&uuid, 0, sizeof(uuid));
+    if (length == 2 || length == 4 || length == 16) {
+      uuid.type = length * 8;
+      memcpy(uuid.value, data, length);
+    }
+  }
+
+  uint8_t bitSize() const { return uuid.type; }
+  const uint8_t* getValue() const { return uuid.value; }
+  const ble_uuid_t* getBase() const { return (const ble_uuid_t*)&uuid; }
+
+  const NimBLEUUID& to128() {
+    if (uuid.type == 16) {
+      uint8_t full[16] = {0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, 0, 0, 0, 0};
+      full[12]         = uuid.value[0];
+      full[13]         = uuid.value[1];
+      memcpy(uuid.value, full, sizeof(full));
+      uuid.type = 128;
+    }
+    return *this;
+  }
+  const NimBLEUUID& to16() {
+    if (uuid.type == 128) {
+      uint8_t low  = uuid.value[12];
+      uint8_t high = uuid.value[13];
+      memset(uuid.value, 0, sizeof(uuid.value));
+      uuid.value[0] = low;
+      uuid.value[1] = high;
+      uuid.type     = 16;
+    }
+    return *this;
+  }
+  const NimBLEUUID& reverseByteOrder() {
+    std::reverse(uuid.value, uuid.value + uuid.type / 8);
+    return *this;
+  }
+
+  std::string toString() const {
+    char text[40];
+    if (uuid.type == 16) {
+      snprintf(text, sizeof(text), "0x%04x", uuid.value[0] | (uuid.value[1] << 8));
+      return text;
+    }
+    std::string result;
+    for (int i = 15; i >= 0; i--) {
+      snprintf(text, sizeof(text), "%02x", uuid.value[i]);
+      result += text;
+      if (i == 12 || i == 10 || i == 8 || i == 6) {
+        result += '-';
+      }
+    }
+    return result;
+  }
+  operator std::string() const { return toString(); }
+
+  bool equals(const NimBLEUUID& other) const { return *this == other; }
+  bool operator==(const NimBLEUUID& other) const {
+    NimBLEUUID a(*this);
+    NimBLEUUID b(other);
+    a.to128();
+    b.to128();
+    return memcmp(a.uuid.value, b.uuid.value, sizeof(uuid.value)) == 0;
+  }
+  bool operator!=(const NimBLEUUID& other) const { return !(*this == other); }
+
+ private:
+  ble_uuid_any_t uuid;
+};
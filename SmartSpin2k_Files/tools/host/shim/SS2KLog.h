@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in. Log lines go to stdout while HostRuntime::setLogging() has them on.
+
+#include <Arduino.h>
+
+void ss2k_log_write(const char* tag, const char* format, ...) __attribute__((format(printf, 2, 3)));
+int ss2k_log_hex_to_buffer(const byte* data, const size_t data_length, char* buffer, const int buffer_offset, const size_t buffer_length);
+
+#define SS2K_LOG(tag, format, ...)  ss2k_log_write(tag, format, ##__VA_ARGS__)
+#define SS2K_LOGW(tag, format, ...) ss2k_log_write(tag, format, ##__VA_ARGS__)
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in for the Arduino-ESP32 WiFiClient and WiFiServer on POSIX sockets. Like the ESP32
+// classes, copies of a WiFiClient share one socket, and reads and accepts never block. Writes don't
+// block either, a full socket buffer shows up as a short write.
+
+#include <Arduino.h>
+#include <memory>
+
+class WiFiClient {
+ public:
+  WiFiClient() {}
+  explicit WiFiClient(int fd);
+
+  uint8_t connected();
+  int available();
+  int read();
+  int read(uint8_t* buffer, size_t size);
+  size_t write(const uint8_t* buffer, size_t size);
+  size_t write(uint8_t b) { return write(&b, 1); }
+  void stop();
+  IPAddress remoteIP() const;
+  int fd() const;
+  void setNoDelay(bool noDelay);
+  explicit operator bool() const { return fd() >= 0; }
+
+ private:
+  struct Socket;
+  std::shared_ptr<Socket> socket;
+};
+
+class WiFiServer {
+ public:
+  explicit WiFiServer(uint16_t port, uint8_t maxClients = 4) : port(port) {}
+  ~WiFiServer() { close(); }
+  void begin();
+  bool hasClient();
+  WiFiClient accept();
+  void close();
+  void end() { close(); }
+  void setNoDelay(bool) {}
+
+ private:
+  uint16_t port;
+  int listenFd = -1;
+  int acceptedFd = -1;  // taken by hasClient(), handed over by accept()
+};
+
+struct WiFiClass {
+  String macAddress() { return "02:00:00:00:00:01"; }
+};
+extern WiFiClass WiFi;
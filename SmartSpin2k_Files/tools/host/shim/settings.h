@@ -0,0 +1,20 @@
+/*
+ * Copyright (C) 2020  Anthony Doud & Joel Baranick
+ * All rights reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+// Host stand-in, the firmware settings the host build needs
+
+#define FIRMWARE_VERSION "host"
+#define NONE             "none"
+
+#define NUM_BLE_DEVICES       5
+#define DEFAULT_SCAN_DURATION 5
+
+#ifndef DIRCON_MANAGER_DELAY
+#define DIRCON_MANAGER_DELAY 50
+#endif